@@ -35,14 +35,28 @@
 extern "C" {
 #endif
 
+/* A publisher pushes the recorder's tagged JSON document to an HTTP
+ * endpoint from its own thread, once per period (10s by default).  The
+ * document is serialized into a buffer reused across pushes, gzip
+ * compressed when built with zlib, and sent with PUT over a kept-alive
+ * connection.  Failed pushes (network errors, 408, 429 and 5xx) are retried
+ * a few times with exponential backoff; ticks missed meanwhile are skipped.
+ * Metric writers are never made to wait on the network.
+ */
 typedef struct stats_publisher stats_publisher_t;
 
 stats_publisher_t *
   stats_publisher_alloc(stats_recorder_t *);
 
+/* Stops the publishing thread; free the publisher before its recorder. */
+void
+  stats_publisher_free(stats_publisher_t *);
+
+/* Sent as X-Circonus-Auth-Token; NULL sends none. */
 bool
   stats_publisher_set_apitoken(stats_publisher_t *, const char *);
 
+/* http://host[:port]/path; nothing is pushed until this is set. */
 bool
   stats_publisher_set_apiurl(stats_publisher_t *, const char *);
 
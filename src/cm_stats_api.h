@@ -33,6 +33,8 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 #include <cm_units.h>
 
 #ifdef __cplusplus
@@ -52,9 +54,18 @@ typedef enum stats_type_t {
   STATS_TYPE_COUNTER,
   STATS_TYPE_DOUBLE,
   STATS_TYPE_HISTOGRAM,
-  STATS_TYPE_HISTOGRAM_FAST
+  STATS_TYPE_HISTOGRAM_FAST,
+  STATS_TYPE_SUMMARY
 } stats_type_t;
 
+/* How histograms are exported: as an array of "H[bucket]=count" strings,
+ * or as a single base64 encoded circllhist serialization.
+ */
+typedef enum stats_hist_format_t {
+  STATS_HIST_FORMAT_BUCKETS,
+  STATS_HIST_FORMAT_B64
+} stats_hist_format_t;
+
 /* Allocate a recorder object */
 stats_recorder_t *
   stats_recorder_alloc(void);
@@ -65,6 +76,25 @@ stats_recorder_t *
 int
   stats_recorder_clear(stats_recorder_t *rec, stats_type_t);
 
+/* Select the histogram encoding used by the JSON exporters and capture.
+ * With STATS_HIST_FORMAT_B64 a histogram's "_value" is a base64 string
+ * (decodable with hist_deserialize_b64) and capture callbacks receive it as
+ * a STATS_TYPE_STRING.  The default is STATS_HIST_FORMAT_BUCKETS.
+ */
+void
+  stats_recorder_set_hist_format(stats_recorder_t *rec, stats_hist_format_t fmt);
+
+/* Run the recorder's refresh callbacks (stats_invoke, stats_ns_invoke) on
+ * `threads` worker threads instead of inline in the exporters.  Each
+ * export queues the callbacks that are due, waits at most budget_ms for
+ * them (0 waits for all), and exports the values they have produced so
+ * far; callbacks still running finish in the background.  Calling it
+ * again changes the budget and can add threads; the pool is never torn
+ * down.  Returns false if fewer threads than asked for are running.
+ */
+bool
+  stats_recorder_set_refresh(stats_recorder_t *rec, int threads, int budget_ms);
+
 /* Get the global namespace for the recorder */
 stats_ns_t *
   stats_recorder_global_ns(stats_recorder_t *);
@@ -94,6 +124,34 @@ typedef void (*stats_ns_update_func_t)(stats_ns_t *, void *closure);
 bool
   stats_ns_invoke(stats_ns_t *, stats_ns_update_func_t, void *closure);
 
+/* As stats_ns_invoke, but the function runs at most once every
+ * min_interval_ms; exports in between see what it last refreshed.
+ */
+bool
+  stats_ns_invoke_interval(stats_ns_t *, stats_ns_update_func_t, void *closure,
+                           int min_interval_ms);
+
+/* Bound the handles registered directly in this namespace.  Once
+ * max_handles names are taken, registering a new name returns the
+ * namespace's "_overflow" handle instead (or NULL if _overflow was first
+ * registered with another type).  It exports under the namespace's own
+ * name tagged overflow:true.  0 removes the limit.
+ */
+void
+  stats_ns_set_max_handles(stats_ns_t *ns, int max_handles);
+
+/* Remove handles in this namespace that go more than `exports` export
+ * passes (by any exporter, capture or snapshot of the recorder) without
+ * being written or looked up.  Observed and invoked handles never expire.
+ * Rather than caching handles from such a namespace, look them up with
+ * stats_register where they are written.  A removed handle stays valid
+ * as long as the namespace: writing to it, or registering its name again,
+ * puts it back and it is exported again from the next pass.  0 turns
+ * expiry off.
+ */
+void
+  stats_ns_set_ttl(stats_ns_t *ns, int exports);
+
 /* Set a tagged-variant name */
 void
   stats_handle_tagged_name(stats_handle_t *h, const char *name);
@@ -123,6 +181,45 @@ stats_handle_t *
   stats_register_fanout(stats_ns_t *, const char *name, stats_type_t,
                                int fanout);
 
+/* Remove the handle registered under name (or, for _ns, the namespace and
+ * everything beneath it).  The memory is reclaimed once no exporter or
+ * registration that could still see it is running, but the caller must
+ * not use the handle or namespace, or anything registered under it, once
+ * this is called.  Returns false if nothing was registered under name.
+ */
+bool
+  stats_deregister(stats_ns_t *, const char *name);
+
+bool
+  stats_deregister_ns(stats_recorder_t *, stats_ns_t *, const char *name);
+
+/* A family is a metric with labels: one handle per distinct set of label
+ * values, each tagged with its labels and exported under the family's name
+ * (for example requests|ST[method:GET,status:200]).  The label names (at
+ * most 8) follow the type and end with NULL:
+ *   fam = stats_register_family(ns, "requests", STATS_TYPE_COUNTER,
+ *                               "method", "status", NULL);
+ * The handles live in a namespace of the family's name, keyed by their
+ * comma separated values, so stats_ns_set_max_handles on it bounds the
+ * label sets (the rest share its _overflow handle).  Its handles neither
+ * expire nor deregister singly; deregistering the namespace frees the
+ * family.  Registering again with the same type and labels
+ * returns the same family, otherwise NULL.
+ */
+typedef struct stats_family stats_family_t;
+
+stats_family_t *
+  stats_register_family(stats_ns_t *, const char *name, stats_type_t, ...);
+
+/* Return the handle for one value per label, registering it on first use.
+ * Looking up a known label set takes no locks and no allocation.
+ */
+stats_handle_t *
+  stats_family_get(stats_family_t *, ...);
+
+stats_handle_t *
+  stats_family_getv(stats_family_t *, const char *const *values);
+
 /* If possible clear the handle to an initial state.
  * If you looking at some bit of memory for your handle,
  * this will fail as it would be dangerous for the library
@@ -168,6 +265,14 @@ typedef void (*stats_invocation_func_t)
 bool
   stats_invoke(stats_handle_t *, stats_invocation_func_t, void *closure);
 
+/* As stats_invoke, but the function runs at most once every
+ * min_interval_ms; exports in between report the value it last produced.
+ * Calling it again changes the interval.
+ */
+bool
+  stats_invoke_interval(stats_handle_t *, stats_invocation_func_t, void *closure,
+                        int min_interval_ms);
+
 /* Set the handle to a specific value. Minimal effort is made to convert
  * between numeric types and compose into histograms.
  * Setting to NULL will clear the value and, in the case of histograms,
@@ -176,6 +281,12 @@ bool
 bool
   stats_set(stats_handle_t *, stats_type_t, void *);
 
+/* Summaries (STATS_TYPE_SUMMARY) accept any numeric stats_set (and the
+ * stats_set_* macros) as an observation and expose the count, sum, min,
+ * max and mean of everything observed since registration or the last clear.
+ * Updates are lock-free.
+ */
+
 /* Add (possibly negative) amount to an underlying handle value.
  * Returns false if types mismatch such that an addition can't happen.
  */
@@ -225,11 +336,31 @@ bool
 bool
   stats_set_hist_intscale(stats_handle_t *h, int64_t val, int scale, uint64_t cnt);
 
+/* Switch a histogram handle to lock-free recording.  Samples are counted
+ * atomically into per-CPU bucket tables that capture swaps out and merges,
+ * so writers never wait on an exporter.  This cannot be undone.
+ * Returns false if the handle is not a histogram.
+ */
+bool
+  stats_handle_hist_lockfree(stats_handle_t *h);
+
+/* Switch a histogram handle to buffered recording.  stats_set_hist and
+ * stats_set_hist_intscale append the raw sample to a ring owned by the
+ * calling thread; rings are drained into the histogram when the recorder
+ * is output or captured (or when a thread's ring fills).  Samples are
+ * therefore only visible to the next export.  This cannot be undone.
+ * Returns false if the handle is not a histogram.
+ */
+bool
+  stats_handle_hist_ring(stats_handle_t *h);
+
 /* Prints a simple name for a statistics type */
 const char *
   stats_type_name(stats_type_t);
 
 /* Prints json via the outf function
+ * Output is coalesced, so outf sees a few large chunks per document; it may
+ * write short and will be called again with the remainder.
  * hist_since_last as true will only show the histogram counts since last
  * invocation, false will show over all of time.
  * simple dictates simpl key value pairs without type information. It also
@@ -246,11 +377,141 @@ ssize_t
                                     bool hist_since_last,
                                     ssize_t (*outf)(void *, const char *, size_t), void *cl);
 
+/* A sink coalesces exporter output into a reusable buffer and hands it to
+ * `flush` in large chunks: the buffered bytes, sometimes followed by one
+ * large fragment that was not worth copying, as an iovec batch suitable for
+ * writev.  flush returns the bytes written or -1 on error.
+ * bufsize of 0 picks a default (64k).
+ */
+typedef struct stats_sink stats_sink_t;
+typedef ssize_t (*stats_sink_flush_f)(void *cl, const struct iovec *iov, int iovcnt);
+
+stats_sink_t *
+  stats_sink_alloc(size_t bufsize, stats_sink_flush_f flush, void *cl);
+
+/* Adapts an outf callback (as taken by stats_recorder_output_json) */
+stats_sink_t *
+  stats_sink_alloc_outf(size_t bufsize,
+                        ssize_t (*outf)(void *, const char *, size_t), void *cl);
+
+/* Flushes with writev(2) on fd */
+stats_sink_t *
+  stats_sink_alloc_fd(size_t bufsize, int fd);
+
+ssize_t
+  stats_sink_write(stats_sink_t *sink, const void *data, size_t len);
+
+bool
+  stats_sink_flush(stats_sink_t *sink);
+
+void
+  stats_sink_free(stats_sink_t *sink);
+
+/* As above, but through a sink; the sink is flushed before returning. */
+ssize_t
+  stats_recorder_output_json_sink(stats_recorder_t *rec,
+                                  bool hist_since_last, bool simple,
+                                  stats_sink_t *sink);
+
+ssize_t
+  stats_recorder_output_json_tagged_sink(stats_recorder_t *rec,
+                                         bool hist_since_last,
+                                         stats_sink_t *sink);
+
+/* A cursor remembers how far a consumer of delta exports has got.  Each
+ * delta export emits only the handles changed since the cursor's previous
+ * (successful) export and then advances it; the first export, and every
+ * full_every-th after that, is a full refresh (0 for never).  Writes
+ * through the stats_* setters are tracked; observed and invoked scalars
+ * and strings are compared against the value last exported.  Other
+ * invoked handles are always emitted.
+ */
+typedef struct stats_cursor stats_cursor_t;
+
+stats_cursor_t *
+  stats_cursor_alloc(int full_every);
+
+void
+  stats_cursor_free(stats_cursor_t *cursor);
+
+ssize_t
+  stats_recorder_output_json_tagged_delta(stats_recorder_t *rec,
+                                          bool hist_since_last,
+                                          stats_cursor_t *cursor,
+                                          ssize_t (*outf)(void *, const char *, size_t),
+                                          void *cl);
+
+ssize_t
+  stats_recorder_output_json_tagged_delta_sink(stats_recorder_t *rec,
+                                               bool hist_since_last,
+                                               stats_cursor_t *cursor,
+                                               stats_sink_t *sink);
+
+/* Prints Prometheus text exposition (format 0.0.4).  Tags become labels,
+ * counters are counter families, other numeric types are gauges and
+ * histograms are histogram families with cumulative _bucket series (le is
+ * each circllhist bucket's upper bound) plus _sum and _count.  Summaries
+ * export _sum and _count, with min, max and mean as <name>_min, ... gauges.
+ * Histograms are reported over all of time.  Strings are not exported.
+ */
+ssize_t
+  stats_recorder_output_prometheus(stats_recorder_t *rec,
+                                   ssize_t (*outf)(void *, const char *, size_t), void *cl);
+
+ssize_t
+  stats_recorder_output_prometheus_sink(stats_recorder_t *rec, stats_sink_t *sink);
+
 typedef bool (*stats_capture_f)(void *cl, const char *name, stats_type_t type, void *addr);
 
 int
   stats_recorder_capture(stats_recorder_t *rec, bool hist_since_last,
                          stats_capture_f cb, void *cl);
+/* A snapshot copies every metric (summaries folded, histograms merged to
+ * buckets) in one pass and then drops the recorder's locks, so any number
+ * of exporters can serialize it afterwards, as tagged or hierarchical JSON
+ * or Prometheus text, without holding up registration or tagging.
+ * hist_since_last applies when it is taken.  stats_snapshot_create_ns
+ * reports how long taking it took and stats_snapshot_lock_ns the longest
+ * any namespace lock was held for it.
+ */
+typedef struct stats_snapshot stats_snapshot_t;
+stats_snapshot_t *
+  stats_recorder_snapshot(stats_recorder_t *rec, bool hist_since_last);
+/* As above, but counters and histograms are read and merged by `threads`
+ * threads (the caller and threads-1 helpers, up to 64).  The helpers are
+ * started once and kept for later snapshots.  The result is identical;
+ * the namespace locks stay held until the workers finish.
+ */
+stats_snapshot_t *
+  stats_recorder_snapshot_parallel(stats_recorder_t *rec, bool hist_since_last,
+                                   int threads);
+void
+  stats_snapshot_free(stats_snapshot_t *snap);
+int
+  stats_snapshot_count(const stats_snapshot_t *snap);
+uint64_t
+  stats_snapshot_create_ns(const stats_snapshot_t *snap);
+uint64_t
+  stats_snapshot_lock_ns(const stats_snapshot_t *snap);
+ssize_t
+  stats_snapshot_output_json(const stats_snapshot_t *snap, bool simple,
+                             ssize_t (*outf)(void *, const char *, size_t), void *cl);
+ssize_t
+  stats_snapshot_output_json_sink(const stats_snapshot_t *snap, bool simple,
+                                  stats_sink_t *sink);
+ssize_t
+  stats_snapshot_output_json_tagged(const stats_snapshot_t *snap,
+                                    ssize_t (*outf)(void *, const char *, size_t), void *cl);
+ssize_t
+  stats_snapshot_output_json_tagged_sink(const stats_snapshot_t *snap,
+                                         stats_sink_t *sink);
+ssize_t
+  stats_snapshot_output_prometheus(const stats_snapshot_t *snap,
+                                   ssize_t (*outf)(void *, const char *, size_t), void *cl);
+ssize_t
+  stats_snapshot_output_prometheus_sink(const stats_snapshot_t *snap, stats_sink_t *sink);
+int
+  stats_snapshot_capture(const stats_snapshot_t *snap, stats_capture_f cb, void *cl);
 
 #ifdef __cplusplus
 }
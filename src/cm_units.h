@@ -0,0 +1,125 @@
+/*
+ * Copyright (c) 2019, Circonus, Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *     * Neither the name Circonus, Inc. nor the names of its contributors
+ *       may be used to endorse or promote products derived from this
+ *       software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef CM_UNITS_H
+#define CM_UNITS_H
+
+#define STATS_UNITS_METERS "meters"
+#define STATS_UNITS_ABBREV_METERS "m"
+#define STATS_UNITS_GRAMS "grams"
+#define STATS_UNITS_ABBREV_GRAMS "g"
+#define STATS_UNITS_SECONDS "seconds"
+#define STATS_UNITS_ABBREV_SECONDS "s"
+#define STATS_UNITS_AMPERES "amperes"
+#define STATS_UNITS_ABBREV_AMPERES "A"
+#define STATS_UNITS_KELVIN "kelvin"
+#define STATS_UNITS_ABBREV_KELVIN "K"
+#define STATS_UNITS_MOLES "moles"
+#define STATS_UNITS_ABBREV_MOLES "mol"
+#define STATS_UNITS_CANDELA "candela"
+#define STATS_UNITS_ABBREV_CANDELA "cd"
+#define STATS_UNITS_PERCENT "percent"
+#define STATS_UNITS_ABBREV_PERCENT "%"
+#define STATS_UNITS_MESSAGES "messages"
+#define STATS_UNITS_ABBREV_MESSAGES "msgs"
+#define STATS_UNITS_PACKETS "packets"
+#define STATS_UNITS_ABBREV_PACKETS "pkts"
+#define STATS_UNITS_RATIO "ratio"
+#define STATS_UNITS_ABBREV_RATIO "ratio"
+#define STATS_UNITS_REQUESTS "requests"
+#define STATS_UNITS_ABBREV_REQUESTS "reqs"
+#define STATS_UNITS_RESPONSES "responses"
+#define STATS_UNITS_ABBREV_RESPONSES "resps"
+#define STATS_UNITS_TRANSACTIONS "transactions"
+#define STATS_UNITS_ABBREV_TRANSACTIONS "txns"
+#define STATS_UNITS_TUPLES "tuples"
+#define STATS_UNITS_ABBREV_TUPLES "tuples"
+#define STATS_UNITS_BITS "bits"
+#define STATS_UNITS_ABBREV_BITS "b"
+#define STATS_UNITS_BYTES "bytes"
+#define STATS_UNITS_ABBREV_BYTES "B"
+#define STATS_UNITS_PREFIX_YOTTA "yotta"
+#define STATS_UNITS_PREFIX_ABBREV_YOTTA "Y"
+#define STATS_UNITS_PREFIX_ZETTA "zetta"
+#define STATS_UNITS_PREFIX_ABBREV_ZETTA "Z"
+#define STATS_UNITS_PREFIX_EXA "exa"
+#define STATS_UNITS_PREFIX_ABBREV_EXA "E"
+#define STATS_UNITS_PREFIX_PETA "peta"
+#define STATS_UNITS_PREFIX_ABBREV_PETA "P"
+#define STATS_UNITS_PREFIX_TERA "tera"
+#define STATS_UNITS_PREFIX_ABBREV_TERA "T"
+#define STATS_UNITS_PREFIX_GIGA "giga"
+#define STATS_UNITS_PREFIX_ABBREV_GIGA "G"
+#define STATS_UNITS_PREFIX_MEGA "mega"
+#define STATS_UNITS_PREFIX_ABBREV_MEGA "M"
+#define STATS_UNITS_PREFIX_KILO "kilo"
+#define STATS_UNITS_PREFIX_ABBREV_KILO "k"
+#define STATS_UNITS_PREFIX_HECTO "hecto"
+#define STATS_UNITS_PREFIX_ABBREV_HECTO "h"
+#define STATS_UNITS_PREFIX_DECA "deca"
+#define STATS_UNITS_PREFIX_ABBREV_DECA "da"
+#define STATS_UNITS_PREFIX_DECI "deci"
+#define STATS_UNITS_PREFIX_ABBREV_DECI "d"
+#define STATS_UNITS_PREFIX_CENTI "centi"
+#define STATS_UNITS_PREFIX_ABBREV_CENTI "c"
+#define STATS_UNITS_PREFIX_MILLI "milli"
+#define STATS_UNITS_PREFIX_ABBREV_MILLI "m"
+#define STATS_UNITS_PREFIX_MICRO "micro"
+#define STATS_UNITS_PREFIX_ABBREV_MICRO "μ"
+#define STATS_UNITS_PREFIX_NANO "nano"
+#define STATS_UNITS_PREFIX_ABBREV_NANO "n"
+#define STATS_UNITS_PREFIX_PICO "pico"
+#define STATS_UNITS_PREFIX_ABBREV_PICO "p"
+#define STATS_UNITS_PREFIX_FEMTO "femto"
+#define STATS_UNITS_PREFIX_ABBREV_FEMTO "f"
+#define STATS_UNITS_PREFIX_ATTO "atto"
+#define STATS_UNITS_PREFIX_ABBREV_ATTO "a"
+#define STATS_UNITS_PREFIX_ZEPTO "zepto"
+#define STATS_UNITS_PREFIX_ABBREV_ZEPTO "z"
+#define STATS_UNITS_PREFIX_YOCTO "yocto"
+#define STATS_UNITS_PREFIX_ABBREV_YOCTO "y"
+#define STATS_UNITS_PREFIX_KIBI "kibi"
+#define STATS_UNITS_PREFIX_ABBREV_KIBI "Ki"
+#define STATS_UNITS_PREFIX_MEBI "mebi"
+#define STATS_UNITS_PREFIX_ABBREV_MEBI "Mi"
+#define STATS_UNITS_PREFIX_GIBI "gibi"
+#define STATS_UNITS_PREFIX_ABBREV_GIBI "Gi"
+#define STATS_UNITS_PREFIX_TEBI "tebi"
+#define STATS_UNITS_PREFIX_ABBREV_TEBI "Ti"
+#define STATS_UNITS_PREFIX_PEBI "pebi"
+#define STATS_UNITS_PREFIX_ABBREV_PEBI "Pi"
+#define STATS_UNITS_PREFIX_EXBI "exbi"
+#define STATS_UNITS_PREFIX_ABBREV_EXBI "Ei"
+#define STATS_UNITS_PREFIX_ZEBI "zebi"
+#define STATS_UNITS_PREFIX_ABBREV_ZEBI "Zi"
+#define STATS_UNITS_PREFIX_YOBI "yobi"
+#define STATS_UNITS_PREFIX_ABBREV_YOBI "Yi"
+
+#endif
@@ -0,0 +1,568 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "circmetrics_config.h"
+#include "cm_stats_api.h"
+#include "cm_publish_api.h"
+
+#if defined(HAVE_ZLIB_H) && defined(HAVE_LIBZ)
+#include <zlib.h>
+#define CM_PUBLISH_GZIP 1
+#endif
+
+/* The clock the condition variable's deadlines are measured against; only
+ * the realtime clock where it cannot be chosen (macOS). */
+#ifdef HAVE_PTHREAD_CONDATTR_SETCLOCK
+#define PUBLISH_CLOCK CLOCK_MONOTONIC
+#else
+#define PUBLISH_CLOCK CLOCK_REALTIME
+#endif
+
+#define PUBLISH_DEFAULT_PERIOD_MS 10000
+#define PUBLISH_MAX_ATTEMPTS 4
+#define PUBLISH_BACKOFF_MS 100
+#define PUBLISH_IO_TIMEOUT_MS 5000
+#define PUBLISH_HEADER_MAX 4096
+#define PUBLISH_RESPONSE_MAX 4096
+
+enum stats_push_result {
+  PUSH_OK,
+  PUSH_RETRY,    /* network trouble, 408, 429 or 5xx */
+  PUSH_REJECTED  /* anything else; resending the same document won't help */
+};
+
+struct stats_publisher {
+  stats_recorder_t *rec;
+  pthread_t         tid;
+  pthread_mutex_t   lock;
+  pthread_cond_t    cond;
+  bool              shutdown;
+
+  /* configuration, guarded by lock; conf_gen moves on every change */
+  char             *apitoken;
+  char             *apiurl;
+  int               period_ms;
+  uint64_t          conf_gen;
+
+  /* everything below belongs to the publishing thread */
+  uint64_t          seen_gen;
+  char             *token;
+  char             *host;
+  char             *port;
+  char             *path;
+  int               fd;
+  stats_sink_t     *sink;
+  char             *doc;
+  size_t            doc_len, doc_size;
+#ifdef CM_PUBLISH_GZIP
+  z_stream          zs;
+  bool              zs_ready;
+  unsigned char    *zbuf;
+  size_t            zbuf_size;
+#endif
+  char              resp[PUBLISH_RESPONSE_MAX];
+  size_t            resp_off, resp_len;
+};
+
+static void
+timespec_add_ms(struct timespec *ts, int ms) {
+  ts->tv_sec += ms / 1000;
+  ts->tv_nsec += (long)(ms % 1000) * 1000000L;
+  if(ts->tv_nsec >= 1000000000L) {
+    ts->tv_sec++;
+    ts->tv_nsec -= 1000000000L;
+  }
+}
+
+static int
+timespec_cmp(const struct timespec *a, const struct timespec *b) {
+  if(a->tv_sec != b->tv_sec) return a->tv_sec < b->tv_sec ? -1 : 1;
+  if(a->tv_nsec != b->tv_nsec) return a->tv_nsec < b->tv_nsec ? -1 : 1;
+  return 0;
+}
+
+/* Accepts http://host[:port][/path]; host may be a bracketed IPv6 address. */
+static bool
+stats_publisher_parse_url(const char *url, char **host, char **port, char **path) {
+  const char *h, *hend, *p, *slash;
+  if(strncasecmp(url, "http://", 7)) return false;
+  h = url + 7;
+  slash = strchr(h, '/');
+  if(!slash) slash = h + strlen(h);
+  if(*h == '[') {
+    hend = memchr(h, ']', slash - h);
+    if(!hend) return false;
+    h++;
+    p = hend + 1;
+  }
+  else {
+    hend = memchr(h, ':', slash - h);
+    if(!hend) hend = slash;
+    p = hend;
+  }
+  if(hend == h) return false;
+  if(p < slash && *p != ':') return false;
+  if(p < slash && p + 1 == slash) return false;
+  if(host) {
+    *host = strndup(h, hend - h);
+    *port = (p < slash) ? strndup(p + 1, slash - p - 1) : strdup("80");
+    *path = *slash ? strdup(slash) : strdup("/");
+  }
+  return true;
+}
+
+static ssize_t
+stats_publisher_collect(void *cl, const struct iovec *iov, int iovcnt) {
+  stats_publisher_t *p = cl;
+  ssize_t total = 0;
+  int i;
+  for(i=0;i<iovcnt;i++) {
+    if(p->doc_len + iov[i].iov_len > p->doc_size) {
+      size_t size = p->doc_size ? p->doc_size : 65536;
+      char *grown;
+      while(size < p->doc_len + iov[i].iov_len) size *= 2;
+      if((grown = realloc(p->doc, size)) == NULL) return -1;
+      p->doc = grown;
+      p->doc_size = size;
+    }
+    memcpy(p->doc + p->doc_len, iov[i].iov_base, iov[i].iov_len);
+    p->doc_len += iov[i].iov_len;
+    total += iov[i].iov_len;
+  }
+  return total;
+}
+
+static void
+stats_publisher_disconnect(stats_publisher_t *p) {
+  if(p->fd >= 0) close(p->fd);
+  p->fd = -1;
+  p->resp_off = p->resp_len = 0;
+}
+
+static bool
+stats_publisher_connect(stats_publisher_t *p) {
+  struct addrinfo hints, *res, *ai;
+  struct timeval tv = { PUBLISH_IO_TIMEOUT_MS / 1000, (PUBLISH_IO_TIMEOUT_MS % 1000) * 1000 };
+  int one = 1;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if(getaddrinfo(p->host, p->port, &hints, &res)) return false;
+  for(ai=res;ai;ai=ai->ai_next) {
+    int fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if(fd < 0) continue;
+    /* the send timeout also bounds connect() */
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if(connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+      p->fd = fd;
+      break;
+    }
+    close(fd);
+  }
+  freeaddrinfo(res);
+  p->resp_off = p->resp_len = 0;
+  return p->fd >= 0;
+}
+
+static bool
+stats_publisher_send(stats_publisher_t *p, struct iovec *iov, int iovcnt) {
+  while(iovcnt > 0) {
+    struct msghdr msg;
+    ssize_t rv;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iovcnt;
+    rv = sendmsg(p->fd, &msg, MSG_NOSIGNAL);
+    if(rv < 0) {
+      if(errno == EINTR) continue;
+      return false;
+    }
+    while(iovcnt > 0 && (size_t)rv >= iov->iov_len) {
+      rv -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if(iovcnt > 0) {
+      iov->iov_base = (char *)iov->iov_base + rv;
+      iov->iov_len -= rv;
+    }
+  }
+  return true;
+}
+
+/* Reads more of the response, keeping unconsumed bytes at the front. */
+static bool
+stats_publisher_fill(stats_publisher_t *p) {
+  ssize_t rv;
+  if(p->resp_off) {
+    memmove(p->resp, p->resp + p->resp_off, p->resp_len - p->resp_off);
+    p->resp_len -= p->resp_off;
+    p->resp_off = 0;
+  }
+  if(p->resp_len == sizeof(p->resp)) return false;
+  do {
+    rv = recv(p->fd, p->resp + p->resp_len, sizeof(p->resp) - p->resp_len, 0);
+  } while(rv < 0 && errno == EINTR);
+  if(rv <= 0) return false;
+  p->resp_len += rv;
+  return true;
+}
+
+/* Returns the next CRLF terminated line (without the CRLF), or NULL. */
+static char *
+stats_publisher_line(stats_publisher_t *p) {
+  while(1) {
+    char *start = p->resp + p->resp_off;
+    char *eol = memchr(start, '\n', p->resp_len - p->resp_off);
+    if(eol) {
+      p->resp_off = eol + 1 - p->resp;
+      if(eol > start && eol[-1] == '\r') eol--;
+      *eol = '\0';
+      return start;
+    }
+    if(!stats_publisher_fill(p)) return NULL;
+  }
+}
+
+static bool
+stats_publisher_skip(stats_publisher_t *p, uint64_t len) {
+  while(len > 0) {
+    size_t avail = p->resp_len - p->resp_off;
+    if(avail == 0) {
+      if(!stats_publisher_fill(p)) return false;
+      continue;
+    }
+    if(avail > len) avail = len;
+    p->resp_off += avail;
+    len -= avail;
+  }
+  return true;
+}
+
+/* Reads (and discards) a response; returns the status or -1.  *keepalive
+ * tells whether the connection may carry the next request. */
+static int
+stats_publisher_response(stats_publisher_t *p, bool *keepalive) {
+  char *line;
+  int status, minor;
+  bool chunked = false, has_length = false;
+  uint64_t length = 0;
+
+  if((line = stats_publisher_line(p)) == NULL) return -1;
+  if(sscanf(line, "HTTP/1.%d %d", &minor, &status) != 2) return -1;
+  *keepalive = (minor >= 1);
+  while((line = stats_publisher_line(p)) != NULL && *line) {
+    char *val = strchr(line, ':');
+    if(!val) continue;
+    *val++ = '\0';
+    while(*val == ' ' || *val == '\t') val++;
+    if(!strcasecmp(line, "content-length")) {
+      length = strtoull(val, NULL, 10);
+      has_length = true;
+    }
+    else if(!strcasecmp(line, "transfer-encoding")) {
+      chunked = strcasestr(val, "chunked") != NULL;
+    }
+    else if(!strcasecmp(line, "connection")) {
+      if(!strcasecmp(val, "close")) *keepalive = false;
+      else if(!strcasecmp(val, "keep-alive")) *keepalive = true;
+    }
+  }
+  if(line == NULL) return -1;
+
+  if(status == 204 || status == 304 || (status >= 100 && status < 200)) return status;
+  if(chunked) {
+    while(1) {
+      uint64_t chunk;
+      if((line = stats_publisher_line(p)) == NULL) return -1;
+      chunk = strtoull(line, NULL, 16);
+      if(chunk == 0) break;
+      if(!stats_publisher_skip(p, chunk + 2)) return -1;
+    }
+    /* trailers, up to the blank line */
+    while((line = stats_publisher_line(p)) != NULL && *line);
+    if(line == NULL) return -1;
+  }
+  else if(has_length) {
+    if(!stats_publisher_skip(p, length)) return -1;
+  }
+  else {
+    /* delimited by the server closing the connection */
+    *keepalive = false;
+  }
+  return status;
+}
+
+static enum stats_push_result
+stats_publisher_put(stats_publisher_t *p, const void *body, size_t len, const char *encoding) {
+  char hdr[PUBLISH_HEADER_MAX];
+  struct iovec iov[2];
+  int hlen, status;
+  bool reused, keepalive = false, v6 = strchr(p->host, ':') != NULL;
+
+  hlen = snprintf(hdr, sizeof(hdr),
+                  "PUT %s HTTP/1.1\r\n"
+                  "Host: %s%s%s%s%s\r\n"
+                  "Content-Type: application/json\r\n"
+                  "Content-Length: %zu\r\n"
+                  "%s%s%s"
+                  "%s%s%s"
+                  "Connection: keep-alive\r\n"
+                  "\r\n",
+                  p->path, v6 ? "[" : "", p->host, v6 ? "]" : "",
+                  strcmp(p->port, "80") ? ":" : "", strcmp(p->port, "80") ? p->port : "", len,
+                  encoding ? "Content-Encoding: " : "", encoding ? encoding : "",
+                  encoding ? "\r\n" : "",
+                  p->token ? "X-Circonus-Auth-Token: " : "", p->token ? p->token : "",
+                  p->token ? "\r\n" : "");
+  if(hlen < 0 || hlen >= (int)sizeof(hdr)) return PUSH_REJECTED;
+
+  reused = (p->fd >= 0);
+  while(1) {
+    if(p->fd < 0 && !stats_publisher_connect(p)) return PUSH_RETRY;
+    iov[0].iov_base = hdr;
+    iov[0].iov_len = hlen;
+    iov[1].iov_base = (void *)body;
+    iov[1].iov_len = len;
+    if(stats_publisher_send(p, iov, 2) &&
+       (status = stats_publisher_response(p, &keepalive)) >= 0) break;
+    stats_publisher_disconnect(p);
+    /* an idle kept-alive connection may have been closed under us; that is
+     * not worth an attempt, so go again once on a fresh connection */
+    if(!reused) return PUSH_RETRY;
+    reused = false;
+  }
+  if(!keepalive) stats_publisher_disconnect(p);
+  if(status >= 200 && status < 300) return PUSH_OK;
+  if(status == 408 || status == 429 || status >= 500) return PUSH_RETRY;
+  return PUSH_REJECTED;
+}
+
+/* Waits up to ms; false if the publisher is shutting down. */
+static bool
+stats_publisher_sleep(stats_publisher_t *p, int ms) {
+  struct timespec deadline;
+  bool running;
+  clock_gettime(PUBLISH_CLOCK, &deadline);
+  timespec_add_ms(&deadline, ms);
+  pthread_mutex_lock(&p->lock);
+  while(!p->shutdown &&
+        pthread_cond_timedwait(&p->cond, &p->lock, &deadline) != ETIMEDOUT);
+  running = !p->shutdown;
+  pthread_mutex_unlock(&p->lock);
+  return running;
+}
+
+static void
+stats_publisher_publish(stats_publisher_t *p) {
+  const void *body;
+  size_t len;
+  const char *encoding = NULL;
+  int attempt;
+  stats_snapshot_t *snap;
+  ssize_t rv;
+
+  /* serialize from a snapshot so the namespaces are not held while we write */
+  if((snap = stats_recorder_snapshot(p->rec, false)) == NULL) return;
+  p->doc_len = 0;
+  rv = stats_snapshot_output_json_tagged_sink(snap, p->sink);
+  stats_snapshot_free(snap);
+  if(rv < 0) return;
+  body = p->doc;
+  len = p->doc_len;
+
+#ifdef CM_PUBLISH_GZIP
+  if(p->zs_ready && deflateReset(&p->zs) == Z_OK) {
+    size_t bound = deflateBound(&p->zs, len) + 32; /* + the gzip wrapper */
+    if(bound > p->zbuf_size) {
+      unsigned char *grown = realloc(p->zbuf, bound);
+      if(grown) {
+        p->zbuf = grown;
+        p->zbuf_size = bound;
+      }
+    }
+    if(bound <= p->zbuf_size) {
+      p->zs.next_in = (unsigned char *)p->doc;
+      p->zs.avail_in = len;
+      p->zs.next_out = p->zbuf;
+      p->zs.avail_out = p->zbuf_size;
+      if(deflate(&p->zs, Z_FINISH) == Z_STREAM_END) {
+        body = p->zbuf;
+        len = p->zs.total_out;
+        encoding = "gzip";
+      }
+    }
+  }
+#endif
+
+  for(attempt=0;attempt<PUBLISH_MAX_ATTEMPTS;attempt++) {
+    if(attempt && !stats_publisher_sleep(p, PUBLISH_BACKOFF_MS << (attempt - 1))) return;
+    switch(stats_publisher_put(p, body, len, encoding)) {
+    case PUSH_OK:
+    case PUSH_REJECTED:
+      return;
+    case PUSH_RETRY:
+      break;
+    }
+  }
+}
+
+/* Takes a private copy of changed configuration; called with p->lock held. */
+static void
+stats_publisher_reconfigure(stats_publisher_t *p) {
+  if(p->seen_gen == p->conf_gen) return;
+  p->seen_gen = p->conf_gen;
+  free(p->token);
+  p->token = p->apitoken ? strdup(p->apitoken) : NULL;
+  free(p->host);
+  free(p->port);
+  free(p->path);
+  p->host = p->port = p->path = NULL;
+  if(p->apiurl) stats_publisher_parse_url(p->apiurl, &p->host, &p->port, &p->path);
+  stats_publisher_disconnect(p);
+}
+
+static void *
+stats_publisher_thread(void *vp) {
+  stats_publisher_t *p = vp;
+  struct timespec last, deadline, now;
+
+  clock_gettime(PUBLISH_CLOCK, &last);
+  pthread_mutex_lock(&p->lock);
+  while(!p->shutdown) {
+    deadline = last;
+    timespec_add_ms(&deadline, p->period_ms);
+    /* a wakeup without a timeout is a configuration change: the deadline is
+     * recomputed with the (possibly) new period */
+    if(pthread_cond_timedwait(&p->cond, &p->lock, &deadline) != ETIMEDOUT) continue;
+    if(p->shutdown) break;
+    /* ticks missed while a push was retrying are skipped, not bunched up */
+    clock_gettime(PUBLISH_CLOCK, &now);
+    last = deadline;
+    timespec_add_ms(&deadline, p->period_ms);
+    if(timespec_cmp(&deadline, &now) < 0) last = now;
+    stats_publisher_reconfigure(p);
+    if(!p->host) continue;
+    pthread_mutex_unlock(&p->lock);
+    stats_publisher_publish(p);
+    pthread_mutex_lock(&p->lock);
+  }
+  pthread_mutex_unlock(&p->lock);
+  return NULL;
+}
+
+stats_publisher_t *
+stats_publisher_alloc(stats_recorder_t *rec) {
+  stats_publisher_t *p;
+  pthread_condattr_t attr;
+
+  if(rec == NULL) return NULL;
+  p = calloc(1, sizeof(*p));
+  if(p == NULL) return NULL;
+  p->rec = rec;
+  p->fd = -1;
+  p->period_ms = PUBLISH_DEFAULT_PERIOD_MS;
+  p->sink = stats_sink_alloc(0, stats_publisher_collect, p);
+  if(p->sink == NULL) {
+    free(p);
+    return NULL;
+  }
+#ifdef CM_PUBLISH_GZIP
+  p->zs_ready = (deflateInit2(&p->zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                              15 + 16 /* gzip */, 8, Z_DEFAULT_STRATEGY) == Z_OK);
+#endif
+  pthread_mutex_init(&p->lock, NULL);
+  pthread_condattr_init(&attr);
+#ifdef HAVE_PTHREAD_CONDATTR_SETCLOCK
+  pthread_condattr_setclock(&attr, PUBLISH_CLOCK);
+#endif
+  pthread_cond_init(&p->cond, &attr);
+  pthread_condattr_destroy(&attr);
+  if(pthread_create(&p->tid, NULL, stats_publisher_thread, p)) {
+    p->shutdown = true;
+    stats_publisher_free(p);
+    return NULL;
+  }
+  return p;
+}
+
+void
+stats_publisher_free(stats_publisher_t *p) {
+  if(p == NULL) return;
+  pthread_mutex_lock(&p->lock);
+  if(!p->shutdown) {
+    p->shutdown = true;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+    pthread_join(p->tid, NULL);
+  }
+  else pthread_mutex_unlock(&p->lock);
+  stats_publisher_disconnect(p);
+#ifdef CM_PUBLISH_GZIP
+  if(p->zs_ready) deflateEnd(&p->zs);
+  free(p->zbuf);
+#endif
+  stats_sink_free(p->sink);
+  pthread_cond_destroy(&p->cond);
+  pthread_mutex_destroy(&p->lock);
+  free(p->doc);
+  free(p->token);
+  free(p->host);
+  free(p->port);
+  free(p->path);
+  free(p->apitoken);
+  free(p->apiurl);
+  free(p);
+}
+
+static bool
+stats_publisher_set_string(stats_publisher_t *p, char **field, const char *val) {
+  char *copy = val ? strdup(val) : NULL;
+  if(val && copy == NULL) return false;
+  pthread_mutex_lock(&p->lock);
+  free(*field);
+  *field = copy;
+  p->conf_gen++;
+  pthread_cond_broadcast(&p->cond);
+  pthread_mutex_unlock(&p->lock);
+  return true;
+}
+
+bool
+stats_publisher_set_apitoken(stats_publisher_t *p, const char *token) {
+  if(p == NULL) return false;
+  if(token && strpbrk(token, "\r\n")) return false;
+  return stats_publisher_set_string(p, &p->apitoken, token);
+}
+
+bool
+stats_publisher_set_apiurl(stats_publisher_t *p, const char *url) {
+  if(p == NULL) return false;
+  if(url && (strpbrk(url, "\r\n \t") || !stats_publisher_parse_url(url, NULL, NULL, NULL)))
+    return false;
+  return stats_publisher_set_string(p, &p->apiurl, url);
+}
+
+bool
+stats_publisher_set_period(stats_publisher_t *p, int period_ms) {
+  if(p == NULL || period_ms <= 0) return false;
+  pthread_mutex_lock(&p->lock);
+  p->period_ms = period_ms;
+  pthread_cond_broadcast(&p->cond);
+  pthread_mutex_unlock(&p->lock);
+  return true;
+}
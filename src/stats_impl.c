@@ -2,7 +2,10 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
+#include <stddef.h>
+#include <errno.h>
 #include <ck_hs.h>
+#include <ck_epoch.h>
 #include <ck_pr.h>
 #include <ck_spinlock.h>
 #include <pthread.h>
@@ -11,101 +14,473 @@
 #include <math.h>
 #include <inttypes.h>
 #include <sys/uio.h>
+#include <time.h>
 
+#include "circmetrics_config.h"
 #include "cm_units.h"
 #include "cm_stats_api.h"
 #include "stats_hash_f.h"
+#include "stats_numfmt.h"
 #include "noit_metric_help.h"
 
 #define MAX_FANOUT 128
 #define DEFAULT_FANOUT 8
+#define LF_HIST_BITS 8
+#define LF_HIST_BUCKETS (1 << LF_HIST_BITS)
+#define HIST_RING_SIZE 1024
+#define HIST_RING_DOUBLE INT32_MIN
+/* How many slot selections to serve before asking the OS again which CPU
+ * we are on, when the kernel does not publish it for us via rseq.
+ */
+#define CPU_REFRESH_INTERVAL 256
 #ifndef unlikely
 #define unlikely(x)    __builtin_expect(!!(x), 0)
 #endif
+#ifndef likely
+#define likely(x)      __builtin_expect(!!(x), 1)
+#endif
 
 #if defined(linux) || defined(__linux) || defined(__linux__)
 #include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#if defined(HAVE_SYS_RSEQ_H)
+#include <sys/rseq.h>
+#elif defined(HAVE_LINUX_RSEQ_H)
+#include <linux/rseq.h>
+#endif
+#if (defined(HAVE_SYS_RSEQ_H) || defined(HAVE_LINUX_RSEQ_H)) && defined(__NR_rseq)
+#define CM_USE_RSEQ 1
+#endif
 #elif defined(__sun__) || defined(__sun) || defined(sun)
 #include <sys/processor.h>
 #endif
 
 static __thread unsigned int circmetrics_tid;
-static inline unsigned int __get_fanout(unsigned int fanout) {
-  if(unlikely(circmetrics_tid == 0)) {
+static __thread unsigned int circmetrics_tid_uses;
+
+#ifdef CM_USE_RSEQ
+#ifndef RSEQ_SIG
+#define RSEQ_SIG 0x53053053
+#endif
+/* The kernel keeps rseq->cpu_id current for every registered thread, so
+ * reading it is a single load.  We don't need a restartable critical
+ * section: a stale slot is merely slower, never incorrect.  Prefer the
+ * area libc registered; failing that, register our own.
+ */
+static __thread struct rseq circmetrics_own_rseq __attribute__((aligned(32)));
+static __thread uint32_t *circmetrics_rseq_cpu;
+static __thread bool circmetrics_rseq_tried;
+static pthread_key_t circmetrics_rseq_key;
+static pthread_once_t circmetrics_rseq_once = PTHREAD_ONCE_INIT;
+
+static void
+circmetrics_rseq_unregister(void *unused) {
+  (void)unused;
+  circmetrics_rseq_cpu = NULL;
+  syscall(__NR_rseq, &circmetrics_own_rseq, sizeof(circmetrics_own_rseq),
+          RSEQ_FLAG_UNREGISTER, RSEQ_SIG);
+}
+static void
+circmetrics_rseq_key_init(void) {
+  pthread_key_create(&circmetrics_rseq_key, circmetrics_rseq_unregister);
+}
+static void
+circmetrics_rseq_setup(void) {
+  circmetrics_rseq_tried = true;
+#ifdef HAVE_SYS_RSEQ_H
+  if(__rseq_size > 0) {
+    struct rseq *rs = (struct rseq *)((char *)__builtin_thread_pointer() + __rseq_offset);
+    circmetrics_rseq_cpu = (uint32_t *)&rs->cpu_id;
+    return;
+  }
+#endif
+  circmetrics_own_rseq.cpu_id = RSEQ_CPU_ID_UNINITIALIZED;
+  if(syscall(__NR_rseq, &circmetrics_own_rseq, sizeof(circmetrics_own_rseq),
+             0, RSEQ_SIG) == 0) {
+    /* Our TLS may be freed before the thread is gone; unregister first. */
+    pthread_once(&circmetrics_rseq_once, circmetrics_rseq_key_init);
+    pthread_setspecific(circmetrics_rseq_key, &circmetrics_own_rseq);
+    circmetrics_rseq_cpu = (uint32_t *)&circmetrics_own_rseq.cpu_id;
+  }
+}
+#endif
+
+static unsigned int __current_cpu(void) {
 #if defined(linux) || defined(__linux) || defined(__linux__)
-    unsigned cpu = sched_getcpu();
-    circmetrics_tid = (int)cpu;
+  int cpu = sched_getcpu();
+  return cpu < 0 ? 0 : (unsigned int)cpu;
 #elif defined(__sun__) || defined(__sun) || defined(sun)
-    circmetrics_tid = (int)getcpuid();
+  return (unsigned int)getcpuid();
 #else
-    circmetrics_tid = (int)(intptr_t)pthread_self();
-    if(circmetrics_tid > 0x100) {
-      int f = circmetrics_tid;
-      circmetrics_tid = 0;
-      while(f) {
-        circmetrics_tid = circmetrics_tid ^ (f & 0x7f);
-        f >>= 7;
-      }
+  unsigned int tid = (unsigned int)(intptr_t)pthread_self();
+  if(tid > 0x100) {
+    unsigned int f = tid;
+    tid = 0;
+    while(f) {
+      tid = tid ^ (f & 0x7f);
+      f >>= 7;
     }
+  }
+  return tid;
+#endif
+}
+
+static inline unsigned int __get_fanout(unsigned int fanout) {
+#ifdef CM_USE_RSEQ
+  if(likely(circmetrics_rseq_cpu != NULL)) {
+    return ck_pr_load_32(circmetrics_rseq_cpu) % fanout;
+  }
+  if(unlikely(!circmetrics_rseq_tried)) {
+    circmetrics_rseq_setup();
+    if(circmetrics_rseq_cpu) return ck_pr_load_32(circmetrics_rseq_cpu) % fanout;
+  }
 #endif
+  if(unlikely(circmetrics_tid_uses == 0)) {
+    circmetrics_tid = __current_cpu();
+    circmetrics_tid_uses = CPU_REFRESH_INTERVAL;
   }
+  circmetrics_tid_uses--;
   return circmetrics_tid % fanout;
 }
 
+/* A "cat\x1fvalue" tag interned in its recorder's tag table.  Every
+ * namespace and handle carrying the same pair points at the one copy, so
+ * equal tags compare equal by pointer.  `refcnt` is guarded by the
+ * recorder's tag_lock.
+ */
+typedef struct stats_tag {
+  uint32_t                   refcnt;
+  uint16_t                   catlen;
+  uint16_t                   len;
+  char                       pair[];
+} stats_tag_t;
+/* The tags on a namespace or handle, guarded by the namespace's lock or
+ * the handle's meta_lock stripe. */
+typedef struct {
+  stats_tag_t              **tag;
+  uint16_t                   ntags;
+  uint16_t                   alloc;
+} stats_tagset_t;
+
+/* A recorder's slab.  Namespaces, containers with their keys, handles and
+ * their fan slots, interned tags, name caches and hash maps are carved out
+ * of large chunks instead of being malloc'd one by one, so registering
+ * does little more than bump a pointer and what is registered together
+ * sits together.  Freed pieces go on a free list per 16-byte size class;
+ * requests over SLAB_MAX fall through to calloc.  Sizes that are whole
+ * cache lines are handed out cache line aligned.
+ */
+#define SLAB_GRAIN 16
+#define SLAB_MAX 4096
+#define SLAB_CLASSES (SLAB_MAX / SLAB_GRAIN)
+#define SLAB_CHUNK_SIZE (256 * 1024)
+struct stats_slab_chunk {
+  struct stats_slab_chunk   *next;
+};
+struct stats_slab {
+  pthread_mutex_t            lock;
+  void                      *free[SLAB_CLASSES];
+  char                      *cur;
+  size_t                     left;
+  struct stats_slab_chunk   *chunks;
+};
+
+static void
+stats_slab_init(struct stats_slab *slab) {
+  memset(slab, 0, sizeof(*slab));
+  pthread_mutex_init(&slab->lock, NULL);
+}
+
+/* Returns zeroed memory. */
+static void *
+stats_slab_alloc(struct stats_slab *slab, size_t len) {
+  size_t cls, pad;
+  void *p;
+  if(len > SLAB_MAX) return calloc(1, len);
+  len = len ? (len + SLAB_GRAIN - 1) & ~(size_t)(SLAB_GRAIN - 1) : SLAB_GRAIN;
+  cls = len / SLAB_GRAIN - 1;
+  pthread_mutex_lock(&slab->lock);
+  if((p = slab->free[cls]) != NULL) {
+    slab->free[cls] = *(void **)p;
+  }
+  else {
+    pad = (len % CK_MD_CACHELINE) ? 0 : -(uintptr_t)slab->cur & (CK_MD_CACHELINE - 1);
+    if(slab->left < pad + len) {
+      struct stats_slab_chunk *chunk = malloc(SLAB_CHUNK_SIZE);
+      if(chunk == NULL) {
+        pthread_mutex_unlock(&slab->lock);
+        return NULL;
+      }
+      chunk->next = slab->chunks;
+      slab->chunks = chunk;
+      /* the data starts one cache line in, cache line aligned */
+      slab->cur = (char *)chunk + CK_MD_CACHELINE - ((uintptr_t)chunk & (CK_MD_CACHELINE - 1));
+      slab->left = (char *)chunk + SLAB_CHUNK_SIZE - slab->cur;
+      pad = 0;
+    }
+    p = slab->cur + pad;
+    slab->cur += pad + len;
+    slab->left -= pad + len;
+  }
+  pthread_mutex_unlock(&slab->lock);
+  memset(p, 0, len);
+  return p;
+}
+
+static void
+stats_slab_free(struct stats_slab *slab, void *p, size_t len) {
+  size_t cls;
+  if(p == NULL) return;
+  if(len > SLAB_MAX) {
+    free(p);
+    return;
+  }
+  len = len ? (len + SLAB_GRAIN - 1) & ~(size_t)(SLAB_GRAIN - 1) : SLAB_GRAIN;
+  cls = len / SLAB_GRAIN - 1;
+  pthread_mutex_lock(&slab->lock);
+  *(void **)p = slab->free[cls];
+  slab->free[cls] = p;
+  pthread_mutex_unlock(&slab->lock);
+}
+
+static char *
+stats_slab_strdup(struct stats_slab *slab, const char *s) {
+  size_t len = strlen(s) + 1;
+  char *p = stats_slab_alloc(slab, len);
+  if(p) memcpy(p, s, len);
+  return p;
+}
+static void
+stats_slab_strfree(struct stats_slab *slab, char *s) {
+  if(s) stats_slab_free(slab, s, strlen(s) + 1);
+}
+
+#define STATS_META_LOCKS 64
 struct stats_recorder_t {
-  struct stats_ns_t *global;
+  struct stats_ns_t         *global;
+  pthread_mutex_t            tag_lock;
+  /* Striped over handles; guards each handle's tags, tagged name and name
+   * cache, whose updates allocate and take other locks. */
+  pthread_mutex_t            meta_lock[STATS_META_LOCKS];
+  ck_hs_t                    tags;
+  stats_hist_format_t        hist_format;
+  /* Bumped by each export pass; writers stamp handles with it. */
+  uint64_t                   epoch;
+  struct stats_slab          slab;
+  /* set once stats_recorder_set_refresh starts worker threads */
+  struct stats_refresh_pool *refresh_pool;
+};
+struct stats_cursor {
+  uint64_t                   since;
+  uint32_t                   exports;
+  uint32_t                   full_every;
+};
+struct stats_delta {
+  uint64_t                   since;
+  uint64_t                   epoch;
+};
+/* When a refresh callback (stats_invoke or stats_ns_invoke) may run next.
+ * Whoever runs it first claims `busy`: a walker for the length of the
+ * call, or the refresh pool from when it is queued.  It runs for `h`, or
+ * else for `node` in `ns`. */
+struct stats_refresh {
+  uint64_t                   interval;  /* ns; 0 runs it on every export */
+  uint64_t                   last;      /* when the last run started */
+  int                        busy;
+  struct stats_refresh      *next;      /* in the pool's queue */
+  stats_handle_t            *h;
+  stats_ns_t                *ns;
+  struct stats_ns_freshnode *node;
 };
 struct stats_ns_freshnode {
   stats_ns_update_func_t f;
   void *closure;
   struct stats_ns_freshnode *next;
+  struct stats_refresh refresh;
 };
 struct stats_ns_t {
   stats_recorder_t          *rec;
+  char                      *name;      /* its key in its parent; NULL for global */
   pthread_rwlock_t           lock;
   ck_hs_t                    map;
-  ck_hs_t                    tags;
+  stats_tagset_t             tags;
+  uint64_t                   tag_gen;
   struct stats_ns_freshnode *freshen;
+  /* Policies: past max_handles new names share the _overflow handle, and
+   * handles left unwritten for ttl export passes are removed (0 is off).
+   * nhandles counts the names registered under the limit and retired
+   * holds the handles expiry removed; both are guarded by the write lock. */
+  int                        max_handles;
+  int                        nhandles;
+  uint32_t                   ttl;
+  struct stats_retired      *retired;
+  /* set once if this namespace holds a family's label sets */
+  struct stats_family       *family;
 };
-struct stats_handle_t {
-  stats_ns_t              *ns;
-  ck_hs_t                  tags;
-  bool                     tagged_suppress;
+/* A lock-free histogram front buffer.  Writers bump counts in the active
+ * table without taking the slot mutex; capture flips `active`, waits for
+ * the writers of the retired table to drain and folds it into the slot's
+ * histogram.  Keys are the raw hist_bucket_t bits plus one (0 is empty).
+ */
+struct stats_hist_lf_table {
+  uint32_t                 key[LF_HIST_BUCKETS];
+  uint64_t                 count[LF_HIST_BUCKETS];
+};
+struct stats_hist_lf {
+  unsigned int               active;
+  unsigned int               writers[2];
+  struct stats_hist_lf_table buf[2];
+};
+/* A per-thread, single-producer ring of raw histogram samples.  The owning
+ * thread appends without locks; exporters (and the owner, when the ring is
+ * full) drain it into the handles' fan slots under `drain_lock`.
+ */
+struct stats_hist_sample {
+  stats_handle_t          *h;
+  union {
+    int64_t                  i;
+    double                   d;
+  }                        v;
+  int                      scale;
+  uint64_t                 cnt;
+};
+struct stats_hist_ring {
+  uint32_t                 head;
+  uint32_t                 tail;
+  unsigned int             in_use;
+  int                      slot;
+  pthread_mutex_t          drain_lock;
+  struct stats_hist_ring  *next;
+  struct stats_hist_sample samples[HIST_RING_SIZE];
+};
+/* Per-handle state most handles never use: allocated from the recorder's
+ * slab the first time a handle is tagged, renamed, invoked or compared by
+ * a delta export, and kept until the handle is freed. */
+struct stats_handle_cold {
+  stats_tagset_t           tags;
+  uint64_t                 tag_gen;
   char                    *tagged_name;
-  stats_type_t             type;
-
   stats_invocation_func_t  cb;
   void                    *cb_closure;
-
+  struct stats_refresh    *refresh;
+  /* for observed or invoked scalars, the bits of the value last seen by a
+   * delta export */
+  uint64_t                 delta_bits;
+};
+/* An encoded "name|ST[...]"; the plain name is its first name_len bytes. */
+struct stats_name_cache {
+  int                      name_len;
+  char                     name[];
+};
+struct stats_handle_t {
+  stats_ns_t              *ns;
+  struct stats_handle_cold *cold;
   void                    *valueptr;
+  /* The recorder epoch of the last write. */
+  uint64_t                 dirty;
+  /* The encoded name as of the summed tag generations of this handle and
+   * its enclosing namespaces; guarded by the recorder's meta_lock. */
+  struct stats_name_cache *tagged_cache;
+  uint64_t                 tagged_cache_gen;
+  stats_type_t             type : 8;
+  bool                     tagged_suppress;
+  bool                     hist_ring;
+  /* guards a string handle's value while it is copied */
+  ck_spinlock_t            lock;
 
+  /* Only the member for the handle's type is allocated. */
   union {
-    char                     pad[CK_MD_CACHELINE];
+    union {
+      int32_t                  i32;
+      uint32_t                 u32;
+      int64_t                  i64;
+      uint64_t                 u64;
+      double                   d;
+    }                        store;
     struct {
-      histogram_t             *hist;
-      uint64_t                 incr;
-      pthread_mutex_t          mutex;
-    }                        cpu;
-  }                       *fan;
-  int                      fanout;
-  histogram_t             *hist_aggr;
-  int                      last_size;
-
-  union {
-    int32_t                  i32;
-    uint32_t                 u32;
-    int64_t                  i64;
-    uint64_t                 u64;
-    double                   d;
-  }                        store;
-  struct {
-    char *                   value;
-    int                      len;
-  }                        str;
-  char                   **strref;
-  pthread_mutex_t        mutex;
+      char *                   value;
+      int                      len;
+    }                        str;
+    struct {
+      union {
+        char                     pad[CK_MD_CACHELINE];
+        struct {
+          histogram_t             *hist;
+          uint64_t                 incr;
+          pthread_mutex_t          mutex;
+          struct stats_hist_lf    *lf;
+        }                        cpu;
+        struct {
+          uint64_t                 count;
+          int64_t                  isum;
+          uint64_t                 dsum;  /* double bits */
+          uint64_t                 min;   /* double bits */
+          uint64_t                 max;   /* double bits */
+        }                        summary;
+      }                       *fan;
+      histogram_t             *hist_aggr;
+      int                      fanout;
+    }                        agg;
+  }                        u;
 };
 
+static size_t
+stats_handle_size(stats_type_t type) {
+  switch(type) {
+  case STATS_TYPE_STRING:
+    return offsetof(stats_handle_t, u) + sizeof(((stats_handle_t *)0)->u.str);
+  case STATS_TYPE_COUNTER:
+  case STATS_TYPE_SUMMARY:
+  case STATS_TYPE_HISTOGRAM:
+  case STATS_TYPE_HISTOGRAM_FAST:
+    return offsetof(stats_handle_t, u) + sizeof(((stats_handle_t *)0)->u.agg);
+  default:
+    break;
+  }
+  return offsetof(stats_handle_t, u) + sizeof(((stats_handle_t *)0)->u.store);
+}
+
+static const stats_tagset_t stats_no_tags;
+static inline const stats_tagset_t *
+stats_handle_tags(stats_handle_t *h) {
+  struct stats_handle_cold *cold = ck_pr_load_ptr(&h->cold);
+  return cold ? &cold->tags : &stats_no_tags;
+}
+static inline pthread_mutex_t *
+stats_handle_meta_lock(stats_handle_t *h) {
+  return &h->ns->rec->meta_lock[((uintptr_t)h >> 6) % STATS_META_LOCKS];
+}
+static inline uint64_t
+stats_handle_tag_gen(stats_handle_t *h) {
+  struct stats_handle_cold *cold = ck_pr_load_ptr(&h->cold);
+  return cold ? ck_pr_load_64(&cold->tag_gen) : 0;
+}
+static inline bool
+stats_handle_has_cb(stats_handle_t *h) {
+  struct stats_handle_cold *cold = ck_pr_load_ptr(&h->cold);
+  return cold && cold->cb;
+}
+
+/* Marks the handle changed for delta exports, once its value is written,
+ * in the epoch the writer read.  An export that began since may have
+ * walked past the handle before the store, so the epoch is read again and
+ * a late write stamped into the next export. */
+static inline void
+stats_handle_stamp(stats_handle_t *h, uint64_t epoch) {
+  uint64_t now;
+  ck_pr_store_64(&h->dirty, epoch);
+  ck_pr_fence_memory();
+  if((now = ck_pr_load_64(&h->ns->rec->epoch)) != epoch) ck_pr_store_64(&h->dirty, now);
+}
+/* The store is skipped when the handle was already written this epoch, so
+ * hot handles stay shared. */
+static inline void
+stats_handle_touch(stats_handle_t *h) {
+  uint64_t epoch = ck_pr_load_64(&h->ns->rec->epoch);
+  if(ck_pr_load_64(&h->dirty) < epoch) stats_handle_stamp(h, epoch);
+}
+
 // The one true container for all things
 // The hashes hold these...
 typedef struct stats_container_t {
@@ -113,10 +488,212 @@ typedef struct stats_container_t {
   stats_handle_t *handle;
   const char     *key;
   int             len;
+  /* unlinked by a deregistration; set under the namespace's write lock */
+  bool            removed;
+  /* created for a handle, so it counts against max_handles */
+  bool            counted;
 } stats_container_t;
 
-static void * hs_malloc(size_t r) { return malloc(r); }
-static void hs_free(void *p, size_t b, bool r) { (void)b; (void)r; free(p); return; }
+/* Deregistered handles and namespaces are unlinked at once but freed only
+ * after an epoch grace period, when no thread is still inside a section
+ * that began before the unlink.  Registration (whose lookups take no
+ * lock) and the Prometheus walk (which keeps handles past the namespace
+ * locks) run in sections; the other walkers hold the read lock that
+ * unlinking must take.  Writes never enter a section.  Each thread gets a
+ * record, adopted from an exited thread where possible.
+ */
+static ck_epoch_t stats_epoch;
+static pthread_key_t stats_epoch_key;
+static pthread_once_t stats_epoch_once = PTHREAD_ONCE_INIT;
+static __thread ck_epoch_record_t *circmetrics_epoch_rec;
+static __thread unsigned int circmetrics_epoch_depth;
+static __thread unsigned int circmetrics_epoch_pending;
+
+static void
+stats_epoch_release(void *vrec) {
+  /* run this thread's deferred frees before handing the record on */
+  ck_epoch_barrier(vrec);
+  circmetrics_epoch_pending = 0;
+  ck_epoch_unregister(vrec);
+  circmetrics_epoch_rec = NULL;
+}
+static void
+stats_epoch_init(void) {
+  ck_epoch_init(&stats_epoch);
+  pthread_key_create(&stats_epoch_key, stats_epoch_release);
+}
+static ck_epoch_record_t *
+stats_epoch_record(void) {
+  ck_epoch_record_t *r = circmetrics_epoch_rec;
+  void *p;
+  if(likely(r != NULL)) return r;
+  pthread_once(&stats_epoch_once, stats_epoch_init);
+  if((r = ck_epoch_recycle(&stats_epoch, NULL)) == NULL) {
+    if(posix_memalign(&p, CK_MD_CACHELINE, sizeof(*r))) return NULL;
+    r = p;
+    ck_epoch_register(&stats_epoch, r, NULL);
+  }
+  pthread_setspecific(stats_epoch_key, r);
+  circmetrics_epoch_rec = r;
+  return r;
+}
+/* Returns NULL only if this thread could not get a record at all */
+static ck_epoch_record_t *
+stats_epoch_begin(ck_epoch_section_t *section) {
+  ck_epoch_record_t *r = stats_epoch_record();
+  if(r == NULL) return NULL;
+  ck_epoch_begin(r, section);
+  circmetrics_epoch_depth++;
+  return r;
+}
+/* Leaving the outermost section frees whatever this thread deregistered
+ * that every other thread has since moved past. */
+static void
+stats_epoch_end(ck_epoch_record_t *r, ck_epoch_section_t *section) {
+  ck_epoch_end(r, section);
+  if(--circmetrics_epoch_depth == 0 && circmetrics_epoch_pending) ck_epoch_poll(r);
+}
+
+static uint64_t
+stats_nanos(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Refresh callbacks.  Each runs at most once per interval and never
+ * concurrently with itself; an export that finds one busy or not yet due
+ * reports the values it last produced.  Without a refresh pool the walkers
+ * run them inline as they reach them.  With one, each export first queues
+ * every due callback for the pool's threads, waits up to its budget, and
+ * walks without running any; stragglers finish in the background.
+ */
+#define REFRESH_MAX_THREADS 64
+/* The clock the budget's deadline is measured against; only the realtime
+ * clock where the condition variable's cannot be chosen (macOS). */
+#ifdef HAVE_PTHREAD_CONDATTR_SETCLOCK
+#define REFRESH_CLOCK CLOCK_MONOTONIC
+#else
+#define REFRESH_CLOCK CLOCK_REALTIME
+#endif
+struct stats_refresh_pool {
+  pthread_mutex_t            lock;
+  pthread_cond_t             work;
+  pthread_cond_t             done;
+  struct stats_refresh      *head;
+  struct stats_refresh     **tail;
+  int                        outstanding;  /* queued or running */
+  int                        threads;
+  uint64_t                   budget;       /* ns; 0 waits for everything */
+};
+static pthread_mutex_t stats_refresh_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static bool
+stats_refresh_claim(struct stats_refresh *r, uint64_t now) {
+  uint64_t last;
+  if(!ck_pr_cas_int(&r->busy, 0, 1)) return false;
+  last = ck_pr_load_64(&r->last);
+  if(last && now - last < ck_pr_load_64(&r->interval)) {
+    ck_pr_store_int(&r->busy, 0);
+    return false;
+  }
+  return true;
+}
+
+/* Once busy is cleared the handle (or namespace) may be freed, so that is
+ * the last thing done; the section keeps a callback that deregisters its
+ * own handle from having it reclaimed before then. */
+static void
+stats_refresh_run(struct stats_refresh *r, uint64_t now) {
+  ck_epoch_record_t *er;
+  ck_epoch_section_t section;
+  er = stats_epoch_begin(&section);
+  ck_pr_store_64(&r->last, now);
+  if(r->h) {
+    struct stats_handle_cold *cold = ck_pr_load_ptr(&r->h->cold);
+    stats_invocation_func_t cb = cold->cb;
+    if(cb) cb(r->h, &r->h->valueptr, cold->cb_closure);
+  }
+  else {
+    r->node->f(r->ns, r->node->closure);
+  }
+  ck_pr_fence_store();
+  ck_pr_store_int(&r->busy, 0);
+  if(er) stats_epoch_end(er, &section);
+}
+
+
+/* Runs the handle's invocation callback, if any is due and no refresh
+ * pool has been given it already. */
+static inline void
+stats_handle_run_cb(stats_handle_t *h) {
+  struct stats_handle_cold *cold = ck_pr_load_ptr(&h->cold);
+  uint64_t now;
+  if(cold == NULL || cold->cb == NULL || ck_pr_load_ptr(&h->ns->rec->refresh_pool)) return;
+  now = stats_nanos();
+  if(stats_refresh_claim(cold->refresh, now)) stats_refresh_run(cold->refresh, now);
+}
+
+static void *
+stats_refresh_worker(void *vpool) {
+  struct stats_refresh_pool *pool = vpool;
+  struct stats_refresh *r;
+  pthread_mutex_lock(&pool->lock);
+  for(;;) {
+    while((r = pool->head) == NULL) pthread_cond_wait(&pool->work, &pool->lock);
+    if((pool->head = r->next) == NULL) pool->tail = &pool->head;
+    pthread_mutex_unlock(&pool->lock);
+    stats_refresh_run(r, stats_nanos());
+    pthread_mutex_lock(&pool->lock);
+    if(--pool->outstanding == 0) pthread_cond_broadcast(&pool->done);
+  }
+  return NULL;
+}
+
+/* ck_malloc passes no context, so the recorder whose maps are about to
+ * allocate is named in hs_slab around the ck_hs calls that may allocate.
+ * Each map allocation records where it came from in a small header.
+ * Lookups read the maps without locks, so a map that ck_hs replaces (on
+ * growth) is freed only after an epoch grace period.
+ */
+struct stats_hs_block {
+  struct stats_slab *slab;
+  size_t             len;
+  ck_epoch_entry_t   entry;
+} __attribute__((aligned(16)));
+CK_EPOCH_CONTAINER(struct stats_hs_block, entry, stats_hs_block_entry)
+static __thread struct stats_slab *hs_slab;
+static void * hs_malloc(size_t r) {
+  size_t len = sizeof(struct stats_hs_block) + r;
+  struct stats_hs_block *b = hs_slab ? stats_slab_alloc(hs_slab, len) : malloc(len);
+  if(b == NULL) return NULL;
+  b->slab = hs_slab;
+  b->len = len;
+  return b + 1;
+}
+static void hs_block_free(struct stats_hs_block *b) {
+  if(b->slab) stats_slab_free(b->slab, b, b->len);
+  else free(b);
+}
+static void hs_block_reclaim(ck_epoch_entry_t *e) {
+  hs_block_free(stats_hs_block_entry(e));
+  circmetrics_epoch_pending--;
+}
+static void hs_free(void *p, size_t bytes, bool r) {
+  struct stats_hs_block *b;
+  ck_epoch_record_t *rec;
+  (void)bytes;
+  if(p == NULL) return;
+  b = (struct stats_hs_block *)p - 1;
+  if(!r) {
+    hs_block_free(b);
+    return;
+  }
+  /* without a record, leaking the old map beats freeing it under a reader */
+  if((rec = stats_epoch_record()) == NULL) return;
+  circmetrics_epoch_pending++;
+  ck_epoch_call(rec, &b->entry, hs_block_reclaim);
+}
 static struct ck_malloc hs_allocator = {
   .malloc = hs_malloc, .free = hs_free
 };
@@ -147,29 +724,36 @@ static bool hs_compare(const void *previous, const void *compare) {
   return false;
 }
 
+static void stats_tagset_free(stats_recorder_t *, stats_tagset_t *);
+static void stats_hist_rings_drain(void);
+static void stats_family_destroy(struct stats_family *);
+
 static void
 stats_ns_free(stats_ns_t *ns) {
-  void *vc;
+  struct stats_ns_freshnode *node;
   if(ns == NULL) return;
-  ck_hs_iterator_t iterator = CK_HS_ITERATOR_INITIALIZER;
-  while(ck_hs_next(&ns->tags, &iterator, &vc)) {
-    free(vc);
+  while((node = ns->freshen) != NULL) {
+    ns->freshen = node->next;
+    free(node);
   }
-  ck_hs_destroy(&ns->tags);
+  if(ns->family) stats_family_destroy(ns->family);
+  stats_tagset_free(ns->rec, &ns->tags);
+  ck_hs_destroy(&ns->map);
   pthread_rwlock_destroy(&ns->lock);
-  free(ns);
+  stats_slab_strfree(&ns->rec->slab, ns->name);
+  stats_slab_free(&ns->rec->slab, ns, sizeof(*ns));
 }
 static stats_ns_t *
 stats_ns_alloc(stats_recorder_t *rec) {
-  stats_ns_t *ns = calloc(1, sizeof(*ns));
-  if(ck_hs_init(&ns->map, CK_HS_MODE_OBJECT|CK_HS_MODE_SPMC,
-                hs_hash, hs_compare, &hs_allocator, 128, lrand48()) == 0) {
-    free(ns);
-    return NULL;
-  }
-  if(ck_hs_init(&ns->tags, CK_HS_MODE_OBJECT|CK_HS_MODE_SPMC,
-                hs_taghash, hs_tagcompare, &hs_allocator, 10, lrand48()) == 0) {
-    free(ns);
+  bool ok;
+  stats_ns_t *ns = stats_slab_alloc(&rec->slab, sizeof(*ns));
+  if(ns == NULL) return NULL;
+  hs_slab = &rec->slab;
+  ok = ck_hs_init(&ns->map, CK_HS_MODE_OBJECT|CK_HS_MODE_SPMC,
+                  hs_hash, hs_compare, &hs_allocator, 128, lrand48());
+  hs_slab = NULL;
+  if(!ok) {
+    stats_slab_free(&rec->slab, ns, sizeof(*ns));
     return NULL;
   }
   pthread_rwlock_init(&ns->lock, NULL);
@@ -189,27 +773,71 @@ stats_type_name(stats_type_t t) {
   case STATS_TYPE_DOUBLE: return "double";
   case STATS_TYPE_HISTOGRAM: return "histogram";
   case STATS_TYPE_HISTOGRAM_FAST: return "histogram_fast";
+  case STATS_TYPE_SUMMARY: return "summary";
   }
   return "unknown";
 }
 
 stats_recorder_t *
 stats_recorder_alloc(void) {
+  bool ok;
+  int i;
   stats_recorder_t *rec = calloc(1, sizeof(*rec));
+  if(rec == NULL) return NULL;
+  stats_slab_init(&rec->slab);
+  hs_slab = &rec->slab;
+  ok = ck_hs_init(&rec->tags, CK_HS_MODE_OBJECT|CK_HS_MODE_SPMC,
+                  hs_taghash, hs_tagcompare, &hs_allocator, 64, lrand48());
+  hs_slab = NULL;
+  if(!ok) {
+    free(rec);
+    return NULL;
+  }
+  pthread_mutex_init(&rec->tag_lock, NULL);
+  for(i=0;i<STATS_META_LOCKS;i++) pthread_mutex_init(&rec->meta_lock[i], NULL);
   rec->global = stats_ns_alloc(rec);
   return rec;
 }
 
+void
+stats_recorder_set_hist_format(stats_recorder_t *rec, stats_hist_format_t fmt) {
+  ck_pr_store_int((int *)&rec->hist_format, fmt);
+}
+
 stats_ns_t *
 stats_recorder_global_ns(stats_recorder_t *rec) {
   return rec ? rec->global : NULL;
 }
 
+static const char stats_overflow_name[] = "_overflow";
+
+static inline bool
+stats_ns_full(stats_ns_t *ns) {
+  int max = ck_pr_load_int(&ns->max_handles);
+  return max > 0 && ck_pr_load_int(&ns->nhandles) >= max;
+}
+
+void
+stats_ns_set_max_handles(stats_ns_t *ns, int max_handles) {
+  if(ns) ck_pr_store_int(&ns->max_handles, max_handles > 0 ? max_handles : 0);
+}
+
+void
+stats_ns_set_ttl(stats_ns_t *ns, int exports) {
+  if(ns) ck_pr_store_32(&ns->ttl, exports > 0 ? exports : 0);
+}
+
+/* A limited container counts against the namespace's max_handles; when
+ * the limit stops a new one being added, NULL is returned with *full set.
+ * Called in an epoch section: the lookup takes no lock, and only adding a
+ * container takes the namespace's write lock.
+ */
 static stats_container_t *
-stats_ns_add_container(stats_ns_t *ns, const char *name) {
+stats_ns_add_container(stats_ns_t *ns, const char *name, bool limited, bool *full) {
   long hashv;
   stats_container_t nc, *prev, *toadd = NULL;
 
+  if(full) *full = false;
   if(strchr(name, '"')) return NULL;
 
   nc.key = name;
@@ -217,24 +845,36 @@ stats_ns_add_container(stats_ns_t *ns, const char *name) {
   // hashv won't change
   hashv = CK_HS_HASH(&ns->map, hs_hash, &nc);
   do {
-    pthread_rwlock_rdlock(&ns->lock);
     prev = ck_hs_get(&ns->map, hashv, &nc);
-    pthread_rwlock_unlock(&ns->lock);
     if(!prev) {
-      toadd = calloc(1, sizeof(*toadd));
-      toadd->key = strdup(name);
-      toadd->len = strlen(toadd->key);
-    
+      if(limited && stats_ns_full(ns)) {
+        *full = true;
+        return NULL;
+      }
+      /* the key lives right behind its container */
+      toadd = stats_slab_alloc(&ns->rec->slab, sizeof(*toadd) + nc.len + 1);
+      if(toadd == NULL) return NULL;
+      memcpy(toadd + 1, name, nc.len + 1);
+      toadd->key = (const char *)(toadd + 1);
+      toadd->len = nc.len;
+      toadd->counted = limited;
+
       pthread_rwlock_wrlock(&ns->lock);
-      if(ck_hs_put(&ns->map, hashv, toadd)) {
-        prev = toadd;
-        toadd = NULL;
+      if(limited && stats_ns_full(ns) && ck_hs_get(&ns->map, hashv, &nc) == NULL) {
+        *full = true;
       }
-      pthread_rwlock_unlock(&ns->lock);
-      if(toadd) {
-        free((void *)toadd->key);
-        free(toadd);
+      else {
+        hs_slab = &ns->rec->slab;
+        if(ck_hs_put(&ns->map, hashv, toadd)) {
+          if(limited) ns->nhandles++;
+          prev = toadd;
+          toadd = NULL;
+        }
+        hs_slab = NULL;
       }
+      pthread_rwlock_unlock(&ns->lock);
+      if(toadd) stats_slab_free(&ns->rec->slab, toadd, sizeof(*toadd) + nc.len + 1);
+      if(limited && *full) return NULL;
     }
   } while(prev == NULL);
   return prev;
@@ -243,73 +883,186 @@ stats_ns_add_container(stats_ns_t *ns, const char *name) {
 stats_ns_t *
 stats_register_ns(stats_recorder_t *rec, stats_ns_t *ns, const char *name) {
   stats_container_t *c;
-  stats_ns_t *new_ns;
+  stats_ns_t *found = NULL, *new_ns = NULL;
+  ck_epoch_record_t *r;
+  ck_epoch_section_t section;
   if(rec == NULL && ns) rec = ns->rec;
   if(ns == NULL && rec) ns = rec->global;
   if(ns == NULL || rec == NULL) return NULL;
   if(ns->rec != rec) return NULL;
-  c = stats_ns_add_container(ns, name);
-  if(!c) return NULL;
-  if(c->ns) return c->ns;
-  new_ns = stats_ns_alloc(rec);
-  pthread_rwlock_wrlock(&ns->lock);
-  if(c->ns == NULL) {
-    c->ns = new_ns;
-    new_ns = NULL;
+  if((r = stats_epoch_begin(&section)) == NULL) return NULL;
+  /* a container deregistered under us is retried as a new one */
+  while((c = stats_ns_add_container(ns, name, false, NULL)) != NULL) {
+    if((found = ck_pr_load_ptr(&c->ns)) != NULL) break;
+    if(new_ns == NULL) {
+      if((new_ns = stats_ns_alloc(rec)) == NULL) break;
+      if((new_ns->name = stats_slab_strdup(&rec->slab, name)) == NULL) break;
+    }
+    pthread_rwlock_wrlock(&ns->lock);
+    if(!c->removed) {
+      if(c->ns == NULL) {
+        c->ns = new_ns;
+        new_ns = NULL;
+      }
+      found = c->ns;
+    }
+    pthread_rwlock_unlock(&ns->lock);
+    if(found) break;
   }
-  pthread_rwlock_unlock(&ns->lock);
+  stats_epoch_end(r, &section);
   if(new_ns != NULL) stats_ns_free(new_ns);
-  return c->ns;
+  return found;
+}
+
+/* The interned table is keyed by the pair string; entries point at `pair`. */
+#define STATS_TAG(p) ((stats_tag_t *)((char *)(p) - offsetof(stats_tag_t, pair)))
+
+static stats_tag_t *
+stats_tag_intern(stats_recorder_t *rec, const char *tagcat, const char *tagval) {
+  char pair[NOIT_TAG_MAX_PAIR_LEN+1];
+  int len = snprintf(pair, sizeof(pair), "%s%c%s", tagcat, NOIT_TAG_DECODED_SEPARATOR, tagval);
+  if(len >= (int)sizeof(pair)) len = sizeof(pair) - 1;
+  unsigned long hashv = CK_HS_HASH(&rec->tags, hs_taghash, pair);
+  stats_tag_t *tag;
+  void *vp;
+
+  pthread_mutex_lock(&rec->tag_lock);
+  if((vp = ck_hs_get(&rec->tags, hashv, pair)) != NULL) {
+    tag = STATS_TAG(vp);
+  }
+  else {
+    tag = stats_slab_alloc(&rec->slab, sizeof(*tag) + len + 1);
+    if(tag == NULL) {
+      pthread_mutex_unlock(&rec->tag_lock);
+      return NULL;
+    }
+    tag->refcnt = 0;
+    tag->catlen = strlen(tagcat);
+    tag->len = len;
+    memcpy(tag->pair, pair, len + 1);
+    hs_slab = &rec->slab;
+    ck_hs_put(&rec->tags, hashv, tag->pair);
+    hs_slab = NULL;
+  }
+  tag->refcnt++;
+  pthread_mutex_unlock(&rec->tag_lock);
+  return tag;
+}
+
+static void
+stats_tag_release(stats_recorder_t *rec, stats_tag_t *tag) {
+  pthread_mutex_lock(&rec->tag_lock);
+  if(--tag->refcnt == 0) {
+    ck_hs_remove(&rec->tags, CK_HS_HASH(&rec->tags, hs_taghash, tag->pair), tag->pair);
+    stats_slab_free(&rec->slab, tag, sizeof(*tag) + tag->len + 1);
+  }
+  pthread_mutex_unlock(&rec->tag_lock);
 }
 
 static void
-stats_add_tag(ck_hs_t *map, const char *tagcat, const char *tagval) {
-  if(!tagcat || strlen(tagcat)==0) return; /* We do not support empty tagcat */
+stats_tagset_free(stats_recorder_t *rec, stats_tagset_t *set) {
+  int i;
+  for(i=0;i<set->ntags;i++) stats_tag_release(rec, set->tag[i]);
+  free(set->tag);
+  set->tag = NULL;
+  set->ntags = set->alloc = 0;
+}
+
+/* Returns false if the tag could not be added (empty category or no memory) */
+static bool
+stats_add_tag(stats_recorder_t *rec, stats_tagset_t *set, const char *tagcat, const char *tagval) {
+  int i;
+  stats_tag_t *tag;
+  if(!tagcat || strlen(tagcat)==0) return false; /* We do not support empty tagcat */
   if(!tagval) tagval = "";
-  char tag[NOIT_TAG_MAX_PAIR_LEN+1];
-  snprintf(tag, sizeof(tag), "%s%c%s", tagcat, NOIT_TAG_DECODED_SEPARATOR, tagval);
-  unsigned long hashv = CK_HS_HASH(map, hs_taghash, tag);
-  void *prev = NULL;
-  if(ck_hs_set(map, hashv, strdup(tag), &prev)) {
-    if(prev) free(prev);
+  if((tag = stats_tag_intern(rec, tagcat, tagval)) == NULL) return false;
+  for(i=0;i<set->ntags;i++) {
+    if(set->tag[i] == tag) {
+      stats_tag_release(rec, tag);
+      return true;
+    }
+  }
+  if(set->ntags == set->alloc) {
+    uint16_t alloc = set->alloc ? set->alloc * 2 : 2;
+    stats_tag_t **grown = realloc(set->tag, alloc * sizeof(*grown));
+    if(grown == NULL) {
+      stats_tag_release(rec, tag);
+      return false;
+    }
+    set->tag = grown;
+    set->alloc = alloc;
   }
+  set->tag[set->ntags++] = tag;
+  return true;
 }
 
 static void
-stats_replace_tag(ck_hs_t *map, const char *tagcat, const char *tagval) {
-  char *name;
-  void *vc;
-  ck_hs_iterator_t iterator = CK_HS_ITERATOR_INITIALIZER;
-  while(ck_hs_next(map, &iterator, &vc)) {
-    name = vc;
-    if(0 == strncmp(name, tagcat, strlen(tagcat)) &&
-       name[strlen(tagcat)] == NOIT_TAG_DECODED_SEPARATOR) {
-      unsigned long hashv = CK_HS_HASH(map, hs_taghash, name);
-      ck_hs_remove(map, hashv, name);
+stats_replace_tag(stats_recorder_t *rec, stats_tagset_t *set, const char *tagcat, const char *tagval) {
+  int i, keep = 0;
+  size_t catlen = tagcat ? strlen(tagcat) : 0;
+  stats_tag_t *held;
+  if(catlen == 0) return;
+  /* keep the old value if the new one cannot be interned */
+  if((held = stats_tag_intern(rec, tagcat, tagval ? tagval : "")) == NULL) return;
+  for(i=0;i<set->ntags;i++) {
+    stats_tag_t *tag = set->tag[i];
+    if(tag->catlen == catlen && !memcmp(tag->pair, tagcat, catlen)) {
+      stats_tag_release(rec, tag);
+    }
+    else {
+      set->tag[keep++] = tag;
     }
   }
-  stats_add_tag(map, tagcat, tagval);
+  set->ntags = keep;
+  stats_add_tag(rec, set, tagcat, tagval);
+  stats_tag_release(rec, held);
 }
 
 void
 stats_ns_add_tag(stats_ns_t *ns, const char *tagcat, const char *tagval) {
   pthread_rwlock_wrlock(&ns->lock);
-  stats_add_tag(&ns->tags, tagcat, tagval);
+  stats_add_tag(ns->rec, &ns->tags, tagcat, tagval);
+  ck_pr_inc_64(&ns->tag_gen);
   pthread_rwlock_unlock(&ns->lock);
 }
 
 void
 stats_ns_replace_tag(stats_ns_t *ns, const char *tagcat, const char *tagval) {
   pthread_rwlock_wrlock(&ns->lock);
-  stats_replace_tag(&ns->tags, tagcat, tagval);
+  stats_replace_tag(ns->rec, &ns->tags, tagcat, tagval);
+  ck_pr_inc_64(&ns->tag_gen);
   pthread_rwlock_unlock(&ns->lock);
 }
 
+static struct stats_handle_cold *
+stats_handle_cold(stats_handle_t *h) {
+  struct stats_handle_cold *cold = ck_pr_load_ptr(&h->cold);
+  if(cold == NULL) {
+    if((cold = stats_slab_alloc(&h->ns->rec->slab, sizeof(*cold))) == NULL) return NULL;
+    if(!ck_pr_cas_ptr(&h->cold, NULL, cold)) {
+      stats_slab_free(&h->ns->rec->slab, cold, sizeof(*cold));
+      cold = ck_pr_load_ptr(&h->cold);
+    }
+  }
+  return cold;
+}
+
 void
 stats_handle_tagged_name(stats_handle_t *h, const char *name) {
-  if(h->tagged_name) free(h->tagged_name);
-  h->tagged_name = name ? strdup(name) : NULL;
-  if(h->tagged_name == NULL) h->tagged_suppress = true;
+  struct stats_handle_cold *cold = stats_handle_cold(h);
+  char *copy = name ? stats_slab_strdup(&h->ns->rec->slab, name) : NULL, *old;
+  if(cold == NULL) {
+    stats_slab_strfree(&h->ns->rec->slab, copy);
+    return;
+  }
+  pthread_mutex_lock(stats_handle_meta_lock(h));
+  old = cold->tagged_name;
+  cold->tagged_name = copy;
+  if(cold->tagged_name == NULL) h->tagged_suppress = true;
+  ck_pr_inc_64(&cold->tag_gen);
+  stats_handle_touch(h);
+  pthread_mutex_unlock(stats_handle_meta_lock(h));
+  stats_slab_strfree(&h->ns->rec->slab, old);
 }
 
 void
@@ -319,118 +1072,413 @@ stats_handle_tagged_suppress(stats_handle_t *h) {
 
 void
 stats_handle_add_tag(stats_handle_t *h, const char *tagcat, const char *tagval) {
-  pthread_mutex_lock(&h->mutex);
-  stats_add_tag(&h->tags, tagcat, tagval);
-  pthread_mutex_unlock(&h->mutex);
+  struct stats_handle_cold *cold = stats_handle_cold(h);
+  if(cold == NULL) return;
+  pthread_mutex_lock(stats_handle_meta_lock(h));
+  stats_add_tag(h->ns->rec, &cold->tags, tagcat, tagval);
+  ck_pr_inc_64(&cold->tag_gen);
+  stats_handle_touch(h);
+  pthread_mutex_unlock(stats_handle_meta_lock(h));
 }
 
 bool
-stats_ns_invoke(stats_ns_t *ns, stats_ns_update_func_t f, void *closure) {
-  struct stats_ns_freshnode *node = calloc(1, sizeof(*node));
+stats_ns_invoke_interval(stats_ns_t *ns, stats_ns_update_func_t f, void *closure,
+                         int min_interval_ms) {
+  struct stats_ns_freshnode *node;
+  if(ns == NULL || f == NULL || (node = calloc(1, sizeof(*node))) == NULL) return false;
   node->f = f;
   node->closure = closure;
+  node->refresh.interval = min_interval_ms > 0 ? min_interval_ms * 1000000ULL : 0;
+  node->refresh.ns = ns;
+  node->refresh.node = node;
   pthread_rwlock_wrlock(&ns->lock);
   node->next = ns->freshen;
-  ns->freshen = node;
+  ck_pr_fence_store();
+  ck_pr_store_ptr(&ns->freshen, node);
   pthread_rwlock_unlock(&ns->lock);
   return true;
 }
 
+bool
+stats_ns_invoke(stats_ns_t *ns, stats_ns_update_func_t f, void *closure) {
+  return stats_ns_invoke_interval(ns, f, closure, 0);
+}
+
 void
 stats_ns_update(stats_ns_t *ns) {
   struct stats_ns_freshnode *node;
-  if(!ns) return;
-  for(node = ns->freshen; node; node = node->next) {
-    node->f(ns, node->closure);
+  uint64_t now;
+  if(!ns || ck_pr_load_ptr(&ns->freshen) == NULL || ck_pr_load_ptr(&ns->rec->refresh_pool)) return;
+  now = stats_nanos();
+  for(node = ck_pr_load_ptr(&ns->freshen); node; node = node->next) {
+    if(stats_refresh_claim(&node->refresh, now)) stats_refresh_run(&node->refresh, now);
   }
 }
 
-static stats_handle_t *
-stats_handle_alloc(stats_ns_t *ns, stats_type_t type, int fanout) {
-  stats_handle_t *h = calloc(1, sizeof(*h));
-  h->ns = ns;
-  h->type = type;
-  if(ck_hs_init(&h->tags, CK_HS_MODE_OBJECT|CK_HS_MODE_SPMC,
-                hs_taghash, hs_tagcompare, &hs_allocator, 10, lrand48()) == 0) {
-    free(h);
-    return NULL;
+/* Claims whatever is due under ns for the pool, in a list ending at *tail */
+static int
+stats_refresh_collect(stats_ns_t *ns, uint64_t now, struct stats_refresh ***tail) {
+  struct stats_ns_freshnode *node;
+  struct stats_handle_cold *cold;
+  ck_hs_iterator_t iterator = CK_HS_ITERATOR_INITIALIZER;
+  void *vc;
+  int n = 0;
+  pthread_rwlock_rdlock(&ns->lock);
+  for(node = ns->freshen; node; node = node->next) {
+    if(!stats_refresh_claim(&node->refresh, now)) continue;
+    **tail = &node->refresh;
+    *tail = &node->refresh.next;
+    n++;
   }
-  h->strref = &h->str.value;
-  if(type == STATS_TYPE_HISTOGRAM ||
-     type == STATS_TYPE_HISTOGRAM_FAST ||
-     type == STATS_TYPE_COUNTER) {
-    h->fanout = fanout;
-    if(h->fanout < 1) h->fanout = DEFAULT_FANOUT;
-    if(h->fanout > MAX_FANOUT) h->fanout = MAX_FANOUT;
-    h->fan = calloc(h->fanout, sizeof(*h->fan));
+  while(ck_hs_next(&ns->map, &iterator, &vc)) {
+    stats_container_t *c = vc;
+    if(c->ns) n += stats_refresh_collect(c->ns, now, tail);
+    if(c->handle == NULL || (cold = ck_pr_load_ptr(&c->handle->cold)) == NULL ||
+       ck_pr_load_ptr(&cold->cb) == NULL || !stats_refresh_claim(cold->refresh, now))
+      continue;
+    **tail = cold->refresh;
+    *tail = &cold->refresh->next;
+    n++;
   }
-  if(type == STATS_TYPE_STRING) {
-    h->valueptr = NULL;
+  pthread_rwlock_unlock(&ns->lock);
+  return n;
+}
+
+/* Run at the start of every export of rec */
+static void
+stats_refresh_dispatch(stats_recorder_t *rec) {
+  struct stats_refresh_pool *pool = ck_pr_load_ptr(&rec->refresh_pool);
+  struct stats_refresh *head = NULL, **tail = &head;
+  struct timespec deadline;
+  uint64_t now;
+  int n;
+  if(pool == NULL) return;
+  if((n = stats_refresh_collect(rec->global, stats_nanos(), &tail)) == 0) return;
+  *tail = NULL;
+  clock_gettime(REFRESH_CLOCK, &deadline);
+  now = (uint64_t)deadline.tv_sec * 1000000000ULL + deadline.tv_nsec + pool->budget;
+  deadline.tv_sec = now / 1000000000ULL;
+  deadline.tv_nsec = now % 1000000000ULL;
+  pthread_mutex_lock(&pool->lock);
+  *pool->tail = head;
+  pool->tail = tail;
+  pool->outstanding += n;
+  pthread_cond_broadcast(&pool->work);
+  while(pool->outstanding) {
+    if(pool->budget == 0) pthread_cond_wait(&pool->done, &pool->lock);
+    else if(pthread_cond_timedwait(&pool->done, &pool->lock, &deadline) == ETIMEDOUT) break;
   }
-  else if(type == STATS_TYPE_HISTOGRAM_FAST) {
-    int i;
-    for(i=0;i<h->fanout;i++) {
-      h->fan[i].cpu.hist = hist_fast_alloc();
-      pthread_mutex_init(&h->fan[i].cpu.mutex, NULL);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+bool
+stats_recorder_set_refresh(stats_recorder_t *rec, int threads, int budget_ms) {
+  struct stats_refresh_pool *pool;
+  pthread_condattr_t attr;
+  pthread_t tid;
+  if(rec == NULL || threads < 0 || budget_ms < 0) return false;
+  if(threads > REFRESH_MAX_THREADS) threads = REFRESH_MAX_THREADS;
+  pthread_mutex_lock(&stats_refresh_pool_lock);
+  if((pool = rec->refresh_pool) == NULL) {
+    if(threads == 0 || (pool = calloc(1, sizeof(*pool))) == NULL) {
+      pthread_mutex_unlock(&stats_refresh_pool_lock);
+      return threads == 0;
     }
-    h->hist_aggr = hist_fast_alloc();
-    h->valueptr = h->hist_aggr;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_condattr_init(&attr);
+#ifdef HAVE_PTHREAD_CONDATTR_SETCLOCK
+    pthread_condattr_setclock(&attr, REFRESH_CLOCK);
+#endif
+    pthread_cond_init(&pool->done, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_cond_init(&pool->work, NULL);
+    pool->tail = &pool->head;
   }
-  else if(type == STATS_TYPE_HISTOGRAM) {
-    int i;
-    for(i=0;i<h->fanout;i++) {
-      h->fan[i].cpu.hist = hist_alloc();
-      pthread_mutex_init(&h->fan[i].cpu.mutex, NULL);
-    }
-    h->hist_aggr = hist_alloc();
-    h->valueptr = h->hist_aggr;
+  pool->budget = budget_ms * 1000000ULL;
+  while(pool->threads < threads) {
+    if(pthread_create(&tid, NULL, stats_refresh_worker, pool)) break;
+    pthread_detach(tid);
+    pool->threads++;
   }
-  else {
-    stats_observe(h, type, &h->store);
+  /* the walkers stop running callbacks only once someone else will */
+  if(rec->refresh_pool == NULL && pool->threads) ck_pr_store_ptr(&rec->refresh_pool, pool);
+  pthread_mutex_unlock(&stats_refresh_pool_lock);
+  if(rec->refresh_pool != pool) {
+    pthread_cond_destroy(&pool->done);
+    pthread_cond_destroy(&pool->work);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+    return false;
   }
-  pthread_mutex_init(&h->mutex, NULL);
-  return h;
+  return pool->threads >= threads;
+}
+
+static inline uint64_t
+stats_double_bits(double d) {
+  uint64_t bits;
+  memcpy(&bits, &d, sizeof(bits));
+  return bits;
+}
+static inline double
+stats_bits_double(uint64_t bits) {
+  double d;
+  memcpy(&d, &bits, sizeof(d));
+  return d;
 }
 
 static void
-stats_handle_free(stats_handle_t *h) {
+stats_summary_reset(stats_handle_t *h) {
   int i;
-  void *vc;
-  if(h == NULL) return;
-  for(i=0;i<h->fanout;i++) {
-    if(h->fan[i].cpu.hist) hist_free(h->fan[i].cpu.hist);
-  }
-  ck_hs_iterator_t iterator = CK_HS_ITERATOR_INITIALIZER;
-  while(ck_hs_next(&h->tags, &iterator, &vc)) {
-    free(vc);
+  for(i=0;i<h->u.agg.fanout;i++) {
+    ck_pr_store_64(&h->u.agg.fan[i].summary.count, 0);
+    ck_pr_fence_store();
+    ck_pr_store_64((uint64_t *)&h->u.agg.fan[i].summary.isum, 0);
+    ck_pr_store_64(&h->u.agg.fan[i].summary.dsum, stats_double_bits(0.0));
+    ck_pr_store_64(&h->u.agg.fan[i].summary.min, stats_double_bits(INFINITY));
+    ck_pr_store_64(&h->u.agg.fan[i].summary.max, stats_double_bits(-INFINITY));
   }
-  ck_hs_destroy(&h->tags);
-  free(h->fan);
-  if(h->hist_aggr) hist_free(h->hist_aggr);
-  free(h);
 }
 
-stats_handle_t *
-stats_register_fanout(stats_ns_t *ns, const char *name, stats_type_t type, int fanout) {
+static bool
+stats_summary_observe(stats_handle_t *h, int64_t iv, double dv, bool is_double) {
+  int cpu = __get_fanout(h->u.agg.fanout);
+  double v = is_double ? dv : (double)iv;
+  uint64_t cur;
+
+  if(isnan(v)) return false;
+  if(is_double) {
+    cur = ck_pr_load_64(&h->u.agg.fan[cpu].summary.dsum);
+    while(!ck_pr_cas_64_value(&h->u.agg.fan[cpu].summary.dsum, cur,
+                              stats_double_bits(stats_bits_double(cur) + v), &cur));
+  }
+  else {
+    ck_pr_add_64((uint64_t *)&h->u.agg.fan[cpu].summary.isum, (uint64_t)iv);
+  }
+  cur = ck_pr_load_64(&h->u.agg.fan[cpu].summary.min);
+  while(v < stats_bits_double(cur) &&
+        !ck_pr_cas_64_value(&h->u.agg.fan[cpu].summary.min, cur, stats_double_bits(v), &cur));
+  cur = ck_pr_load_64(&h->u.agg.fan[cpu].summary.max);
+  while(v > stats_bits_double(cur) &&
+        !ck_pr_cas_64_value(&h->u.agg.fan[cpu].summary.max, cur, stats_double_bits(v), &cur));
+  /* counted last, so a fold that sees the count sees what it covers */
+  ck_pr_fence_store();
+  ck_pr_inc_64(&h->u.agg.fan[cpu].summary.count);
+  return true;
+}
+
+struct stats_summary_value {
+  uint64_t count;
+  double   sum;
+  double   min;
+  double   max;
+  double   mean;
+};
+#define SUMMARY_NCOMPONENTS 5
+static const char *stats_summary_component_names[SUMMARY_NCOMPONENTS] = {
+  "count", "sum", "min", "max", "mean"
+};
+
+static void
+stats_summary_fold(stats_handle_t *h, struct stats_summary_value *sv) {
+  int i;
+  int64_t isum = 0;
+  double dsum = 0;
+  sv->count = 0;
+  sv->min = INFINITY;
+  sv->max = -INFINITY;
+  for(i=0;i<h->u.agg.fanout;i++) {
+    double min, max;
+    uint64_t count = ck_pr_load_64(&h->u.agg.fan[i].summary.count);
+    if(count == 0) continue;
+    ck_pr_fence_load();
+    min = stats_bits_double(ck_pr_load_64(&h->u.agg.fan[i].summary.min));
+    max = stats_bits_double(ck_pr_load_64(&h->u.agg.fan[i].summary.max));
+    /* a slot being reset under us */
+    if(min > max) continue;
+    sv->count += count;
+    isum += (int64_t)ck_pr_load_64((uint64_t *)&h->u.agg.fan[i].summary.isum);
+    dsum += stats_bits_double(ck_pr_load_64(&h->u.agg.fan[i].summary.dsum));
+    if(min < sv->min) sv->min = min;
+    if(max > sv->max) sv->max = max;
+  }
+  sv->sum = (double)isum + dsum;
+  sv->mean = sv->count ? sv->sum / (double)sv->count : NAN;
+}
+
+/* Returns a pointer to the component's value, or NULL if it is undefined
+ * (the min, max and mean of an empty summary). */
+static void *
+stats_summary_component(struct stats_summary_value *sv, int i, stats_type_t *type) {
+  *type = (i == 0) ? STATS_TYPE_UINT64 : STATS_TYPE_DOUBLE;
+  switch(i) {
+  case 0: return &sv->count;
+  case 1: return &sv->sum;
+  }
+  if(sv->count == 0) return NULL;
+  switch(i) {
+  case 2: return &sv->min;
+  case 3: return &sv->max;
+  case 4: return &sv->mean;
+  }
+  return NULL;
+}
+
+static stats_handle_t *
+stats_handle_alloc(stats_ns_t *ns, stats_type_t type, int fanout) {
+  stats_handle_t *h = stats_slab_alloc(&ns->rec->slab, stats_handle_size(type));
+  if(h == NULL) return NULL;
+  h->ns = ns;
+  h->type = type;
+  h->dirty = ck_pr_load_64(&ns->rec->epoch);
+  if(type == STATS_TYPE_HISTOGRAM ||
+     type == STATS_TYPE_HISTOGRAM_FAST ||
+     type == STATS_TYPE_COUNTER ||
+     type == STATS_TYPE_SUMMARY) {
+    h->u.agg.fanout = fanout;
+    if(h->u.agg.fanout < 1) h->u.agg.fanout = DEFAULT_FANOUT;
+    if(h->u.agg.fanout > MAX_FANOUT) h->u.agg.fanout = MAX_FANOUT;
+    h->u.agg.fan = stats_slab_alloc(&ns->rec->slab, h->u.agg.fanout * sizeof(*h->u.agg.fan));
+  }
+  if(type == STATS_TYPE_STRING) {
+    h->valueptr = NULL;
+  }
+  else if(type == STATS_TYPE_HISTOGRAM_FAST) {
+    int i;
+    for(i=0;i<h->u.agg.fanout;i++) {
+      h->u.agg.fan[i].cpu.hist = hist_fast_alloc();
+      pthread_mutex_init(&h->u.agg.fan[i].cpu.mutex, NULL);
+    }
+    h->u.agg.hist_aggr = hist_fast_alloc();
+    h->valueptr = h->u.agg.hist_aggr;
+  }
+  else if(type == STATS_TYPE_HISTOGRAM) {
+    int i;
+    for(i=0;i<h->u.agg.fanout;i++) {
+      h->u.agg.fan[i].cpu.hist = hist_alloc();
+      pthread_mutex_init(&h->u.agg.fan[i].cpu.mutex, NULL);
+    }
+    h->u.agg.hist_aggr = hist_alloc();
+    h->valueptr = h->u.agg.hist_aggr;
+  }
+  else if(type == STATS_TYPE_SUMMARY) {
+    stats_summary_reset(h);
+  }
+  else {
+    stats_observe(h, type, &h->u.store);
+  }
+  ck_spinlock_init(&h->lock);
+  return h;
+}
+
+static void
+stats_name_cache_free(struct stats_slab *slab, struct stats_name_cache *nc) {
+  if(nc) stats_slab_free(slab, nc, sizeof(*nc) + strlen(nc->name) + 1);
+}
+
+/* Takes the recorder since a deregistered handle may outlive its namespace */
+static void
+stats_handle_free(stats_recorder_t *rec, stats_handle_t *h) {
+  int i;
+  struct stats_slab *slab;
+  if(h == NULL) return;
+  slab = &rec->slab;
+  switch(h->type) {
+  case STATS_TYPE_HISTOGRAM:
+  case STATS_TYPE_HISTOGRAM_FAST:
+    for(i=0;i<h->u.agg.fanout;i++) {
+      if(h->u.agg.fan[i].cpu.hist) hist_free(h->u.agg.fan[i].cpu.hist);
+      free(h->u.agg.fan[i].cpu.lf);
+    }
+    if(h->u.agg.hist_aggr) hist_free(h->u.agg.hist_aggr);
+    /* fall through */
+  case STATS_TYPE_COUNTER:
+  case STATS_TYPE_SUMMARY:
+    stats_slab_free(slab, h->u.agg.fan, h->u.agg.fanout * sizeof(*h->u.agg.fan));
+    break;
+  case STATS_TYPE_STRING:
+    free(h->u.str.value);
+    break;
+  default:
+    break;
+  }
+  if(h->cold) {
+    free(h->cold->refresh);
+    stats_tagset_free(rec, &h->cold->tags);
+    stats_slab_strfree(slab, h->cold->tagged_name);
+    stats_slab_free(slab, h->cold, sizeof(*h->cold));
+  }
+  stats_name_cache_free(slab, h->tagged_cache);
+  stats_slab_free(slab, h, stats_handle_size(h->type));
+}
+
+/* The shared _overflow handle exports under its namespace's name (which
+ * a family shares) tagged overflow:true, so what it counts stays in the
+ * series of the names it stands in for. */
+static void
+stats_overflow_tag(stats_ns_t *ns, stats_handle_t *h) {
+  if(ns->name) stats_handle_tagged_name(h, ns->name);
+  stats_handle_add_tag(h, "overflow", "true");
+}
+
+static stats_handle_t *stats_ns_unretire(stats_ns_t *ns, const char *name,
+                                         stats_type_t type);
+static void stats_ns_retire(stats_ns_t *ns, const char *name, stats_handle_t *h);
+
+/* *overflowed is set when the namespace's limit sent name to _overflow */
+static stats_handle_t *
+stats_register_internal(stats_ns_t *ns, const char *name, stats_type_t type, int fanout,
+                        bool *overflowed) {
   stats_container_t *c;
+  stats_handle_t *h = NULL, *new_h = NULL, *revived = NULL;
+  ck_epoch_record_t *r;
+  ck_epoch_section_t section;
+  bool full;
+  *overflowed = false;
   if(fanout && (type != STATS_TYPE_COUNTER && type != STATS_TYPE_HISTOGRAM &&
-                type != STATS_TYPE_HISTOGRAM_FAST))
+                type != STATS_TYPE_HISTOGRAM_FAST && type != STATS_TYPE_SUMMARY))
     return NULL;
   if(ns == NULL) return NULL;
-  c = stats_ns_add_container(ns, name);
-  if(!c) return NULL;
-  if(!c->handle) {
-    stats_handle_t *h = stats_handle_alloc(ns, type, fanout);
+  if((r = stats_epoch_begin(&section)) == NULL) return NULL;
+  for(;;) {
+    if((c = stats_ns_add_container(ns, name, name != stats_overflow_name, &full)) == NULL) {
+      /* past the namespace's limit, new names share one handle */
+      if(!full) break;
+      name = stats_overflow_name;
+      *overflowed = true;
+      continue;
+    }
+    if((h = ck_pr_load_ptr(&c->handle)) != NULL) break;
+    /* a name that expired gets back the handle its writers may still hold */
+    if(new_h == NULL && ck_pr_load_ptr(&ns->retired))
+      new_h = revived = stats_ns_unretire(ns, name, type);
+    if(new_h == NULL) {
+      if((new_h = stats_handle_alloc(ns, type, fanout)) == NULL) break;
+      if(!strcmp(name, stats_overflow_name)) stats_overflow_tag(ns, new_h);
+    }
     pthread_rwlock_wrlock(&ns->lock);
-    if(!c->handle) {
-      c->handle = h;
-      h = NULL;
+    if(!c->removed) {
+      if(c->handle == NULL) {
+        c->handle = new_h;
+        new_h = NULL;
+      }
+      h = c->handle;
     }
     pthread_rwlock_unlock(&ns->lock);
-    stats_handle_free(h);
+    if(h) break;
   }
-  if(c->handle->type == type) return c->handle;
-  return NULL;
+  if(h && h->type != type) h = NULL;
+  /* a handle just looked up is not idle, whatever its value does next */
+  if(h && ck_pr_load_32(&ns->ttl)) stats_handle_touch(h);
+  stats_epoch_end(r, &section);
+  if(new_h && new_h == revived) stats_ns_retire(ns, name, new_h);
+  else stats_handle_free(ns->rec, new_h);
+  return h;
+}
+
+stats_handle_t *
+stats_register_fanout(stats_ns_t *ns, const char *name, stats_type_t type, int fanout) {
+  bool overflowed;
+  return stats_register_internal(ns, name, type, fanout, &overflowed);
 }
 
 stats_handle_t *
@@ -438,686 +1486,3541 @@ stats_register(stats_ns_t *ns, const char *name, stats_type_t type) {
   return stats_register_fanout(ns, name, type, 0);
 }
 
-bool
-stats_handle_clear(stats_handle_t *h) {
-  int i;
-  /* We only support clearing histograms and counters */
+/* What a deregistration unlinked, freed once the grace period is over */
+struct stats_dead {
+  ck_epoch_entry_t   entry;
+  stats_recorder_t  *rec;
+  stats_container_t *c;
+  stats_handle_t    *h;
+  stats_ns_t        *ns;
+};
+CK_EPOCH_CONTAINER(struct stats_dead, entry, stats_dead_entry)
+
+/* A handle that expiry took out of its namespace.  Writers may still hold
+ * it, so it lives as long as the namespace does; writing to it or
+ * registering its name again puts it back. */
+struct stats_retired {
+  struct stats_retired *next;
+  stats_handle_t       *h;
+  uint64_t              since;  /* the recorder's epoch when it was retired */
+  int                   len;
+  char                  key[];
+};
+
+static struct stats_retired *
+stats_retired_alloc(stats_ns_t *ns, const char *key, int len, stats_handle_t *h) {
+  struct stats_retired *rt = stats_slab_alloc(&ns->rec->slab, sizeof(*rt) + len + 1);
+  if(rt == NULL) return NULL;
+  rt->h = h;
+  rt->since = ck_pr_load_64(&ns->rec->epoch);
+  rt->len = len;
+  memcpy(rt->key, key, len);
+  rt->key[len] = '\0';
+  return rt;
+}
+static void
+stats_retired_free(stats_ns_t *ns, struct stats_retired *rt) {
+  stats_slab_free(&ns->rec->slab, rt, sizeof(*rt) + rt->len + 1);
+}
+
+static void
+stats_ns_free_tree(stats_ns_t *ns) {
+  void *vc;
+  struct stats_retired *rt;
+  ck_hs_iterator_t iterator = CK_HS_ITERATOR_INITIALIZER;
+  while((rt = ns->retired) != NULL) {
+    ns->retired = rt->next;
+    stats_handle_free(ns->rec, rt->h);
+    stats_retired_free(ns, rt);
+  }
+  while(ck_hs_next(&ns->map, &iterator, &vc)) {
+    stats_container_t *c = vc;
+    if(c->ns) stats_ns_free_tree(c->ns);
+    stats_handle_free(ns->rec, c->handle);
+    stats_slab_free(&ns->rec->slab, c, sizeof(*c) + c->len + 1);
+  }
+  stats_ns_free(ns);
+}
+
+/* Whether a queued or running refresh still points at h, or into ns */
+static bool
+stats_handle_refresh_busy(stats_handle_t *h) {
+  return h && h->cold && h->cold->refresh && ck_pr_load_int(&h->cold->refresh->busy);
+}
+static bool
+stats_ns_refresh_busy(stats_ns_t *ns) {
+  struct stats_ns_freshnode *node;
+  void *vc;
+  ck_hs_iterator_t iterator = CK_HS_ITERATOR_INITIALIZER;
+  for(node = ns->freshen; node; node = node->next) {
+    if(ck_pr_load_int(&node->refresh.busy)) return true;
+  }
+  while(ck_hs_next(&ns->map, &iterator, &vc)) {
+    stats_container_t *c = vc;
+    if(stats_handle_refresh_busy(c->handle) || (c->ns && stats_ns_refresh_busy(c->ns))) return true;
+  }
+  return false;
+}
+
+static void stats_dead_reclaim(ck_epoch_entry_t *e);
+/* A refresh may sit in the pool's queue across a grace period.  Blocking
+ * here would stall whoever polled (and a pool thread that polls could wait
+ * on itself), so the free is put off for another grace period instead. */
+static bool
+stats_dead_defer(struct stats_dead *d) {
+  ck_epoch_record_t *r;
+  if(!stats_handle_refresh_busy(d->h) && !(d->ns && stats_ns_refresh_busy(d->ns))) return false;
+  /* with no record, leaking beats freeing under the refresh */
+  if((r = stats_epoch_record()) != NULL) ck_epoch_call(r, &d->entry, stats_dead_reclaim);
+  return true;
+}
+
+static void
+stats_dead_reclaim(ck_epoch_entry_t *e) {
+  struct stats_dead *d = stats_dead_entry(e);
+  if(stats_dead_defer(d)) return;
+  /* rings may still hold samples for the handles about to go */
+  stats_hist_rings_drain();
+  stats_handle_free(d->rec, d->h);
+  if(d->ns) stats_ns_free_tree(d->ns);
+  if(d->c) stats_slab_free(&d->rec->slab, d->c, sizeof(*d->c) + d->c->len + 1);
+  stats_slab_free(&d->rec->slab, d, sizeof(*d));
+  circmetrics_epoch_pending--;
+}
+
+/* Takes c's handle (or namespace) out of ns, and c itself once it holds
+ * neither, and queues them to be freed after the grace period; if retire
+ * is set the handle is left to the caller.  Called in an epoch section
+ * with the namespace's write lock held. */
+static bool
+stats_container_unlink(stats_ns_t *ns, stats_container_t *c, bool is_ns, bool retire,
+                       ck_epoch_record_t *r) {
+  struct stats_dead *d;
+  if(is_ns ? c->ns == NULL : c->handle == NULL) return false;
+  if((d = stats_slab_alloc(&ns->rec->slab, sizeof(*d))) == NULL) return false;
+  d->rec = ns->rec;
+  if(is_ns) {
+    d->ns = c->ns;
+    c->ns = NULL;
+  }
+  else {
+    if(!retire) d->h = c->handle;
+    c->handle = NULL;
+  }
+  if(c->ns == NULL && c->handle == NULL) {
+    ck_hs_remove(&ns->map, CK_HS_HASH(&ns->map, hs_hash, c), c);
+    if(c->counted) ns->nhandles--;
+    c->removed = true;
+    d->c = c;
+  }
+  circmetrics_epoch_pending++;
+  ck_epoch_call(r, &d->entry, stats_dead_reclaim);
+  return true;
+}
+
+static bool
+stats_ns_unlink(stats_ns_t *ns, const char *name, bool is_ns) {
+  stats_container_t key, *c;
+  ck_epoch_record_t *r;
+  ck_epoch_section_t section;
+  bool unlinked = false;
+
+  if(ns == NULL || name == NULL) return false;
+  key.key = name;
+  key.len = strlen(name);
+  if((r = stats_epoch_begin(&section)) == NULL) return false;
+  pthread_rwlock_wrlock(&ns->lock);
+  if((c = ck_hs_get(&ns->map, CK_HS_HASH(&ns->map, hs_hash, &key), &key)) != NULL)
+    unlinked = stats_container_unlink(ns, c, is_ns, false, r);
+  pthread_rwlock_unlock(&ns->lock);
+  stats_epoch_end(r, &section);
+  return unlinked;
+}
+
+/* Whether c's handle has gone through more than the namespace's ttl in
+ * export passes without a write (or a lookup).  Observed and invoked
+ * handles are fed from outside the library and never expire. */
+static inline bool
+stats_container_idle(stats_ns_t *ns, stats_container_t *c) {
+  uint32_t ttl = ck_pr_load_32(&ns->ttl);
+  stats_handle_t *h = c->handle;
+  /* a family's table keeps its handles */
+  if(ttl == 0 || h == NULL || stats_handle_has_cb(h) || ck_pr_load_ptr(&ns->family)) return false;
   switch(h->type) {
-  case STATS_TYPE_HISTOGRAM_FAST:
-  case STATS_TYPE_HISTOGRAM:
-    for(i=0;i<h->fanout;i++)
-      hist_clear(h->fan[i].cpu.hist);
-    hist_clear(h->hist_aggr);
-    return true;
-  case STATS_TYPE_COUNTER:
-    for(i=0;i<h->fanout;i++)
-      h->fan[i].cpu.incr = 0;
-    return true;
+  case STATS_TYPE_STRING:
+  case STATS_TYPE_INT32:
+  case STATS_TYPE_UINT32:
+  case STATS_TYPE_INT64:
+  case STATS_TYPE_UINT64:
+  case STATS_TYPE_DOUBLE:
+    if(h->valueptr != &h->u.store && h->valueptr != &h->u.str.value) return false;
+    break;
   default:
-    h->valueptr = NULL;
     break;
   }
-  return false;
+  return ck_pr_load_64(&ns->rec->epoch) - ck_pr_load_64(&h->dirty) > ttl;
 }
 
-stats_type_t
-stats_handle_type(stats_handle_t *h) {
-  return h->type;
+/* Puts a retired handle back under its name, unless the name has since
+ * been taken or the namespace is full; then it waits for another write. */
+static void
+stats_ns_relink(stats_ns_t *ns, struct stats_retired *rt) {
+  stats_container_t *c;
+  bool full, linked = false;
+  c = stats_ns_add_container(ns, rt->key, strcmp(rt->key, stats_overflow_name) != 0, &full);
+  pthread_rwlock_wrlock(&ns->lock);
+  if(c && !c->removed && c->handle == NULL) {
+    c->handle = rt->h;
+    linked = true;
+  }
+  if(!linked) {
+    rt->since = ck_pr_load_64(&ns->rec->epoch) + 1;
+    rt->next = ns->retired;
+    ns->retired = rt;
+  }
+  pthread_rwlock_unlock(&ns->lock);
+  if(linked) stats_retired_free(ns, rt);
 }
 
-stats_handle_t *
-stats_observe(stats_handle_t *h, stats_type_t type, void *memory) {
-  if(h == NULL) return NULL;
-  // Can't observe a histogram as they aren't thread safe
-  if(h->type == STATS_TYPE_HISTOGRAM) return NULL;
-  if(h->type == STATS_TYPE_HISTOGRAM_FAST) return NULL;
-  if(h->type != type) return NULL;
-  h->valueptr = memory;
+/* Puts h back on the retired list, when it lost a race to install it */
+static void
+stats_ns_retire(stats_ns_t *ns, const char *name, stats_handle_t *h) {
+  struct stats_retired *rt;
+  if((rt = stats_retired_alloc(ns, name, strlen(name), h)) == NULL) return;
+  pthread_rwlock_wrlock(&ns->lock);
+  rt->next = ns->retired;
+  ns->retired = rt;
+  pthread_rwlock_unlock(&ns->lock);
+}
+
+/* Takes name's retired handle of this type back, if there is one */
+static stats_handle_t *
+stats_ns_unretire(stats_ns_t *ns, const char *name, stats_type_t type) {
+  struct stats_retired *rt, **rp;
+  stats_handle_t *h = NULL;
+  pthread_rwlock_wrlock(&ns->lock);
+  for(rp = &ns->retired; (rt = *rp) != NULL; rp = &rt->next) {
+    if(strcmp(rt->key, name) || rt->h->type != type) continue;
+    *rp = rt->next;
+    h = rt->h;
+    break;
+  }
+  pthread_rwlock_unlock(&ns->lock);
+  if(rt) stats_retired_free(ns, rt);
   return h;
 }
 
-bool
-stats_invoke(stats_handle_t *h, stats_invocation_func_t cb, void *closure) {
-  if(h == NULL) return false;
-  h->cb = cb;
-  h->cb_closure = closure;
-  return true;
+/* Walkers count the idle handles they pass and, once they have let go of
+ * the namespace's read lock, have them removed here.  Writers are not in
+ * an epoch section and may have kept a handle, so a removed handle is
+ * never freed before its namespace: it is only retired, and put back once
+ * it is written again. */
+static void
+stats_ns_expire(stats_ns_t *ns) {
+  void *vc;
+  struct stats_retired *rt, **rp, *written = NULL;
+  ck_epoch_record_t *r;
+  ck_epoch_section_t section;
+  ck_hs_iterator_t iterator = CK_HS_ITERATOR_INITIALIZER;
+  if((r = stats_epoch_begin(&section)) == NULL) return;
+  pthread_rwlock_wrlock(&ns->lock);
+  for(rp = &ns->retired; (rt = *rp) != NULL;) {
+    if(ck_pr_load_64(&rt->h->dirty) < rt->since) {
+      rp = &rt->next;
+      continue;
+    }
+    *rp = rt->next;
+    rt->next = written;
+    written = rt;
+  }
+  while(ck_hs_next(&ns->map, &iterator, &vc)) {
+    stats_container_t *c = vc;
+    if(!stats_container_idle(ns, c) ||
+       (rt = stats_retired_alloc(ns, c->key, c->len, c->handle)) == NULL) continue;
+    if(!stats_container_unlink(ns, c, false, true, r)) {
+      stats_retired_free(ns, rt);
+      continue;
+    }
+    rt->next = ns->retired;
+    ns->retired = rt;
+  }
+  pthread_rwlock_unlock(&ns->lock);
+  while((rt = written) != NULL) {
+    written = rt->next;
+    stats_ns_relink(ns, rt);
+  }
+  stats_epoch_end(r, &section);
+}
+/* Whether a walker that passed idle handles in ns, or a retired handle
+ * that has been written since, should call stats_ns_expire */
+static bool
+stats_ns_expiring(stats_ns_t *ns, int idle) {
+  struct stats_retired *rt;
+  bool written = false;
+  if(ns == NULL) return false;
+  if(idle) return true;
+  if(ck_pr_load_ptr(&ns->retired) == NULL) return false;
+  pthread_rwlock_rdlock(&ns->lock);
+  for(rt = ns->retired; rt && !written; rt = rt->next)
+    written = ck_pr_load_64(&rt->h->dirty) >= rt->since;
+  pthread_rwlock_unlock(&ns->lock);
+  return written;
 }
 
 bool
-stats_set_hist(stats_handle_t *h, double d, uint64_t cnt) {
-  if(h == NULL || (h->type != STATS_TYPE_HISTOGRAM &&
-                   h->type != STATS_TYPE_HISTOGRAM_FAST)) return false;
-  int cpu = __get_fanout(h->fanout);
-  pthread_mutex_lock(&h->fan[cpu].cpu.mutex);
-  hist_insert(h->fan[cpu].cpu.hist, d, cnt);
-  pthread_mutex_unlock(&h->fan[cpu].cpu.mutex);
-  return true;
+stats_deregister(stats_ns_t *ns, const char *name) {
+  if(ns && ck_pr_load_ptr(&ns->family)) return false;
+  return stats_ns_unlink(ns, name, false);
 }
+
 bool
-stats_set_hist_intscale(stats_handle_t *h, int64_t val, int scale, uint64_t cnt) {
-  if(h == NULL || (h->type != STATS_TYPE_HISTOGRAM &&
-                   h->type != STATS_TYPE_HISTOGRAM_FAST)) return false;
-  int cpu = __get_fanout(h->fanout);
-  pthread_mutex_lock(&h->fan[cpu].cpu.mutex);
-  hist_insert_intscale(h->fan[cpu].cpu.hist, val, scale, cnt);
-  pthread_mutex_unlock(&h->fan[cpu].cpu.mutex);
+stats_deregister_ns(stats_recorder_t *rec, stats_ns_t *ns, const char *name) {
+  if(rec == NULL && ns) rec = ns->rec;
+  if(ns == NULL && rec) ns = rec->global;
+  if(ns == NULL || ns->rec != rec) return false;
+  return stats_ns_unlink(ns, name, true);
+}
+
+/* Families.  A family is a namespace whose handles are told apart by their
+ * label values; each carries its labels as tags and exports under the
+ * family's name.  Label sets are found through an open-addressed table
+ * that readers probe without locks: entries are never moved or freed, and
+ * growing leaves the old table in place for readers still inside it.  Each
+ * thread also remembers its recent hits in a small direct-mapped cache,
+ * keyed by the family's id so that a freed family's address can be reused.
+ * Handles in a family stay until the family's namespace is deregistered.
+ */
+#define FAMILY_MAX_LABELS 8
+#define FAMILY_CACHE_SIZE 64
+#define FAMILY_TABLE_SIZE 16
+struct stats_family_entry {
+  uint32_t                   hash;
+  stats_handle_t            *h;
+  char                       vals[];  /* each value NUL terminated */
+};
+struct stats_family_table {
+  struct stats_family_table *retired;
+  uint32_t                   mask;
+  struct stats_family_entry *slot[];
+};
+struct stats_family {
+  uint64_t                   id;
+  stats_ns_t                *ns;
+  char                      *name;
+  stats_type_t               type;
+  int                        nlabels;
+  char                      *labels[FAMILY_MAX_LABELS];
+  pthread_mutex_t            lock;
+  struct stats_family_table *table;
+  uint32_t                   count;
+};
+struct stats_family_cached {
+  uint64_t                   id;
+  uint32_t                   hash;
+  struct stats_family_entry *e;
+};
+static __thread struct stats_family_cached circmetrics_family_cache[FAMILY_CACHE_SIZE];
+static uint64_t stats_family_ids;
+
+static struct stats_family_table *
+stats_family_table_alloc(uint32_t size) {
+  struct stats_family_table *t = calloc(1, sizeof(*t) + size * sizeof(*t->slot));
+  if(t) t->mask = size - 1;
+  return t;
+}
+
+static inline uint32_t
+stats_family_hash(const stats_family_t *fam, const char *const *values, uint32_t *lens) {
+  /* FNV-1a, measuring each value as it goes; label values are short */
+  uint32_t hash = 2166136261u;
+  int i;
+  for(i=0;i<fam->nlabels;i++) {
+    const unsigned char *p = (const unsigned char *)values[i];
+    while(*p) hash = (hash ^ *p++) * 16777619u;
+    hash = (hash ^ 0xff) * 16777619u;
+    lens[i] = p - (const unsigned char *)values[i];
+  }
+  return hash ^ (hash >> 15);
+}
+
+static inline bool
+stats_family_match(const struct stats_family_entry *e, int nlabels,
+                   const char *const *values, const uint32_t *lens) {
+  const char *p = e->vals;
+  int i;
+  for(i=0;i<nlabels;i++) {
+    if(strncmp(p, values[i], lens[i]) || p[lens[i]] != '\0') return false;
+    p += lens[i] + 1;
+  }
   return true;
 }
 
-bool stats_add32(stats_handle_t *h, int32_t cnt) {
-  if(h == NULL) return false;
-  if(h->type == STATS_TYPE_INT64 || h->type == STATS_TYPE_UINT64 ||
-     h->type == STATS_TYPE_COUNTER)
-    return stats_add64(h, (int64_t)cnt);
-  if(h->type != STATS_TYPE_INT32 && h->type != STATS_TYPE_UINT32)
-    return false;
-  ck_pr_add_32(&h->store.u32, cnt);
-  return true;
+static struct stats_family_entry *
+stats_family_find(const stats_family_t *fam, const struct stats_family_table *t, uint32_t hash,
+                  const char *const *values, const uint32_t *lens) {
+  uint32_t i;
+  for(i=0;i<=t->mask;i++) {
+    struct stats_family_entry *e = ck_pr_load_ptr(&t->slot[(hash + i) & t->mask]);
+    if(e == NULL) break;
+    if(e->hash == hash && stats_family_match(e, fam->nlabels, values, lens)) return e;
+  }
+  return NULL;
+}
+
+static void
+stats_family_place(struct stats_family_table *t, struct stats_family_entry *e) {
+  uint32_t i = e->hash;
+  while(t->slot[i & t->mask]) i++;
+  ck_pr_fence_store();
+  ck_pr_store_ptr(&t->slot[i & t->mask], e);
+}
+
+/* Called with the family's lock held */
+static struct stats_family_table *
+stats_family_grow(stats_family_t *fam) {
+  struct stats_family_table *t = fam->table, *grown;
+  uint32_t i;
+  if((grown = stats_family_table_alloc((t->mask + 1) * 2)) == NULL) return NULL;
+  for(i=0;i<=t->mask;i++) {
+    if(t->slot[i]) stats_family_place(grown, t->slot[i]);
+  }
+  grown->retired = t;
+  ck_pr_fence_store();
+  ck_pr_store_ptr(&fam->table, grown);
+  return grown;
+}
+
+/* The slow path: registers the label set's handle, keyed in the family's
+ * namespace by the comma separated values.  Sets that the namespace's
+ * limit sends to _overflow are not remembered, so they cannot grow the
+ * table either. */
+static stats_handle_t *
+stats_family_add(stats_family_t *fam, uint32_t hash, const char *const *values,
+                 const uint32_t *lens, struct stats_family_entry **found) {
+  char key[MAX_METRIC_TAGGED_NAME];
+  size_t keylen = 0, vlen = 0;
+  struct stats_family_table *t;
+  struct stats_family_entry *e;
+  stats_handle_t *h = NULL;
+  bool overflowed;
+  int i;
+  uint32_t j;
+
+  *found = NULL;
+  pthread_mutex_lock(&fam->lock);
+  t = fam->table;
+  if((e = stats_family_find(fam, t, hash, values, lens)) != NULL) {
+    h = e->h;
+    goto out;
+  }
+  for(i=0;i<fam->nlabels;i++) {
+    for(j=0;j<lens[i];j++) {
+      /* escaped so that distinct sets cannot share a key */
+      if(values[i][j] == ',' || values[i][j] == '\\') {
+        if(keylen + 1 >= sizeof(key)) goto out;
+        key[keylen++] = '\\';
+      }
+      if(keylen + 1 >= sizeof(key)) goto out;
+      key[keylen++] = values[i][j];
+    }
+    if(i + 1 < fam->nlabels) {
+      if(keylen + 1 >= sizeof(key)) goto out;
+      key[keylen++] = ',';
+    }
+    vlen += lens[i] + 1;
+  }
+  key[keylen] = '\0';
+  h = stats_register_internal(fam->ns, key, fam->type, 0, &overflowed);
+  if(h == NULL || overflowed) goto out;
+  if(fam->count + 1 > (t->mask + 1) / 2 && (t = stats_family_grow(fam)) == NULL) goto out;
+  if((e = stats_slab_alloc(&fam->ns->rec->slab, sizeof(*e) + vlen)) == NULL) goto out;
+  stats_handle_tagged_name(h, fam->name);
+  for(i=0;i<fam->nlabels;i++) stats_handle_add_tag(h, fam->labels[i], values[i]);
+  e->hash = hash;
+  e->h = h;
+  for(i=0,vlen=0;i<fam->nlabels;i++) {
+    memcpy(e->vals + vlen, values[i], lens[i] + 1);
+    vlen += lens[i] + 1;
+  }
+  stats_family_place(t, e);
+  fam->count++;
+ out:
+  pthread_mutex_unlock(&fam->lock);
+  *found = e;
+  return h;
+}
+
+stats_handle_t *
+stats_family_getv(stats_family_t *fam, const char *const *values) {
+  uint32_t lens[FAMILY_MAX_LABELS], hash;
+  struct stats_family_cached *cached;
+  struct stats_family_entry *e;
+  stats_handle_t *h;
+
+  if(fam == NULL) return NULL;
+  hash = stats_family_hash(fam, values, lens);
+  cached = &circmetrics_family_cache[(hash ^ fam->id) & (FAMILY_CACHE_SIZE - 1)];
+  if(likely(cached->id == fam->id) && cached->hash == hash &&
+     stats_family_match(cached->e, fam->nlabels, values, lens))
+    return cached->e->h;
+  e = stats_family_find(fam, ck_pr_load_ptr(&fam->table), hash, values, lens);
+  if(e) h = e->h;
+  else if((h = stats_family_add(fam, hash, values, lens, &e)) == NULL || e == NULL) return h;
+  cached->id = fam->id;
+  cached->hash = hash;
+  cached->e = e;
+  return h;
+}
+
+stats_handle_t *
+stats_family_get(stats_family_t *fam, ...) {
+  const char *values[FAMILY_MAX_LABELS];
+  va_list ap;
+  int i;
+  if(fam == NULL) return NULL;
+  va_start(ap, fam);
+  for(i=0;i<fam->nlabels;i++) values[i] = va_arg(ap, const char *);
+  va_end(ap);
+  return stats_family_getv(fam, values);
+}
+
+static void
+stats_family_free(stats_family_t *fam) {
+  struct stats_slab *slab = &fam->ns->rec->slab;
+  int i;
+  stats_slab_strfree(slab, fam->name);
+  for(i=0;i<fam->nlabels;i++) stats_slab_strfree(slab, fam->labels[i]);
+  pthread_mutex_destroy(&fam->lock);
+  free(fam->table);
+  stats_slab_free(slab, fam, sizeof(*fam));
+}
+
+/* Called as the family's namespace is freed, when no lookup can reach it */
+static void
+stats_family_destroy(stats_family_t *fam) {
+  struct stats_family_table *t = fam->table, *retired;
+  uint32_t i;
+  int j;
+  for(i=0;i<=t->mask;i++) {
+    struct stats_family_entry *e = t->slot[i];
+    size_t len = sizeof(*e);
+    if(e == NULL) continue;
+    for(j=0;j<fam->nlabels;j++) len += strlen(e->vals + len - sizeof(*e)) + 1;
+    stats_slab_free(&fam->ns->rec->slab, e, len);
+  }
+  while((retired = t->retired) != NULL) {
+    t->retired = retired->retired;
+    free(retired);
+  }
+  stats_family_free(fam);
+}
+
+stats_family_t *
+stats_register_family(stats_ns_t *ns, const char *name, stats_type_t type, ...) {
+  const char *labels[FAMILY_MAX_LABELS];
+  const char *label;
+  stats_family_t *fam, *new_fam;
+  stats_ns_t *fns;
+  int i, nlabels = 0;
+  va_list ap;
+
+  va_start(ap, type);
+  while((label = va_arg(ap, const char *)) != NULL) {
+    if(nlabels == FAMILY_MAX_LABELS) {
+      va_end(ap);
+      return NULL;
+    }
+    labels[nlabels++] = label;
+  }
+  va_end(ap);
+  if(nlabels == 0 || (fns = stats_register_ns(NULL, ns, name)) == NULL) return NULL;
+  if((fam = ck_pr_load_ptr(&fns->family)) == NULL) {
+    if((new_fam = stats_slab_alloc(&fns->rec->slab, sizeof(*new_fam))) == NULL) return NULL;
+    new_fam->id = ck_pr_faa_64(&stats_family_ids, 1) + 1;
+    new_fam->ns = fns;
+    new_fam->type = type;
+    new_fam->nlabels = nlabels;
+    new_fam->name = stats_slab_strdup(&fns->rec->slab, name);
+    for(i=0;i<nlabels;i++) new_fam->labels[i] = stats_slab_strdup(&fns->rec->slab, labels[i]);
+    pthread_mutex_init(&new_fam->lock, NULL);
+    new_fam->table = stats_family_table_alloc(FAMILY_TABLE_SIZE);
+    for(i=0;i<nlabels && new_fam->labels[i];i++);
+    if(new_fam->name == NULL || i < nlabels || new_fam->table == NULL ||
+       !ck_pr_cas_ptr(&fns->family, NULL, new_fam)) {
+      stats_family_free(new_fam);
+    }
+    fam = ck_pr_load_ptr(&fns->family);
+    if(fam == NULL) return NULL;
+  }
+  /* registering again must ask for the same family */
+  if(fam->type != type || fam->nlabels != nlabels) return NULL;
+  for(i=0;i<nlabels;i++) {
+    if(strcmp(fam->labels[i], labels[i])) return NULL;
+  }
+  return fam;
+}
+
+static inline uint32_t
+stats_hist_lf_key(hist_bucket_t hb) {
+  uint16_t bits;
+  memcpy(&bits, &hb, sizeof(bits));
+  return (uint32_t)bits + 1;
+}
+
+/* Returns false if the active table is full, in which case the caller
+ * must fall back to the locked insert.
+ */
+static bool
+stats_hist_lf_insert(struct stats_hist_lf *lf, hist_bucket_t hb, uint64_t cnt) {
+  unsigned int b, i, off;
+  uint32_t key = stats_hist_lf_key(hb), cur;
+  struct stats_hist_lf_table *t;
+  bool inserted = false;
+
+  /* Announce ourselves on a table and make sure it is still the active one,
+   * otherwise capture may already be draining it. */
+  while(1) {
+    b = ck_pr_load_uint(&lf->active);
+    ck_pr_inc_uint(&lf->writers[b]);
+    ck_pr_fence_memory();
+    if(ck_pr_load_uint(&lf->active) == b) break;
+    ck_pr_dec_uint(&lf->writers[b]);
+  }
+  t = &lf->buf[b];
+  off = (key * 2654435761u) >> (32 - LF_HIST_BITS);
+  for(i=0;i<LF_HIST_BUCKETS;i++) {
+    unsigned int idx = (off + i) & (LF_HIST_BUCKETS - 1);
+    cur = ck_pr_load_32(&t->key[idx]);
+    if(cur == 0 && ck_pr_cas_32_value(&t->key[idx], 0, key, &cur)) cur = key;
+    if(cur == key) {
+      ck_pr_add_64(&t->count[idx], cnt);
+      inserted = true;
+      break;
+    }
+  }
+  ck_pr_fence_memory();
+  ck_pr_dec_uint(&lf->writers[b]);
+  return inserted;
+}
+
+/* Must be called with the fan slot's mutex held; that serializes drains
+ * against one another.  Writers never take the mutex while counted in
+ * `writers`, so waiting on them here cannot deadlock.
+ */
+static void
+stats_hist_lf_drain(histogram_t *tgt, struct stats_hist_lf *lf) {
+  unsigned int b, i;
+  struct stats_hist_lf_table *t;
+
+  b = ck_pr_load_uint(&lf->active);
+  ck_pr_store_uint(&lf->active, !b);
+  ck_pr_fence_memory();
+  while(ck_pr_load_uint(&lf->writers[b]) != 0) ck_pr_stall();
+  ck_pr_fence_memory();
+  t = &lf->buf[b];
+  for(i=0;i<LF_HIST_BUCKETS;i++) {
+    if(t->key[i] == 0) continue;
+    if(t->count[i]) {
+      hist_bucket_t hb;
+      uint16_t bits = t->key[i] - 1;
+      memcpy(&hb, &bits, sizeof(hb));
+      hist_insert_raw(tgt, hb, t->count[i]);
+    }
+    t->key[i] = 0;
+    t->count[i] = 0;
+  }
+}
+
+/* Histograms leave the fan slot's counter unused; writers set it once they
+ * have added to the slot so merges can pass over slots with nothing new.
+ * The load keeps a hot slot from dirtying its line again on every insert.
+ */
+static inline void
+stats_hist_slot_mark(stats_handle_t *h, int cpu) {
+  uint64_t *filled = &h->u.agg.fan[cpu].cpu.incr;
+  if(ck_pr_load_64(filled) == 0) ck_pr_store_64(filled, 1);
+}
+
+static void
+stats_hist_fan_clear(stats_handle_t *h) {
+  int i;
+  if(h->hist_ring) stats_hist_rings_drain();
+  for(i=0;i<h->u.agg.fanout;i++) {
+    pthread_mutex_lock(&h->u.agg.fan[i].cpu.mutex);
+    if(h->u.agg.fan[i].cpu.lf) stats_hist_lf_drain(h->u.agg.fan[i].cpu.hist, h->u.agg.fan[i].cpu.lf);
+    hist_clear(h->u.agg.fan[i].cpu.hist);
+    pthread_mutex_unlock(&h->u.agg.fan[i].cpu.mutex);
+  }
+  hist_clear(h->u.agg.hist_aggr);
+}
+
+bool
+stats_handle_hist_lockfree(stats_handle_t *h) {
+  int i;
+  if(h == NULL || (h->type != STATS_TYPE_HISTOGRAM &&
+                   h->type != STATS_TYPE_HISTOGRAM_FAST)) return false;
+  for(i=0;i<h->u.agg.fanout;i++) {
+    struct stats_hist_lf *lf;
+    if(ck_pr_load_ptr(&h->u.agg.fan[i].cpu.lf)) continue;
+    lf = calloc(1, sizeof(*lf));
+    if(lf == NULL) return false;
+    if(!ck_pr_cas_ptr(&h->u.agg.fan[i].cpu.lf, NULL, lf)) free(lf);
+  }
+  return true;
+}
+
+static struct stats_hist_ring *stats_hist_rings;
+static __thread struct stats_hist_ring *circmetrics_ring;
+static pthread_key_t stats_hist_ring_key;
+static pthread_once_t stats_hist_ring_once = PTHREAD_ONCE_INIT;
+
+static void
+stats_hist_ring_drain(struct stats_hist_ring *ring) {
+  uint32_t head, tail;
+  stats_handle_t *locked = NULL;
+  int cpu = 0;
+
+  pthread_mutex_lock(&ring->drain_lock);
+  head = ck_pr_load_32(&ring->head);
+  ck_pr_fence_load();
+  for(tail = ring->tail; tail != head; tail++) {
+    struct stats_hist_sample *sample = &ring->samples[tail & (HIST_RING_SIZE - 1)];
+    /* Samples for one handle tend to come in runs; keep its slot locked */
+    if(sample->h != locked) {
+      if(locked) pthread_mutex_unlock(&locked->u.agg.fan[cpu].cpu.mutex);
+      locked = sample->h;
+      cpu = ring->slot % locked->u.agg.fanout;
+      pthread_mutex_lock(&locked->u.agg.fan[cpu].cpu.mutex);
+    }
+    if(sample->scale == HIST_RING_DOUBLE)
+      hist_insert(locked->u.agg.fan[cpu].cpu.hist, sample->v.d, sample->cnt);
+    else
+      hist_insert_intscale(locked->u.agg.fan[cpu].cpu.hist, sample->v.i, sample->scale, sample->cnt);
+    stats_hist_slot_mark(locked, cpu);
+  }
+  if(locked) pthread_mutex_unlock(&locked->u.agg.fan[cpu].cpu.mutex);
+  ck_pr_fence_memory();
+  ck_pr_store_32(&ring->tail, tail);
+  pthread_mutex_unlock(&ring->drain_lock);
+}
+
+static void
+stats_hist_rings_drain(void) {
+  struct stats_hist_ring *ring;
+  for(ring = ck_pr_load_ptr(&stats_hist_rings); ring; ring = ring->next) {
+    if(ck_pr_load_32(&ring->head) != ck_pr_load_32(&ring->tail))
+      stats_hist_ring_drain(ring);
+  }
+}
+
+static void
+stats_hist_ring_release(void *vring) {
+  struct stats_hist_ring *ring = vring;
+  stats_hist_ring_drain(ring);
+  circmetrics_ring = NULL;
+  ck_pr_store_uint(&ring->in_use, 0);
+}
+static void
+stats_hist_ring_key_init(void) {
+  pthread_key_create(&stats_hist_ring_key, stats_hist_ring_release);
+}
+static struct stats_hist_ring *
+stats_hist_ring_acquire(void) {
+  struct stats_hist_ring *ring, *head;
+  int nrings = 0;
+
+  pthread_once(&stats_hist_ring_once, stats_hist_ring_key_init);
+  /* Rings are never freed; adopt one abandoned by an exited thread. */
+  for(ring = ck_pr_load_ptr(&stats_hist_rings); ring; ring = ring->next, nrings++) {
+    if(ck_pr_load_uint(&ring->in_use) == 0 &&
+       ck_pr_cas_uint(&ring->in_use, 0, 1)) break;
+  }
+  if(ring == NULL) {
+    ring = calloc(1, sizeof(*ring));
+    if(ring == NULL) return NULL;
+    ring->in_use = 1;
+    ring->slot = nrings;
+    pthread_mutex_init(&ring->drain_lock, NULL);
+    do {
+      head = ck_pr_load_ptr(&stats_hist_rings);
+      ring->next = head;
+    } while(!ck_pr_cas_ptr(&stats_hist_rings, head, ring));
+  }
+  pthread_setspecific(stats_hist_ring_key, ring);
+  circmetrics_ring = ring;
+  return ring;
+}
+
+/* Returns false only if this thread could not get a ring at all */
+static inline bool
+stats_hist_ring_push(stats_handle_t *h, int64_t i, double d, int scale, uint64_t cnt) {
+  struct stats_hist_ring *ring = circmetrics_ring;
+  struct stats_hist_sample *sample;
+  uint32_t head;
+
+  if(unlikely(ring == NULL) && (ring = stats_hist_ring_acquire()) == NULL) return false;
+  head = ring->head;
+  if(unlikely(head - ck_pr_load_32(&ring->tail) >= HIST_RING_SIZE))
+    stats_hist_ring_drain(ring);
+  sample = &ring->samples[head & (HIST_RING_SIZE - 1)];
+  sample->h = h;
+  if(scale == HIST_RING_DOUBLE) sample->v.d = d;
+  else sample->v.i = i;
+  sample->scale = scale;
+  sample->cnt = cnt;
+  ck_pr_fence_store();
+  ck_pr_store_32(&ring->head, head + 1);
+  return true;
+}
+
+bool
+stats_handle_hist_ring(stats_handle_t *h) {
+  if(h == NULL || (h->type != STATS_TYPE_HISTOGRAM &&
+                   h->type != STATS_TYPE_HISTOGRAM_FAST)) return false;
+  h->hist_ring = true;
+  return true;
+}
+
+static bool
+stats_handle_clear_value(stats_handle_t *h) {
+  int i;
+  /* We only support clearing histograms and counters */
+  switch(h->type) {
+  case STATS_TYPE_HISTOGRAM_FAST:
+  case STATS_TYPE_HISTOGRAM:
+    stats_hist_fan_clear(h);
+    return true;
+  case STATS_TYPE_COUNTER:
+    for(i=0;i<h->u.agg.fanout;i++)
+      h->u.agg.fan[i].cpu.incr = 0;
+    return true;
+  case STATS_TYPE_SUMMARY:
+    stats_summary_reset(h);
+    return true;
+  default:
+    h->valueptr = NULL;
+    break;
+  }
+  return false;
+}
+bool
+stats_handle_clear(stats_handle_t *h) {
+  bool rv = stats_handle_clear_value(h);
+  stats_handle_touch(h);
+  return rv;
+}
+
+stats_type_t
+stats_handle_type(stats_handle_t *h) {
+  return h->type;
+}
+
+stats_handle_t *
+stats_observe(stats_handle_t *h, stats_type_t type, void *memory) {
+  if(h == NULL) return NULL;
+  // Can't observe a histogram as they aren't thread safe
+  if(h->type == STATS_TYPE_HISTOGRAM) return NULL;
+  if(h->type == STATS_TYPE_HISTOGRAM_FAST) return NULL;
+  if(h->type == STATS_TYPE_SUMMARY) return NULL;
+  if(h->type != type) return NULL;
+  h->valueptr = memory;
+  return h;
+}
+
+bool
+stats_invoke_interval(stats_handle_t *h, stats_invocation_func_t cb, void *closure,
+                      int min_interval_ms) {
+  struct stats_handle_cold *cold;
+  struct stats_refresh *r;
+  if(h == NULL || (cold = stats_handle_cold(h)) == NULL) return false;
+  if((r = ck_pr_load_ptr(&cold->refresh)) == NULL) {
+    if((r = calloc(1, sizeof(*r))) == NULL) return false;
+    r->h = h;
+    if(!ck_pr_cas_ptr(&cold->refresh, NULL, r)) {
+      free(r);
+      r = ck_pr_load_ptr(&cold->refresh);
+    }
+  }
+  ck_pr_store_64(&r->interval, min_interval_ms > 0 ? min_interval_ms * 1000000ULL : 0);
+  cold->cb_closure = closure;
+  ck_pr_store_ptr(&cold->cb, cb);
+  return true;
+}
+
+bool
+stats_invoke(stats_handle_t *h, stats_invocation_func_t cb, void *closure) {
+  return stats_invoke_interval(h, cb, closure, 0);
+}
+
+static void
+stats_set_hist_value(stats_handle_t *h, double d, uint64_t cnt) {
+  if(h->hist_ring && stats_hist_ring_push(h, 0, d, HIST_RING_DOUBLE, cnt)) return;
+  int cpu = __get_fanout(h->u.agg.fanout);
+  struct stats_hist_lf *lf = ck_pr_load_ptr(&h->u.agg.fan[cpu].cpu.lf);
+  if(lf && stats_hist_lf_insert(lf, double_to_hist_bucket(d), cnt)) {
+    stats_hist_slot_mark(h, cpu);
+    return;
+  }
+  pthread_mutex_lock(&h->u.agg.fan[cpu].cpu.mutex);
+  hist_insert(h->u.agg.fan[cpu].cpu.hist, d, cnt);
+  pthread_mutex_unlock(&h->u.agg.fan[cpu].cpu.mutex);
+  stats_hist_slot_mark(h, cpu);
+}
+bool
+stats_set_hist(stats_handle_t *h, double d, uint64_t cnt) {
+  if(h == NULL || (h->type != STATS_TYPE_HISTOGRAM &&
+                   h->type != STATS_TYPE_HISTOGRAM_FAST)) return false;
+  stats_set_hist_value(h, d, cnt);
+  stats_handle_touch(h);
+  return true;
+}
+static void
+stats_set_hist_intscale_value(stats_handle_t *h, int64_t val, int scale, uint64_t cnt) {
+  if(h->hist_ring && scale != HIST_RING_DOUBLE &&
+     stats_hist_ring_push(h, val, 0, scale, cnt)) return;
+  int cpu = __get_fanout(h->u.agg.fanout);
+  struct stats_hist_lf *lf = ck_pr_load_ptr(&h->u.agg.fan[cpu].cpu.lf);
+  if(lf && stats_hist_lf_insert(lf, int_scale_to_hist_bucket(val, scale), cnt)) {
+    stats_hist_slot_mark(h, cpu);
+    return;
+  }
+  pthread_mutex_lock(&h->u.agg.fan[cpu].cpu.mutex);
+  hist_insert_intscale(h->u.agg.fan[cpu].cpu.hist, val, scale, cnt);
+  pthread_mutex_unlock(&h->u.agg.fan[cpu].cpu.mutex);
+  stats_hist_slot_mark(h, cpu);
+}
+bool
+stats_set_hist_intscale(stats_handle_t *h, int64_t val, int scale, uint64_t cnt) {
+  if(h == NULL || (h->type != STATS_TYPE_HISTOGRAM &&
+                   h->type != STATS_TYPE_HISTOGRAM_FAST)) return false;
+  stats_set_hist_intscale_value(h, val, scale, cnt);
+  stats_handle_touch(h);
+  return true;
+}
+
+bool stats_add32(stats_handle_t *h, int32_t cnt) {
+  if(h == NULL) return false;
+  if(h->type == STATS_TYPE_INT64 || h->type == STATS_TYPE_UINT64 ||
+     h->type == STATS_TYPE_COUNTER)
+    return stats_add64(h, (int64_t)cnt);
+  if(h->type != STATS_TYPE_INT32 && h->type != STATS_TYPE_UINT32)
+    return false;
+  ck_pr_add_32(&h->u.store.u32, cnt);
+  stats_handle_touch(h);
+  return true;
+}
+
+bool stats_add64(stats_handle_t *h, int64_t cnt) {
+  if(h == NULL) return false;
+  if(h->type == STATS_TYPE_COUNTER) {
+    int cpu = __get_fanout(h->u.agg.fanout);
+    ck_pr_add_64(&h->u.agg.fan[cpu].cpu.incr, cnt);
+    stats_handle_touch(h);
+    return true;
+  }
+  if(h->type != STATS_TYPE_INT64 && h->type != STATS_TYPE_UINT64)
+    return false;
+  ck_pr_add_64(&h->u.store.u64, cnt);
+  stats_handle_touch(h);
+  return true;
+}
+
+static bool
+stats_set_value(stats_handle_t *h, stats_type_t type, void *ptr) {
+  int len, i;
+  if(h->type == STATS_TYPE_HISTOGRAM ||
+     h->type == STATS_TYPE_HISTOGRAM_FAST) {
+    const histogram_t * const * hptr = (const histogram_t * const *)&ptr;
+    int cpu = __get_fanout(h->u.agg.fanout);
+    struct stats_hist_lf *lf;
+    bool rv = true;
+    if(ptr == NULL) {
+      stats_hist_fan_clear(h);
+      return true;
+    }
+    if((lf = ck_pr_load_ptr(&h->u.agg.fan[cpu].cpu.lf)) != NULL) {
+      hist_bucket_t hb;
+      bool scalar = true;
+      switch(type) {
+      case STATS_TYPE_INT32: hb = int_scale_to_hist_bucket(*((int32_t *)ptr), 0); break;
+      case STATS_TYPE_UINT32: hb = int_scale_to_hist_bucket(*((uint32_t *)ptr), 0); break;
+      case STATS_TYPE_INT64: hb = int_scale_to_hist_bucket(*((int64_t *)ptr), 0); break;
+      case STATS_TYPE_UINT64: hb = double_to_hist_bucket((double)*((uint64_t *)ptr)); break;
+      case STATS_TYPE_DOUBLE: hb = double_to_hist_bucket(*((double *)ptr)); break;
+      default: scalar = false; break;
+      }
+      if(scalar && stats_hist_lf_insert(lf, hb, 1)) {
+        stats_hist_slot_mark(h, cpu);
+        return true;
+      }
+    }
+    // For histogram types, we can actually allow setting from other types
+    pthread_mutex_lock(&h->u.agg.fan[cpu].cpu.mutex);
+    switch(type) {
+    case STATS_TYPE_COUNTER:
+    case STATS_TYPE_STRING:
+    case STATS_TYPE_SUMMARY:
+      rv = false; break; // but not these types
+    case STATS_TYPE_HISTOGRAM:
+      /* intentional fallthrough */
+    case STATS_TYPE_HISTOGRAM_FAST:
+      hist_accumulate(h->u.agg.fan[cpu].cpu.hist, hptr, 1);
+      break;
+    case STATS_TYPE_INT32:
+      hist_insert_intscale(h->u.agg.fan[cpu].cpu.hist, *((int32_t *)ptr), 0, 1);
+      break;
+    case STATS_TYPE_UINT32:
+      hist_insert_intscale(h->u.agg.fan[cpu].cpu.hist, *((uint32_t *)ptr), 0, 1);
+      break;
+    case STATS_TYPE_INT64:
+      hist_insert_intscale(h->u.agg.fan[cpu].cpu.hist, *((int64_t *)ptr), 0, 1);
+      break;
+    case STATS_TYPE_UINT64:
+      hist_insert(h->u.agg.fan[cpu].cpu.hist, (double)*((uint64_t *)ptr), 1);
+      break;
+    case STATS_TYPE_DOUBLE:
+      hist_insert(h->u.agg.fan[cpu].cpu.hist, *((double *)ptr), 1);
+      break;
+    }
+    pthread_mutex_unlock(&h->u.agg.fan[cpu].cpu.mutex);
+    if(rv) stats_hist_slot_mark(h, cpu);
+    return rv;
+  }
+  if(h->type == STATS_TYPE_SUMMARY) {
+    if(ptr == NULL) {
+      stats_summary_reset(h);
+      return true;
+    }
+    switch(type) {
+    case STATS_TYPE_INT32: return stats_summary_observe(h, *((int32_t *)ptr), 0, false);
+    case STATS_TYPE_UINT32: return stats_summary_observe(h, *((uint32_t *)ptr), 0, false);
+    case STATS_TYPE_INT64: return stats_summary_observe(h, *((int64_t *)ptr), 0, false);
+    case STATS_TYPE_UINT64: return stats_summary_observe(h, 0, (double)*((uint64_t *)ptr), true);
+    case STATS_TYPE_DOUBLE: return stats_summary_observe(h, 0, *((double *)ptr), true);
+    default: return false;
+    }
+  }
+  if(h->type != type) return false;
+  switch(type) {
+  // we necessarily handled the histogram case already
+  case STATS_TYPE_COUNTER:
+    if(ptr == NULL) {
+      for(i=0;i<h->u.agg.fanout;i++) h->u.agg.fan[i].cpu.incr = 0;
+      return true;
+    }
+    return false;
+  case STATS_TYPE_HISTOGRAM: assert(type != STATS_TYPE_HISTOGRAM); break;
+  case STATS_TYPE_HISTOGRAM_FAST: assert(type != STATS_TYPE_HISTOGRAM_FAST); break;
+  case STATS_TYPE_SUMMARY: assert(type != STATS_TYPE_SUMMARY); break;
+  case STATS_TYPE_STRING:
+    if(ptr == NULL) {
+      h->valueptr = NULL;
+      return true;
+    }
+    len = strlen((char *)ptr) + 1;
+    char *tofree = NULL;
+    if(h->u.str.len < len) {
+      char *replace = malloc(len);
+      tofree = h->u.str.value;
+      ck_spinlock_lock(&h->lock);
+      h->u.str.value = replace;
+      h->u.str.len = len;
+    } else {
+      ck_spinlock_lock(&h->lock);
+    }
+    memcpy(h->u.str.value, (char *)ptr, len);
+    h->valueptr = &h->u.str.value;
+    ck_spinlock_unlock(&h->lock);
+    free(tofree);
+    break;
+  case STATS_TYPE_INT32:
+  case STATS_TYPE_UINT32:
+    h->valueptr = &h->u.store;
+    memcpy(h->valueptr, ptr, sizeof(int32_t));
+    break;
+  case STATS_TYPE_INT64:
+  case STATS_TYPE_UINT64:
+  case STATS_TYPE_DOUBLE:
+    h->valueptr = &h->u.store;
+    memcpy(h->valueptr, ptr, sizeof(int64_t));
+    break;
+  }
+  return true;
+}
+bool
+stats_set(stats_handle_t *h, stats_type_t type, void *ptr) {
+  bool rv;
+  if(h == NULL) return false;
+  rv = stats_set_value(h, type, ptr);
+  stats_handle_touch(h);
+  return rv;
+}
+
+static int
+stats_ns_clear(stats_ns_t *ns, stats_type_t type) {
+  int cleared = 0;
+  void *vc;
+  ck_hs_iterator_t iterator = CK_HS_ITERATOR_INITIALIZER;
+  pthread_rwlock_rdlock(&ns->lock);
+  while(ck_hs_next(&ns->map, &iterator, &vc)) {
+    stats_container_t *c = vc;
+    if(c->ns) cleared += stats_ns_clear(c->ns, type);
+    if(c->handle && c->handle->type == type) {
+      if(stats_handle_clear(c->handle)) cleared++;
+    }
+  }
+  pthread_rwlock_unlock(&ns->lock);
+  return cleared;
+}
+
+int
+stats_recorder_clear(stats_recorder_t *rec, stats_type_t type) {
+  return stats_ns_clear(rec->global, type);
+}
+
+/* Exporters write through a sink that coalesces the many small fragments
+ * of a document into one buffer.  A full buffer is handed to `flush` as an
+ * iovec batch; fragments too large to be worth copying ride along as a
+ * second iovec instead.
+ */
+struct stats_sink {
+  char                    *buf;
+  size_t                   size;
+  size_t                   used;
+  bool                     own_buf;
+  bool                     failed;
+  stats_sink_flush_f       flush;
+  void                    *cl;
+  /* closure of the outf adapter; `cl` points here when it is in use */
+  struct {
+    ssize_t              (*outf)(void *, const char *, size_t);
+    void                  *cl;
+  }                        adapter;
+};
+
+#define STATS_SINK_DEFAULT_SIZE 65536
+#define STATS_SINK_STACK_SIZE 8192
+
+static ssize_t
+stats_sink_flush_outf(void *vsink, const struct iovec *iov, int iovcnt) {
+  stats_sink_t *sink = vsink;
+  ssize_t total = 0;
+  int i;
+  for(i=0;i<iovcnt;i++) {
+    const char *base = iov[i].iov_base;
+    size_t off = 0;
+    while(off < iov[i].iov_len) {
+      ssize_t rv = sink->adapter.outf(sink->adapter.cl, base + off, iov[i].iov_len - off);
+      if(rv <= 0) return -1;
+      off += rv;
+    }
+    total += off;
+  }
+  return total;
+}
+
+static ssize_t
+stats_sink_flush_fd(void *cl, const struct iovec *iov, int iovcnt) {
+  int fd = (int)(intptr_t)cl;
+  struct iovec left[2];
+  ssize_t total = 0;
+  assert(iovcnt <= 2);
+  memcpy(left, iov, iovcnt * sizeof(*iov));
+  while(iovcnt > 0) {
+    ssize_t rv = writev(fd, left, iovcnt);
+    if(rv < 0 && errno == EINTR) continue;
+    if(rv <= 0) return -1;
+    total += rv;
+    while(iovcnt > 0 && (size_t)rv >= left[0].iov_len) {
+      rv -= left[0].iov_len;
+      memmove(left, left + 1, --iovcnt * sizeof(*left));
+    }
+    if(iovcnt > 0) {
+      left[0].iov_base = (char *)left[0].iov_base + rv;
+      left[0].iov_len -= rv;
+    }
+  }
+  return total;
+}
+
+static void
+stats_sink_init(stats_sink_t *sink, char *buf, size_t size,
+                stats_sink_flush_f flush, void *cl) {
+  memset(sink, 0, sizeof(*sink));
+  sink->buf = buf;
+  sink->size = size;
+  sink->flush = flush;
+  sink->cl = cl;
+}
+static void
+stats_sink_init_outf(stats_sink_t *sink, char *buf, size_t size,
+                     ssize_t (*outf)(void *, const char *, size_t), void *cl) {
+  stats_sink_init(sink, buf, size, stats_sink_flush_outf, sink);
+  sink->adapter.outf = outf;
+  sink->adapter.cl = cl;
+}
+
+stats_sink_t *
+stats_sink_alloc(size_t bufsize, stats_sink_flush_f flush, void *cl) {
+  stats_sink_t *sink;
+  if(flush == NULL) return NULL;
+  if(bufsize == 0) bufsize = STATS_SINK_DEFAULT_SIZE;
+  sink = malloc(sizeof(*sink));
+  if(sink == NULL) return NULL;
+  stats_sink_init(sink, malloc(bufsize), bufsize, flush, cl);
+  if(sink->buf == NULL) {
+    free(sink);
+    return NULL;
+  }
+  sink->own_buf = true;
+  return sink;
+}
+
+stats_sink_t *
+stats_sink_alloc_outf(size_t bufsize, ssize_t (*outf)(void *, const char *, size_t), void *cl) {
+  stats_sink_t *sink;
+  if(outf == NULL) return NULL;
+  sink = stats_sink_alloc(bufsize, stats_sink_flush_outf, NULL);
+  if(sink == NULL) return NULL;
+  stats_sink_init_outf(sink, sink->buf, sink->size, outf, cl);
+  sink->own_buf = true;
+  return sink;
+}
+
+stats_sink_t *
+stats_sink_alloc_fd(size_t bufsize, int fd) {
+  return stats_sink_alloc(bufsize, stats_sink_flush_fd, (void *)(intptr_t)fd);
+}
+
+void
+stats_sink_free(stats_sink_t *sink) {
+  if(sink == NULL) return;
+  if(sink->own_buf) free(sink->buf);
+  free(sink);
+}
+
+static bool
+stats_sink_push(stats_sink_t *sink, const char *extra, size_t extra_len) {
+  struct iovec iov[2];
+  int iovcnt = 0;
+  if(sink->used) {
+    iov[iovcnt].iov_base = sink->buf;
+    iov[iovcnt++].iov_len = sink->used;
+  }
+  if(extra_len) {
+    iov[iovcnt].iov_base = (void *)extra;
+    iov[iovcnt++].iov_len = extra_len;
+  }
+  sink->used = 0;
+  if(iovcnt == 0) return true;
+  if(sink->flush(sink->cl, iov, iovcnt) < 0) {
+    sink->failed = true;
+    return false;
+  }
+  return true;
+}
+
+bool
+stats_sink_flush(stats_sink_t *sink) {
+  if(sink->failed) return false;
+  return stats_sink_push(sink, NULL, 0);
+}
+
+/* Slow path of stats_sink_put: the fragment does not fit what is left. */
+static ssize_t
+stats_sink_spill(stats_sink_t *sink, const char *data, size_t len) {
+  if(sink->failed) return -1;
+  if(len >= sink->size / 2) {
+    if(!stats_sink_push(sink, data, len)) return -1;
+    return len;
+  }
+  if(!stats_sink_push(sink, NULL, 0)) return -1;
+  memcpy(sink->buf, data, len);
+  sink->used = len;
+  return len;
+}
+
+static inline ssize_t
+stats_sink_put(stats_sink_t *sink, const char *data, size_t len) {
+  if(likely(len <= sink->size - sink->used)) {
+    memcpy(sink->buf + sink->used, data, len);
+    sink->used += len;
+    return len;
+  }
+  return stats_sink_spill(sink, data, len);
+}
+
+ssize_t
+stats_sink_write(stats_sink_t *sink, const void *data, size_t len) {
+  return stats_sink_put(sink, data, len);
+}
+
+#define OUTF(sink,k,l,a) do { \
+  ssize_t rv = stats_sink_put((sink), (k), (l)); \
+  if(rv != (ssize_t)(l)) return -1; \
+  (a) += rv; \
+} while(0)
+
+#define OUTB(sink,k,l,a,label) do { \
+  ssize_t rv = stats_sink_put((sink), (k), (l)); \
+  if(rv != (ssize_t)(l)) goto label; \
+  (a) += rv; \
+} while(0)
+
+#define OUTBLOCK(sink,k,l,a,block) do { \
+  ssize_t rv = stats_sink_put((sink), (k), (l)); \
+  if(rv != (ssize_t)(l)) block \
+  (a) += rv; \
+} while(0)
+
+/* Finding the next byte JSON needs escaped (a control character, '"' or
+ * '\\') dominates string encoding, so it is done 16 or 32 bytes at a time
+ * where the CPU allows.  The implementation is picked once, at first use.
+ */
+static size_t
+json_escape_scan_scalar(const unsigned char *s, size_t len) {
+  size_t i;
+  for(i=0;i<len;i++) {
+    if(s[i] < 0x20 || s[i] == '"' || s[i] == '\\') break;
+  }
+  return i;
+}
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define CM_JSON_SIMD
+#include <immintrin.h>
+
+__attribute__((target("sse2")))
+static size_t
+json_escape_scan_sse2(const unsigned char *s, size_t len) {
+  const __m128i quote = _mm_set1_epi8('"'), bslash = _mm_set1_epi8('\\');
+  const __m128i ctrl_max = _mm_set1_epi8(0x1f);
+  size_t i = 0;
+  for(;i+16<=len;i+=16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+    /* v <= 0x1f unsigned  <=>  max(v, 0x1f) == 0x1f */
+    __m128i m = _mm_cmpeq_epi8(_mm_max_epu8(v, ctrl_max), ctrl_max);
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, quote));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, bslash));
+    int mask = _mm_movemask_epi8(m);
+    if(mask) return i + __builtin_ctz(mask);
+  }
+  return i + json_escape_scan_scalar(s + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static size_t
+json_escape_scan_avx2(const unsigned char *s, size_t len) {
+  const __m256i quote = _mm256_set1_epi8('"'), bslash = _mm256_set1_epi8('\\');
+  const __m256i ctrl_max = _mm256_set1_epi8(0x1f);
+  size_t i = 0;
+  for(;i+32<=len;i+=32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(s + i));
+    __m256i m = _mm256_cmpeq_epi8(_mm256_max_epu8(v, ctrl_max), ctrl_max);
+    m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, quote));
+    m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, bslash));
+    unsigned int mask = (unsigned int)_mm256_movemask_epi8(m);
+    if(mask) return i + __builtin_ctz(mask);
+  }
+  /* a VEX-encoded 16 byte step; calling into the SSE2 scanner here would
+   * pay for an AVX/SSE state transition on every short string */
+  if(i+16<=len) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+    __m128i m = _mm_cmpeq_epi8(_mm_max_epu8(v, _mm256_castsi256_si128(ctrl_max)),
+                               _mm256_castsi256_si128(ctrl_max));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm256_castsi256_si128(quote)));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm256_castsi256_si128(bslash)));
+    int mask = _mm_movemask_epi8(m);
+    if(mask) return i + __builtin_ctz(mask);
+    i += 16;
+  }
+  return i + json_escape_scan_scalar(s + i, len - i);
+}
+#endif
+
+enum {
+  JSON_ESCAPE_UNPROBED = 0,
+  JSON_ESCAPE_SCALAR,
+  JSON_ESCAPE_SSE2,
+  JSON_ESCAPE_AVX2
+};
+static int json_escape_isa = JSON_ESCAPE_UNPROBED;
+
+static int
+json_escape_probe(void) {
+  int isa = JSON_ESCAPE_SCALAR;
+#ifdef CM_JSON_SIMD
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("avx2")) isa = JSON_ESCAPE_AVX2;
+  else if(__builtin_cpu_supports("sse2")) isa = JSON_ESCAPE_SSE2;
+#endif
+  ck_pr_store_int(&json_escape_isa, isa);
+  return isa;
+}
+
+/* Returns the offset of the first byte in s that needs escaping, or len. */
+static inline size_t
+json_escape_scan(const unsigned char *s, size_t len) {
+  int isa = ck_pr_load_int(&json_escape_isa);
+  if(unlikely(isa == JSON_ESCAPE_UNPROBED)) isa = json_escape_probe();
+#ifdef CM_JSON_SIMD
+  if(isa == JSON_ESCAPE_AVX2) return json_escape_scan_avx2(s, len);
+  if(isa == JSON_ESCAPE_SSE2) return json_escape_scan_sse2(s, len);
+#endif
+  return json_escape_scan_scalar(s, len);
+}
+
+/* yajl_string_encode is borrowed and hacked from libyajl
+ *
+ * Copyright (c) 2007-2014, Lloyd Hilaiel <me@lloyd.io>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+static ssize_t
+yajl_string_encode(stats_sink_t *sink,
+                   const char * sstr,
+                   size_t len) {
+  const unsigned char * str = (const unsigned char *)sstr;
+  ssize_t written = 0;
+  static const char * hexchar = "0123456789ABCDEF";
+  size_t beg = 0;
+  size_t end = 0;
+  char hexbuf[7] = { '\\', 'u', '0', '0', '0', '0', 0 };
+
+  while (end < len) {
+    const char * escaped = NULL;
+    end += json_escape_scan(str + end, len - end);
+    if (end == len) break;
+    switch (str[end]) {
+      case '\r': escaped = "\\r"; break;
+      case '\n': escaped = "\\n"; break;
+      case '\\': escaped = "\\\\"; break;
+      case '"': escaped = "\\\""; break;
+      case '\f': escaped = "\\f"; break;
+      case '\b': escaped = "\\b"; break;
+      case '\t': escaped = "\\t"; break;
+      default:
+        if ((unsigned char) str[end] < 32) {
+          hexbuf[4] = hexchar[(uint8_t)str[end] >> 4];
+          hexbuf[5] = hexchar[(uint8_t)str[end] & 0xf];
+          escaped = hexbuf;
+        }
+        break;
+    }
+    OUTF(sink, (const char *) (str + beg), end - beg, written);
+    OUTF(sink, escaped, (unsigned int)strlen(escaped), written);
+    beg = ++end;
+  }
+  OUTF(sink, (const char *) (str + beg), end - beg, written);
+  return written;
+}
+static const char *
+stats_type_code(stats_type_t type, bool hist_since_last) {
+  switch(type) {
+    case STATS_TYPE_STRING: return "s";
+    case STATS_TYPE_INT32: return "i";
+    case STATS_TYPE_UINT32: return "I";
+    case STATS_TYPE_INT64: return "l";
+    case STATS_TYPE_COUNTER:
+    case STATS_TYPE_UINT64: return "L";
+    case STATS_TYPE_DOUBLE: return "n";
+    case STATS_TYPE_HISTOGRAM_FAST:
+    case STATS_TYPE_HISTOGRAM: return hist_since_last ? "h" : "H";
+    case STATS_TYPE_SUMMARY: break;
+  }
+  return "";
+}
+
+/* Writes a histogram bucket exactly as "%0.2g" of its value would, but
+ * straight from the bucket's two decimal digits.
+ */
+static size_t
+stats_fmt_hist_bucket(char *out, hist_bucket_t hb) {
+  char *p = out;
+  int val = hb.val, exp = hb.exp, d1, d2;
+  if(val == 0) {
+    *p = '0';
+    return 1;
+  }
+  if(val > 99 || val < -99 || (val > -10 && val < 10)) {
+    return snprintf(out, STATS_NUMFMT_MAX, "%0.2g", hist_bucket_to_double(hb));
+  }
+  if(val < 0) {
+    *p++ = '-';
+    val = -val;
+  }
+  d1 = val / 10;
+  d2 = val % 10;
+  if(exp < -4 || exp >= 2) {
+    *p++ = '0' + d1;
+    if(d2) {
+      *p++ = '.';
+      *p++ = '0' + d2;
+    }
+    p += stats_fmt_exponent(p, exp);
+  }
+  else if(exp == 1) {
+    *p++ = '0' + d1;
+    *p++ = '0' + d2;
+  }
+  else if(exp == 0) {
+    *p++ = '0' + d1;
+    if(d2) {
+      *p++ = '.';
+      *p++ = '0' + d2;
+    }
+  }
+  else {
+    *p++ = '0';
+    *p++ = '.';
+    for(;exp<-1;exp++) *p++ = '0';
+    *p++ = '0' + d1;
+    if(d2) *p++ = '0' + d2;
+  }
+  return p - out;
+}
+
+/* Writes one "H[bucket]=count" element of a histogram's JSON array. */
+static size_t
+stats_fmt_hist_elem(char *out, hist_bucket_t hb, uint64_t cnt, bool comma) {
+  size_t len = 0;
+  if(comma) out[len++] = ',';
+  memcpy(out + len, "\"H[", 3);
+  len += 3;
+  len += stats_fmt_hist_bucket(out + len, hb);
+  out[len++] = ']';
+  out[len++] = '=';
+  len += stats_fmt_u64(out + len, cnt);
+  out[len++] = '"';
+  return len;
+}
+
+static ssize_t
+stats_scalar_output_json(stats_type_t type, const void *vptr,
+                         stats_sink_t *sink) {
+  ssize_t written = 0, len = 0;
+  int fpclass;
+  char buff[STATS_NUMFMT_MAX];
+
+  if(vptr == NULL) {
+    OUTF(sink, "null", 4, written);
+    return written;
+  }
+  switch(type) {
+  case STATS_TYPE_INT32:
+    len = stats_fmt_i64(buff, *(int32_t *)vptr);
+    break;
+  case STATS_TYPE_UINT32:
+    len = stats_fmt_u64(buff, *(uint32_t *)vptr);
+    break;
+  case STATS_TYPE_INT64:
+    len = stats_fmt_i64(buff, *(int64_t *)vptr);
+    break;
+  case STATS_TYPE_COUNTER:
+  case STATS_TYPE_UINT64:
+    len = stats_fmt_u64(buff, *(uint64_t *)vptr);
+    break;
+  case STATS_TYPE_DOUBLE:
+    fpclass = fpclassify(*(double *)vptr);
+    if(fpclass == FP_INFINITE || fpclass == FP_NAN) {
+      OUTF(sink, "null", 4, written);
+      return written;
+    }
+    len = stats_fmt_double(buff, *(double *)vptr);
+    break;
+  default:
+    return -1;
+  }
+  OUTF(sink, buff,len,written);
+  return written;
+}
+
+/* Summaries are exposed hierarchically as a branch holding one leaf per
+ * component, and in tagged form as one metric per component named
+ * `<name>_<component>`.
+ */
+static ssize_t
+stats_summary_value_output_json(struct stats_summary_value *sv, bool simple,
+                                stats_sink_t *sink) {
+  ssize_t written = 0, rv;
+  int i;
+
+  for(i=0;i<SUMMARY_NCOMPONENTS;i++) {
+    stats_type_t type;
+    void *vptr = stats_summary_component(sv, i, &type);
+    const char *component = stats_summary_component_names[i];
+    if(i) OUTF(sink, ",", 1, written);
+    OUTF(sink, "\"", 1, written);
+    OUTF(sink, component, strlen(component), written);
+    OUTF(sink, "\":", 2, written);
+    if(!simple) {
+      OUTF(sink, "{\"_type\":\"", 10, written);
+      OUTF(sink, stats_type_code(type, false), 1, written);
+      OUTF(sink, "\",\"_value\":", 11, written);
+    }
+    rv = stats_scalar_output_json(type, vptr, sink);
+    if(rv < 0) return -1;
+    written += rv;
+    if(!simple) OUTF(sink, "}", 1, written);
+  }
+  return written;
+}
+static ssize_t
+stats_summary_output_json(stats_handle_t *h, bool simple,
+                          stats_sink_t *sink) {
+  struct stats_summary_value sv;
+  stats_handle_run_cb(h);
+  stats_summary_fold(h, &sv);
+  return stats_summary_value_output_json(&sv, simple, sink);
+}
+
+/* Each thread keeps one histogram to merge into, cleared and reused by
+ * every export it runs, so steady-state exports allocate nothing for their
+ * histograms.  A merge nested inside another (from a capture callback, say)
+ * gets a fresh histogram of nbins instead.  The thread also keeps empty
+ * histograms to swap into fan slots, one list per kind (fast or not).
+ */
+struct stats_hist_scratch {
+  histogram_t             *merge;
+  bool                     busy;
+  int                      nspare[2];
+  histogram_t             *spare[2][MAX_FANOUT];
+};
+static pthread_key_t stats_hist_scratch_key;
+static pthread_once_t stats_hist_scratch_once = PTHREAD_ONCE_INIT;
+static __thread struct stats_hist_scratch *circmetrics_hist_scratch;
+
+static void
+stats_hist_scratch_release_thread(void *vs) {
+  struct stats_hist_scratch *s = vs;
+  int i, kind;
+  if(s->merge) hist_free(s->merge);
+  for(kind=0;kind<2;kind++)
+    for(i=0;i<s->nspare[kind];i++) hist_free(s->spare[kind][i]);
+  free(s);
+  circmetrics_hist_scratch = NULL;
+}
+static void
+stats_hist_scratch_init(void) {
+  pthread_key_create(&stats_hist_scratch_key, stats_hist_scratch_release_thread);
+}
+static struct stats_hist_scratch *
+stats_hist_scratch_local(void) {
+  if(circmetrics_hist_scratch == NULL) {
+    pthread_once(&stats_hist_scratch_once, stats_hist_scratch_init);
+    if((circmetrics_hist_scratch = calloc(1, sizeof(*circmetrics_hist_scratch))) == NULL) return NULL;
+    pthread_setspecific(stats_hist_scratch_key, circmetrics_hist_scratch);
+  }
+  return circmetrics_hist_scratch;
+}
+static histogram_t *
+stats_hist_scratch(int nbins) {
+  struct stats_hist_scratch *s = stats_hist_scratch_local();
+  if(s == NULL || s->busy) return hist_alloc_nbins(nbins);
+  if(s->merge == NULL) {
+    if((s->merge = hist_alloc_nbins(nbins)) == NULL) return NULL;
+  }
+  else {
+    hist_clear(s->merge);
+  }
+  s->busy = true;
+  return s->merge;
+}
+static void
+stats_hist_scratch_done(histogram_t *hist) {
+  struct stats_hist_scratch *s = circmetrics_hist_scratch;
+  if(hist == NULL) return;
+  if(s && hist == s->merge) s->busy = false;
+  else hist_free(hist);
+}
+/* An empty histogram of the fan slots' kind, or NULL if none can be had */
+static histogram_t *
+stats_hist_spare(bool fast) {
+  struct stats_hist_scratch *s = stats_hist_scratch_local();
+  if(s && s->nspare[fast]) return s->spare[fast][--s->nspare[fast]];
+  return fast ? hist_fast_alloc() : hist_alloc();
+}
+static void
+stats_hist_spare_put(histogram_t *hist, bool fast) {
+  struct stats_hist_scratch *s = circmetrics_hist_scratch;
+  if(s == NULL || s->nspare[fast] == MAX_FANOUT) {
+    hist_free(hist);
+    return;
+  }
+  hist_clear(hist);
+  s->spare[fast][s->nspare[fast]++] = hist;
+}
+
+/* Merges the handle's fan slots into a scratch histogram, folding in (or,
+ * when hist_since_last, into) the all-time aggregate.  The caller hands it
+ * back with stats_hist_scratch_done.
+ *
+ * Slots no writer has marked since they were last taken are skipped without
+ * locking them, and the marked ones are accumulated in a single call so the
+ * result is compacted once rather than once per slot.  When hist_since_last,
+ * each slot's histogram is swapped for an empty spare under its lock, so
+ * writers only wait for the swap; otherwise the slots stay locked, taken in
+ * ascending order, until the call returns.
+ */
+static histogram_t *
+stats_handle_hist_merge(stats_handle_t *h, bool hist_since_last) {
+  histogram_t *taken[MAX_FANOUT + 1];
+  int locked[MAX_FANOUT];
+  int i, ntaken = 0, nlocked = 0, nbins = hist_bucket_count(h->u.agg.hist_aggr);
+  bool fast = h->type == STATS_TYPE_HISTOGRAM_FAST;
+  histogram_t *copy;
+  /* nbins is only a hint for a fresh histogram; accumulating grows it as
+   * needed.  Slot histograms are not read unlocked, as a concurrent merge
+   * may swap one out and free it. */
+  copy = stats_hist_scratch(nbins);
+  for(i=0;i<h->u.agg.fanout;i++) {
+    histogram_t *spare = NULL;
+    if(ck_pr_load_64(&h->u.agg.fan[i].cpu.incr) == 0) continue;
+    if(hist_since_last) {
+      spare = stats_hist_spare(fast);
+      /* unmark first: a writer that lands after this marks the slot again */
+      ck_pr_store_64(&h->u.agg.fan[i].cpu.incr, 0);
+      ck_pr_fence_memory();
+    }
+    pthread_mutex_lock(&h->u.agg.fan[i].cpu.mutex);
+    if(h->u.agg.fan[i].cpu.lf) stats_hist_lf_drain(h->u.agg.fan[i].cpu.hist, h->u.agg.fan[i].cpu.lf);
+    if(!hist_since_last) {
+      taken[ntaken++] = h->u.agg.fan[i].cpu.hist;
+      locked[nlocked++] = i;
+      continue;
+    }
+    if(spare) {
+      taken[ntaken++] = h->u.agg.fan[i].cpu.hist;
+      h->u.agg.fan[i].cpu.hist = spare;
+    }
+    else {
+      hist_accumulate(copy, (const histogram_t * const *)&h->u.agg.fan[i].cpu.hist, 1);
+      hist_clear(h->u.agg.fan[i].cpu.hist);
+    }
+    pthread_mutex_unlock(&h->u.agg.fan[i].cpu.mutex);
+  }
+  if(!hist_since_last) taken[ntaken++] = h->u.agg.hist_aggr;
+  if(ntaken) hist_accumulate(copy, (const histogram_t * const *)taken, ntaken);
+  for(i=0;i<nlocked;i++) pthread_mutex_unlock(&h->u.agg.fan[locked[i]].cpu.mutex);
+  if(hist_since_last) {
+    for(i=0;i<ntaken;i++) stats_hist_spare_put(taken[i], fast);
+    hist_accumulate(h->u.agg.hist_aggr, (const histogram_t *const *)&copy, 1);
+  }
+  return copy;
+}
+
+/* Encodes h as base64 circllhist into buf, or into a heap buffer if it does
+ * not fit; *out is NUL terminated and must be freed if it is not buf.
+ */
+static ssize_t
+stats_hist_b64(const histogram_t *h, char *buf, size_t len, char **out) {
+  ssize_t est = hist_serialize_b64_estimate(h), rv;
+  *out = buf;
+  if(est < 0) return -1;
+  if((size_t)est >= len) {
+    len = est + 1;
+    if((*out = malloc(len)) == NULL) return -1;
+  }
+  rv = hist_serialize_b64(h, *out, len - 1);
+  if(rv < 0) {
+    if(*out != buf) free(*out);
+    *out = NULL;
+    return -1;
+  }
+  (*out)[rv] = '\0';
+  return rv;
+}
+
+bool
+stats_handle_capture(const char *metric_name, stats_handle_t *h, bool hist_since_last,
+                     stats_capture_f cb, void *cl) {
+  bool took_action = false;
+  char string_copy[4096];
+  char *string = NULL;
+  stats_handle_run_cb(h);
+
+  switch(h->type) {
+  case STATS_TYPE_STRING:
+    ck_spinlock_lock(&h->lock);
+    if(h->valueptr && *(char **)h->valueptr) {
+      int len = strlen(*(char **)h->valueptr);
+      if(len >= sizeof(string_copy)) len = sizeof(string_copy)-1;
+      memcpy(string_copy, *(char **)h->valueptr, len);
+      string_copy[len] = '\0';
+      string = string_copy;
+    }
+    ck_spinlock_unlock(&h->lock);
+    took_action = cb(cl, metric_name, h->type, string);
+    break;
+  case STATS_TYPE_INT32:
+  case STATS_TYPE_UINT32:
+  case STATS_TYPE_INT64:
+  case STATS_TYPE_UINT64:
+  case STATS_TYPE_DOUBLE:
+    took_action = cb(cl, metric_name, h->type, h->valueptr);
+    break;
+  case STATS_TYPE_COUNTER:
+  {
+    int i;
+    uint64_t sum = 0;
+    for(i=0;i<h->u.agg.fanout;i++)
+      sum += ck_pr_load_64(&h->u.agg.fan[i].cpu.incr);
+    took_action = cb(cl, metric_name, STATS_TYPE_UINT64, &sum);
+    break;
+  }
+  case STATS_TYPE_SUMMARY:
+    /* captured per component by stats_summary_capture */
+    break;
+  case STATS_TYPE_HISTOGRAM_FAST:
+  case STATS_TYPE_HISTOGRAM:
+    {
+      histogram_t *copy = stats_handle_hist_merge(h, hist_since_last);
+      if(ck_pr_load_int((int *)&h->ns->rec->hist_format) == STATS_HIST_FORMAT_B64) {
+        char b64buf[1024], *b64;
+        if(stats_hist_b64(copy, b64buf, sizeof(b64buf), &b64) >= 0) {
+          took_action = cb(cl, metric_name, STATS_TYPE_STRING, b64);
+          if(b64 != b64buf) free(b64);
+        }
+        stats_hist_scratch_done(copy);
+        break;
+      }
+      took_action = cb(cl, metric_name, STATS_TYPE_HISTOGRAM, copy);
+      stats_hist_scratch_done(copy);
+    }
+    break;
+  }
+  return took_action;
+}
+static ssize_t
+stats_val_output_json(stats_handle_t *h, bool hist_since_last, bool invoke,
+                      stats_sink_t *sink) {
+  ssize_t written = 0, rv, len;
+  char buff[64];
+  char string_copy[4096];
+
+  if(h->type == STATS_TYPE_SUMMARY) {
+    OUTF(sink, "{", 1, written);
+    rv = stats_summary_output_json(h, true, sink);
+    if(rv < 0) return -1;
+    written += rv;
+    OUTF(sink, "}", 1, written);
+    return written;
+  }
+
+  if(invoke) stats_handle_run_cb(h);
+
+  if(h->valueptr == NULL ||
+     (h->type == STATS_TYPE_STRING && *((char **)h->valueptr) == NULL)) {
+    OUTF(sink, "null", 4, written);
+    return written;
+  }
+  switch(h->type) {
+  case STATS_TYPE_STRING:
+    OUTF(sink, "\"",1,written);
+    ck_spinlock_lock(&h->lock);
+    len = strlen(*(char **)h->valueptr);
+    if(len >= sizeof(string_copy)) len = sizeof(string_copy)-1;
+    memcpy(string_copy, *(char **)h->valueptr, len);
+    ck_spinlock_unlock(&h->lock);
+    string_copy[len] = '\0';
+    rv = yajl_string_encode(sink, string_copy, len);
+    if(rv < 0) return -1;
+    written += rv;
+    OUTF(sink, "\"",1,written);
+    break;
+  case STATS_TYPE_INT32:
+  case STATS_TYPE_UINT32:
+  case STATS_TYPE_INT64:
+  case STATS_TYPE_UINT64:
+  case STATS_TYPE_DOUBLE:
+    rv = stats_scalar_output_json(h->type, h->valueptr, sink);
+    if(rv < 0) return -1;
+    written += rv;
+    break;
+  case STATS_TYPE_COUNTER:
+  {
+    int i;
+    uint64_t sum = 0;
+    for(i=0;i<h->u.agg.fanout;i++)
+      sum += ck_pr_load_64(&h->u.agg.fan[i].cpu.incr);
+    rv = stats_scalar_output_json(STATS_TYPE_UINT64, &sum, sink);
+    if(rv < 0) return -1;
+    written += rv;
+    break;
+  }
+  case STATS_TYPE_SUMMARY:
+    break;
+  case STATS_TYPE_HISTOGRAM_FAST:
+  case STATS_TYPE_HISTOGRAM:
+    {
+      int i;
+      bool needs_comma = false;
+      histogram_t *copy = stats_handle_hist_merge(h, hist_since_last);
+      if(ck_pr_load_int((int *)&h->ns->rec->hist_format) == STATS_HIST_FORMAT_B64) {
+        char b64buf[1024], *b64;
+        len = stats_hist_b64(copy, b64buf, sizeof(b64buf), &b64);
+        if(len < 0) {
+          stats_hist_scratch_done(copy);
+          return -1;
+        }
+        /* the base64 alphabet needs no JSON escaping */
+        OUTB(sink, "\"", 1, written, b64bail);
+        OUTB(sink, b64, len, written, b64bail);
+        OUTB(sink, "\"", 1, written, b64bail);
+      b64bail:
+        if(b64 != b64buf) free(b64);
+        stats_hist_scratch_done(copy);
+        break;
+      }
+      OUTB(sink, "[", 1, written, bail);
+      for(i=0;i<hist_bucket_count(copy);i++) {
+        uint64_t cnt;
+        hist_bucket_t hb;
+        if(hist_bucket_idx_bucket(copy, i, &hb, &cnt)) {
+          len = stats_fmt_hist_elem(buff, hb, cnt, needs_comma);
+          needs_comma = true;
+          OUTB(sink, buff,len,written,bail);
+        }
+      }
+      OUTB(sink, "]", 1, written,bail);
+    bail:
+      stats_hist_scratch_done(copy);
+    }
+    break;
+  }
+  return written;
+}
+
+static ssize_t
+stats_con_output_json(stats_ns_t *ns, stats_handle_t *h, bool hist_since_last,
+                      bool simple,
+                      stats_sink_t *sink) {
+  void *vc;
+  ssize_t written = 0, ns_written = 0;
+  int idle = 0;
+  ck_hs_iterator_t iterator = CK_HS_ITERATOR_INITIALIZER;
+  stats_ns_update(ns);
+  if(!simple) OUTF(sink, "{", 1, written);
+  if(ns) {
+    if(simple) OUTF(sink, "{", 1, written);
+    pthread_rwlock_rdlock(&ns->lock);
+    while(ck_hs_next(&ns->map, &iterator, &vc)) {
+      stats_container_t *c = vc;
+      if(stats_container_idle(ns, c)) idle++;
+      if(!simple || c->ns != NULL ||
+         (c->handle->type != STATS_TYPE_HISTOGRAM &&
+          c->handle->type != STATS_TYPE_HISTOGRAM_FAST)) {
+        if(ns_written) {
+          OUTBLOCK(sink, ",", 1, written, { pthread_rwlock_unlock(&ns->lock); return -1; });
+        }
+        OUTBLOCK(sink, "\"", 1, written, { pthread_rwlock_unlock(&ns->lock); return -1; });
+        ns_written = yajl_string_encode(sink, c->key, c->len);
+        if(ns_written < 0) {
+          pthread_rwlock_unlock(&ns->lock);
+          return -1;
+        }
+        written += ns_written;
+        OUTBLOCK(sink, "\":", 2, written, { pthread_rwlock_unlock(&ns->lock); return -1; });
+        ns_written = stats_con_output_json(c->ns, c->handle, hist_since_last, simple, sink);
+        if(ns_written < 0) {
+          pthread_rwlock_unlock(&ns->lock);
+          return -1;
+        }
+        written += ns_written;
+      }
+    }
+    pthread_rwlock_unlock(&ns->lock);
+    if(stats_ns_expiring(ns, idle)) stats_ns_expire(ns);
+    if(simple) OUTF(sink, "}", 1, written);
+  }
+  if(h && !simple && h->type == STATS_TYPE_SUMMARY) {
+    ssize_t rv;
+    if(ns_written) OUTF(sink, ",", 1, written);
+    rv = stats_summary_output_json(h, false, sink);
+    if(rv < 0) return -1;
+    written += rv;
+  }
+  else if(h && (!ns || !simple)) {
+    if(!simple) {
+      if(ns_written) OUTF(sink, ",", 1, written);
+      OUTF(sink, "\"_type\":\"", 9, written);
+      OUTF(sink, stats_type_code(h->type, hist_since_last), 1, written);
+      OUTF(sink, "\",\"_value\":", 11, written);
+    }
+    if(!simple || (h->type != STATS_TYPE_HISTOGRAM &&
+                   h->type != STATS_TYPE_HISTOGRAM_FAST)) {
+      ssize_t rv = stats_val_output_json(h, hist_since_last, true, sink);
+      if(rv < 0) return -1;
+      written += rv;
+    }
+  }
+  if(!simple) OUTF(sink, "}", 1, written);
+  return written;
+}
+ssize_t
+stats_recorder_output_json_sink(stats_recorder_t *rec,
+                                bool hist_since_last, bool simple,
+                                stats_sink_t *sink) {
+  ssize_t written;
+  sink->failed = false;
+  ck_pr_inc_64(&rec->epoch);
+  stats_refresh_dispatch(rec);
+  stats_hist_rings_drain();
+  written = stats_con_output_json(rec->global, NULL, hist_since_last, simple, sink);
+  if(written < 0) {
+    sink->used = 0; /* drop the partial document */
+    return -1;
+  }
+  if(!stats_sink_flush(sink)) return -1;
+  return written;
+}
+ssize_t
+stats_recorder_output_json(stats_recorder_t *rec,
+                           bool hist_since_last, bool simple,
+                           ssize_t (*outf)(void *, const char *, size_t), void *cl) {
+  char buf[STATS_SINK_STACK_SIZE];
+  stats_sink_t sink;
+  stats_sink_init_outf(&sink, buf, sizeof(buf), outf, cl);
+  return stats_recorder_output_json_sink(rec, hist_since_last, simple, &sink);
+}
+
+
+/* The tags inherited by a node during a tagged walk: one frame per
+ * enclosing namespace, living on the walker's C stack.  Each frame's tag map
+ * stays valid for as long as the namespace's read lock is held, which the
+ * walk does while descending.  `gen` is the summed tag generation of this
+ * and all enclosing frames. */
+struct stats_tag_frame {
+  const stats_tagset_t         *tags;
+  uint64_t                      gen;
+  const struct stats_tag_frame *up;
+};
+
+static int
+collect_tags(stats_tag_t **tags, int ntags, const stats_tagset_t *src) {
+  int i;
+  for(i=0;i<src->ntags && ntags<MAX_TAGS;i++) tags[ntags++] = src->tag[i];
+  return ntags;
+}
+static int
+tagptrcmp(const void *a, const void *b) {
+  const stats_tag_t *ta = *(stats_tag_t **)a, *tb = *(stats_tag_t **)b;
+  return ta == tb ? 0 : strcmp(ta->pair, tb->pair);
+}
+static size_t personal_strlcat(char *dst, const char *src, size_t size) {
+  int dl = strlen(dst);
+  int sz = size-dl-1;
+  if(sz >= 0) {
+    strncat(dst, src, sz);
+    dst[dl+sz] = '\0';
+  }
+  return dl+strlen(src);
+}
+static void
+make_metric_name(char *out, size_t len, const char *name, const stats_tagset_t *htags,
+                 const struct stats_tag_frame *frame) {
+  int i, ntags, written = 0;
+  stats_tag_t *tags[MAX_TAGS];
+  ntags = collect_tags(tags, 0, htags);
+  for(;frame;frame=frame->up) {
+    if(frame->tags) ntags = collect_tags(tags, ntags, frame->tags);
+  }
+  qsort(tags, ntags, sizeof(*tags), tagptrcmp);
+  snprintf(out, len, "%s|ST[", name);
+  for(i=0;i<ntags;i++) {
+    char tag[NOIT_TAG_MAX_PAIR_LEN+1];
+    /* the same tag inherited from several levels is written once */
+    if(i>0 && tags[i] == tags[i-1]) continue;
+    lcm_noit_metric_tagset_encode_tag(tag, sizeof(tag), tags[i]->pair, tags[i]->len);
+    if(written++) personal_strlcat(out,",",len);
+    personal_strlcat(out,tag,len);
+  }
+  personal_strlcat(out,"]",len);
+}
+
+/* Fills `out` with the handle's encoded "name|ST[...]", reusing the cached
+ * copy unless the tag generation of the handle or of an enclosing namespace
+ * moved on.  Returns the length of the leading plain name. */
+static int
+stats_handle_metric_name(stats_handle_t *h, const char *name,
+                         const struct stats_tag_frame *frame, char *out, size_t len) {
+  int name_len;
+  uint64_t gen;
+  struct stats_name_cache *nc;
+  pthread_mutex_lock(stats_handle_meta_lock(h));
+  gen = frame->gen + stats_handle_tag_gen(h);
+  if(h->tagged_cache && h->tagged_cache_gen == gen) {
+    size_t cache_len = strlen(h->tagged_cache->name);
+    if(cache_len >= len) cache_len = len - 1;
+    memcpy(out, h->tagged_cache->name, cache_len);
+    out[cache_len] = '\0';
+    name_len = h->tagged_cache->name_len;
+  }
+  else {
+    size_t out_len;
+    if(h->cold && h->cold->tagged_name) name = h->cold->tagged_name;
+    make_metric_name(out, len, name, stats_handle_tags(h), frame);
+    out_len = strlen(out);
+    name_len = strlen(name);
+    if(name_len > out_len) name_len = out_len;
+    stats_name_cache_free(&h->ns->rec->slab, h->tagged_cache);
+    if((nc = stats_slab_alloc(&h->ns->rec->slab, sizeof(*nc) + out_len + 1)) != NULL) {
+      nc->name_len = name_len;
+      memcpy(nc->name, out, out_len + 1);
+    }
+    ck_pr_store_ptr(&h->tagged_cache, nc);
+    ck_pr_store_64(&h->tagged_cache_gen, gen);
+  }
+  pthread_mutex_unlock(stats_handle_meta_lock(h));
+  return name_len;
+}
+
+static ssize_t
+stats_summary_output_json_tagged(stats_handle_t *h, const char *name, int name_len,
+                                 bool *started,
+                                 stats_sink_t *sink) {
+  ssize_t written = 0, rv;
+  struct stats_summary_value sv;
+  int i;
+
+  stats_handle_run_cb(h);
+  stats_summary_fold(h, &sv);
+  for(i=0;i<SUMMARY_NCOMPONENTS;i++) {
+    char metric_name[MAX_METRIC_TAGGED_NAME];
+    stats_type_t type;
+    void *vptr = stats_summary_component(&sv, i, &type);
+    /* splice the component in between the plain name and its tags */
+    snprintf(metric_name, sizeof(metric_name), "%.*s_%s%s", name_len, name,
+             stats_summary_component_names[i], name + name_len);
+    if(*started) OUTF(sink, ",", 1, written);
+    *started = true;
+    OUTF(sink, "\"", 1, written);
+    rv = yajl_string_encode(sink, metric_name, strlen(metric_name));
+    if(rv < 0) return -1;
+    written += rv;
+    OUTF(sink, "\":{\"_type\":\"", 12, written);
+    OUTF(sink, stats_type_code(type, false), 1, written);
+    OUTF(sink, "\",\"_value\":", 11, written);
+    rv = stats_scalar_output_json(type, vptr, sink);
+    if(rv < 0) return -1;
+    written += rv;
+    OUTF(sink, "}", 1, written);
+  }
+  return written;
+}
+
+static int
+stats_summary_capture(stats_handle_t *h, const char *name, int name_len,
+                      stats_capture_f cb, void *cl) {
+  struct stats_summary_value sv;
+  int i, cnt = 0;
+
+  stats_handle_run_cb(h);
+  stats_summary_fold(h, &sv);
+  for(i=0;i<SUMMARY_NCOMPONENTS;i++) {
+    char metric_name[MAX_METRIC_TAGGED_NAME];
+    stats_type_t type;
+    void *vptr = stats_summary_component(&sv, i, &type);
+    /* splice the component in between the plain name and its tags */
+    snprintf(metric_name, sizeof(metric_name), "%.*s_%s%s", name_len, name,
+             stats_summary_component_names[i], name + name_len);
+    if(cb(cl, metric_name, type, vptr)) cnt++;
+  }
+  return cnt;
+}
+
+/* The bits of a scalar's current value (or a hash of a string's), for
+ * spotting changes to values the library does not see being written. */
+static uint64_t
+stats_handle_value_bits(stats_handle_t *h) {
+  uint64_t bits = 0;
+  const char *str;
+  if(h->valueptr == NULL) return 0;
+  switch(h->type) {
+  case STATS_TYPE_INT32:
+  case STATS_TYPE_UINT32:
+    return 1 + (uint64_t)*(uint32_t *)h->valueptr;
+  case STATS_TYPE_INT64:
+  case STATS_TYPE_UINT64:
+  case STATS_TYPE_DOUBLE:
+    memcpy(&bits, h->valueptr, sizeof(bits));
+    return bits ^ 0x8000000000000000ULL; /* distinct from "unset" */
+  case STATS_TYPE_STRING:
+    ck_spinlock_lock(&h->lock);
+    if((str = *(char **)h->valueptr) != NULL) {
+      size_t len = strlen(str);
+      bits = ((uint64_t)__hash(str, len, 0x9e3779b9) << 32) | __hash(str, len, 0);
+      bits |= 1;
+    }
+    ck_spinlock_unlock(&h->lock);
+    return bits;
+  default:
+    break;
+  }
+  return 0;
+}
+
+static void
+stats_handle_mark(stats_handle_t *h, uint64_t epoch) {
+  uint64_t cur = ck_pr_load_64(&h->dirty);
+  while(cur < epoch && !ck_pr_cas_64_value(&h->dirty, cur, epoch, &cur));
+}
+
+/* Whether a delta export should include h.  Observed and invoked scalars
+ * are compared against the value a delta export last saw (running the
+ * callback, which *invoked reports so it is not run twice); a change to
+ * the tags it inherits counts as a change too.  Other invoked handles
+ * cannot be judged and are always included.
+ */
+static bool
+stats_handle_changed(stats_handle_t *h, const struct stats_tag_frame *frame,
+                     const struct stats_delta *delta, bool *invoke) {
+  bool renamed;
+  switch(h->type) {
+  case STATS_TYPE_STRING:
+  case STATS_TYPE_INT32:
+  case STATS_TYPE_UINT32:
+  case STATS_TYPE_INT64:
+  case STATS_TYPE_UINT64:
+  case STATS_TYPE_DOUBLE:
+    if(stats_handle_has_cb(h) || (h->valueptr != &h->u.store && h->valueptr != &h->u.str.value)) {
+      struct stats_handle_cold *cold = stats_handle_cold(h);
+      uint64_t bits, old;
+      if(cold == NULL) return true;
+      if(cold->cb) {
+        stats_handle_run_cb(h);
+        *invoke = false;
+      }
+      bits = stats_handle_value_bits(h);
+      old = ck_pr_load_64(&cold->delta_bits);
+      if(bits != old && ck_pr_cas_64(&cold->delta_bits, old, bits))
+        stats_handle_mark(h, delta->epoch);
+    }
+    break;
+  default:
+    if(stats_handle_has_cb(h)) return true;
+    break;
+  }
+  renamed = ck_pr_load_ptr(&h->tagged_cache) &&
+            ck_pr_load_64(&h->tagged_cache_gen) != frame->gen + stats_handle_tag_gen(h);
+  if(renamed) stats_handle_mark(h, delta->epoch);
+  return ck_pr_load_64(&h->dirty) >= delta->since;
+}
+
+static ssize_t
+stats_con_output_json_tagged(stats_ns_t *ns, stats_handle_t *h, const char *name, bool hist_since_last,
+                      bool top_level, bool *started, const struct stats_tag_frame *up,
+                      const struct stats_delta *delta, stats_sink_t *sink) {
+  void *vc;
+  ssize_t written = 0, ns_written = 0;
+  char metric_name[MAX_METRIC_TAGGED_NAME];
+  int name_len, idle = 0;
+  bool invoke = true;
+  struct stats_tag_frame frame = { NULL, up ? up->gen : 0, up };
+  ck_hs_iterator_t iterator = CK_HS_ITERATOR_INITIALIZER;
+  stats_ns_update(ns);
+  if(top_level) OUTF(sink, "{", 1, written);
+  if(ns) {
+    /* held through the handle below, which inherits this namespace's tags */
+    pthread_rwlock_rdlock(&ns->lock);
+    frame.tags = &ns->tags;
+    frame.gen += ck_pr_load_64(&ns->tag_gen);
+    while(ck_hs_next(&ns->map, &iterator, &vc)) {
+      stats_container_t *c = vc;
+      if(stats_container_idle(ns, c)) idle++;
+      ns_written = stats_con_output_json_tagged(c->ns, c->handle, c->key, hist_since_last, false, started, &frame, delta, sink);
+      if(ns_written < 0) {
+        pthread_rwlock_unlock(&ns->lock);
+        return -1;
+      }
+      written += ns_written;
+    }
+  }
+  if(h && delta && !stats_handle_changed(h, &frame, delta, &invoke)) h = NULL;
+  if(h && !h->tagged_suppress && h->type == STATS_TYPE_SUMMARY) {
+    name_len = stats_handle_metric_name(h, name, &frame, metric_name, sizeof(metric_name));
+    ns_written = stats_summary_output_json_tagged(h, metric_name, name_len, started, sink);
+    if(ns_written < 0) goto bail;
+    written += ns_written;
+  }
+  else if(h && !h->tagged_suppress) {
+    if(*started) {
+      OUTB(sink, ",", 1, written, bail);
+    }
+    *started = true;
+    OUTB(sink, "\"", 1, written, bail);
+    stats_handle_metric_name(h, name, &frame, metric_name, sizeof(metric_name));
+    ns_written = yajl_string_encode(sink, metric_name, strlen(metric_name));
+    if(ns_written < 0) goto bail;
+    written += ns_written;
+    OUTB(sink, "\":{", 3, written, bail);
+    OUTB(sink, "\"_type\":\"", 9, written, bail);
+    OUTB(sink, stats_type_code(h->type, hist_since_last), 1, written, bail);
+    OUTB(sink, "\",\"_value\":", 11, written, bail);
+    ns_written = stats_val_output_json(h, hist_since_last, invoke, sink);
+    if(ns_written < 0) goto bail;
+    written += ns_written;
+    OUTB(sink, "}", 1, written, bail);
+  }
+  if(ns) pthread_rwlock_unlock(&ns->lock);
+  if(stats_ns_expiring(ns, idle)) stats_ns_expire(ns);
+  if(top_level) OUTF(sink, "}", 1, written);
+  return written;
+ bail:
+  if(ns) pthread_rwlock_unlock(&ns->lock);
+  return -1;
+}
+ssize_t
+stats_recorder_output_json_tagged_sink(stats_recorder_t *rec,
+                                       bool hist_since_last,
+                                       stats_sink_t *sink) {
+  bool started = false;
+  ssize_t written;
+  sink->failed = false;
+  ck_pr_inc_64(&rec->epoch);
+  stats_refresh_dispatch(rec);
+  stats_hist_rings_drain();
+  written = stats_con_output_json_tagged(rec->global, NULL, NULL, hist_since_last, true, &started, NULL, NULL, sink);
+  if(written < 0) {
+    sink->used = 0; /* drop the partial document */
+    return -1;
+  }
+  if(!stats_sink_flush(sink)) return -1;
+  return written;
+}
+ssize_t
+stats_recorder_output_json_tagged(stats_recorder_t *rec,
+                                  bool hist_since_last,
+                                  ssize_t (*outf)(void *, const char *, size_t), void *cl) {
+  char buf[STATS_SINK_STACK_SIZE];
+  stats_sink_t sink;
+  stats_sink_init_outf(&sink, buf, sizeof(buf), outf, cl);
+  return stats_recorder_output_json_tagged_sink(rec, hist_since_last, &sink);
+}
+
+stats_cursor_t *
+stats_cursor_alloc(int full_every) {
+  stats_cursor_t *cursor = calloc(1, sizeof(*cursor));
+  if(cursor && full_every > 0) cursor->full_every = full_every;
+  return cursor;
+}
+
+void
+stats_cursor_free(stats_cursor_t *cursor) {
+  free(cursor);
+}
+
+ssize_t
+stats_recorder_output_json_tagged_delta_sink(stats_recorder_t *rec,
+                                             bool hist_since_last,
+                                             stats_cursor_t *cursor,
+                                             stats_sink_t *sink) {
+  bool started = false;
+  ssize_t written;
+  struct stats_delta delta;
+  /* writes from here on are stamped with the next epoch */
+  delta.epoch = ck_pr_faa_64(&rec->epoch, 1);
+  stats_refresh_dispatch(rec);
+  delta.since = cursor->since;
+  if(cursor->full_every && cursor->exports % cursor->full_every == 0) delta.since = 0;
+  sink->failed = false;
+  stats_hist_rings_drain();
+  written = stats_con_output_json_tagged(rec->global, NULL, NULL, hist_since_last, true, &started, NULL, &delta, sink);
+  if(written < 0) {
+    sink->used = 0; /* drop the partial document */
+    return -1;
+  }
+  if(!stats_sink_flush(sink)) return -1;
+  /* only a delivered document moves the cursor */
+  cursor->since = delta.epoch + 1;
+  cursor->exports++;
+  return written;
+}
+ssize_t
+stats_recorder_output_json_tagged_delta(stats_recorder_t *rec,
+                                        bool hist_since_last,
+                                        stats_cursor_t *cursor,
+                                        ssize_t (*outf)(void *, const char *, size_t), void *cl) {
+  char buf[STATS_SINK_STACK_SIZE];
+  stats_sink_t sink;
+  stats_sink_init_outf(&sink, buf, sizeof(buf), outf, cl);
+  return stats_recorder_output_json_tagged_delta_sink(rec, hist_since_last, cursor, &sink);
+}
+
+static int
+stats_con_capture(stats_ns_t *ns, stats_handle_t *h, const char *name, bool hist_since_last,
+                  const struct stats_tag_frame *up, stats_capture_f cb, void *cl) {
+  int cnt = 0, name_len, idle = 0;
+  void *vc;
+  char metric_name[MAX_METRIC_TAGGED_NAME];
+  struct stats_tag_frame frame = { NULL, up ? up->gen : 0, up };
+  ck_hs_iterator_t iterator = CK_HS_ITERATOR_INITIALIZER;
+  stats_ns_update(ns);
+  if(ns) {
+    pthread_rwlock_rdlock(&ns->lock);
+    frame.tags = &ns->tags;
+    frame.gen += ck_pr_load_64(&ns->tag_gen);
+    while(ck_hs_next(&ns->map, &iterator, &vc)) {
+      stats_container_t *c = vc;
+      if(stats_container_idle(ns, c)) idle++;
+      cnt += stats_con_capture(c->ns, c->handle, c->key, hist_since_last, &frame, cb, cl);
+    }
+  }
+  if(h && !h->tagged_suppress && h->type == STATS_TYPE_SUMMARY) {
+    name_len = stats_handle_metric_name(h, name, &frame, metric_name, sizeof(metric_name));
+    cnt += stats_summary_capture(h, metric_name, name_len, cb, cl);
+  }
+  else if(h && !h->tagged_suppress) {
+    stats_handle_metric_name(h, name, &frame, metric_name, sizeof(metric_name));
+    if(stats_handle_capture(metric_name, h, hist_since_last, cb, cl)) {
+      cnt++;
+    }
+  }
+  if(ns) pthread_rwlock_unlock(&ns->lock);
+  if(stats_ns_expiring(ns, idle)) stats_ns_expire(ns);
+  return cnt;
+}
+
+int
+stats_recorder_capture(stats_recorder_t *rec, bool hist_since_last,
+                       stats_capture_f cb, void *cl) {
+  ck_pr_inc_64(&rec->epoch);
+  stats_refresh_dispatch(rec);
+  stats_hist_rings_drain();
+  return stats_con_capture(rec->global, NULL, NULL, hist_since_last, NULL, cb, cl);
+}
+
+/* Snapshots.  One walk copies every metric, with histograms merged down to
+ * their buckets, into arena blocks owned by the snapshot; the namespace
+ * locks are released as soon as the walk ends and exporters then read the
+ * snapshot without touching the recorder.  Values are kept once and
+ * indexed three ways: the tagged metrics in walk order, the namespace tree
+ * (one node per container, depth first) and the Prometheus series with
+ * their labels already rendered.
+ */
+#define STATS_ARENA_BLOCK_SIZE 65536
+#define SNAPSHOT_MAX_THREADS 64
+struct stats_arena_block {
+  struct stats_arena_block *next;
+  size_t                    used;
+  size_t                    size;
+  char                      data[];
+};
+struct stats_snapshot_bucket {
+  hist_bucket_t             hb;
+  uint64_t                  cnt;
+};
+struct stats_snapshot_metric {
+  struct stats_snapshot_metric *next;
+  const char               *name;
+  stats_type_t              type;
+  bool                      isnull;
+  int                       nbuckets;
+  union {
+    int32_t                   i32;
+    uint32_t                  u32;
+    int64_t                   i64;
+    uint64_t                  u64;
+    double                    d;
+    const char               *str;
+    struct stats_snapshot_bucket *buckets;
+  }                         v;
+};
+struct stats_snapshot_node {
+  struct stats_snapshot_node   *next;
+  const char                   *key;
+  int                           keylen;
+  int                           depth;  /* 1 for the global namespace's children */
+  bool                          ns;     /* a namespace; its children follow it */
+  struct stats_snapshot_metric *m;      /* the handle's value, if any */
+  struct stats_summary_value   *sv;     /* or its folded summary */
+};
+struct stats_snapshot_prom {
+  struct stats_snapshot_prom   *next;
+  const char                   *name;   /* the tagged name or key */
+  const char                   *labels; /* label pairs, without braces */
+  size_t                        labels_len;
+  stats_type_t                  type;
+  /* the value; for a summary, the first of its component metrics */
+  const struct stats_snapshot_metric *m;
+};
+struct stats_prom_walk;
+struct stats_snapshot {
+  struct stats_arena_block     *arena;
+  struct stats_snapshot_metric *head;
+  struct stats_snapshot_metric **tail;
+  struct stats_snapshot_node   *nodes;
+  struct stats_snapshot_node  **nodes_tail;
+  struct stats_snapshot_prom   *prom;
+  struct stats_snapshot_prom  **prom_tail;
+  struct stats_prom_walk       *labels; /* scratch while it is taken */
+  int                           count;
+  bool                          hist_since_last;
+  stats_hist_format_t           hist_format;
+  uint64_t                      create_ns;
+  uint64_t                      lock_ns;
+};
+
+static void *
+stats_arena_alloc(struct stats_arena_block **arena, size_t len) {
+  struct stats_arena_block *b = *arena;
+  void *p;
+  len = (len + 7) & ~(size_t)7;
+  if(b == NULL || b->size - b->used < len) {
+    size_t size = len > STATS_ARENA_BLOCK_SIZE ? len : STATS_ARENA_BLOCK_SIZE;
+    if((b = malloc(sizeof(*b) + size)) == NULL) return NULL;
+    b->used = 0;
+    b->size = size;
+    b->next = *arena;
+    *arena = b;
+  }
+  p = b->data + b->used;
+  b->used += len;
+  return p;
+}
+static char *
+stats_arena_strndup(struct stats_arena_block **arena, const char *s, size_t len) {
+  char *p = stats_arena_alloc(arena, len + 1);
+  if(p == NULL) return NULL;
+  memcpy(p, s, len);
+  p[len] = '\0';
+  return p;
+}
+
+/* Adds a value; it is a tagged metric if it has a name. */
+static struct stats_snapshot_metric *
+stats_snapshot_add(stats_snapshot_t *snap, const char *name, stats_type_t type) {
+  struct stats_snapshot_metric *m = stats_arena_alloc(&snap->arena, sizeof(*m));
+  if(m == NULL) return NULL;
+  memset(m, 0, sizeof(*m));
+  m->type = type;
+  if(name == NULL) return m;
+  if((m->name = stats_arena_strndup(&snap->arena, name, strlen(name))) == NULL) return NULL;
+  *snap->tail = m;
+  snap->tail = &m->next;
+  snap->count++;
+  return m;
 }
 
-bool stats_add64(stats_handle_t *h, int64_t cnt) {
-  if(h == NULL) return false;
-  if(h->type == STATS_TYPE_COUNTER) {
-    int cpu = __get_fanout(h->fanout);
-    ck_pr_add_64(&h->fan[cpu].cpu.incr, cnt);
-    return true;
-  }
-  if(h->type != STATS_TYPE_INT64 && h->type != STATS_TYPE_UINT64)
-    return false;
-  ck_pr_add_64(&h->store.u64, cnt);
-  return true;
+static struct stats_snapshot_node *
+stats_snapshot_node_add(stats_snapshot_t *snap, const stats_container_t *c, int depth) {
+  struct stats_snapshot_node *node = stats_arena_alloc(&snap->arena, sizeof(*node));
+  if(node == NULL) return NULL;
+  memset(node, 0, sizeof(*node));
+  if((node->key = stats_arena_strndup(&snap->arena, c->key, c->len)) == NULL) return NULL;
+  node->keylen = c->len;
+  node->depth = depth;
+  *snap->nodes_tail = node;
+  snap->nodes_tail = &node->next;
+  return node;
 }
 
-bool
-stats_set(stats_handle_t *h, stats_type_t type, void *ptr) {
-  int len, i;
-  if(h == NULL) return false;
-  if(h->type == STATS_TYPE_HISTOGRAM ||
-     h->type == STATS_TYPE_HISTOGRAM_FAST) {
-    const histogram_t * const * hptr = (const histogram_t * const *)&ptr;
-    int cpu = __get_fanout(h->fanout);
-    bool rv = true;
-    if(ptr == NULL) {
-      for(i=0;i<h->fanout;i++) {
-        hist_clear(h->fan[i].cpu.hist);
-      }
-      hist_clear(h->hist_aggr);
-      return true;
-    }
-    // For histogram types, we can actually allow setting from other types
-    pthread_mutex_lock(&h->fan[cpu].cpu.mutex);
-    switch(type) {
-    case STATS_TYPE_COUNTER:
-    case STATS_TYPE_STRING:
-      rv = false; break; // but not these types
-    case STATS_TYPE_HISTOGRAM:
-      /* intentional fallthrough */
-    case STATS_TYPE_HISTOGRAM_FAST:
-      hist_accumulate(h->fan[cpu].cpu.hist, hptr, 1);
-      break;
-    case STATS_TYPE_INT32:
-      hist_insert_intscale(h->fan[cpu].cpu.hist, *((int32_t *)ptr), 0, 1);
-      break;
-    case STATS_TYPE_UINT32:
-      hist_insert_intscale(h->fan[cpu].cpu.hist, *((uint32_t *)ptr), 0, 1);
-      break;
-    case STATS_TYPE_INT64:
-      hist_insert_intscale(h->fan[cpu].cpu.hist, *((int64_t *)ptr), 0, 1);
-      break;
-    case STATS_TYPE_UINT64:
-      hist_insert(h->fan[cpu].cpu.hist, (double)*((uint64_t *)ptr), 1);
-      break;
-    case STATS_TYPE_DOUBLE:
-      hist_insert(h->fan[cpu].cpu.hist, *((double *)ptr), 1);
-      break;
-    }
-    pthread_mutex_unlock(&h->fan[cpu].cpu.mutex);
-    return rv;
+static bool
+stats_snapshot_prom_add(stats_snapshot_t *snap, stats_handle_t *h, const char *key,
+                        const struct stats_tag_frame *frame,
+                        const struct stats_snapshot_metric *m);
+static void
+stats_snapshot_labels_done(stats_snapshot_t *snap);
+
+static bool
+stats_snapshot_scalar(struct stats_snapshot_metric *m, const void *vptr) {
+  if(vptr == NULL) {
+    m->isnull = true;
+    return true;
   }
-  if(h->type != type) return false;
-  switch(type) {
-  // we necessarily handled the histogram case already
-  case STATS_TYPE_COUNTER:
-    if(ptr == NULL) {
-      for(i=0;i<h->fanout;i++) h->fan[i].cpu.incr = 0;
-      return true;
-    }
-    return false;
-  case STATS_TYPE_HISTOGRAM: assert(type != STATS_TYPE_HISTOGRAM); break;
-  case STATS_TYPE_HISTOGRAM_FAST: assert(type != STATS_TYPE_HISTOGRAM_FAST); break;
-  case STATS_TYPE_STRING:
-    if(ptr == NULL) {
-      h->valueptr = NULL;
-      return true;
-    }
-    len = strlen((char *)ptr) + 1;
-    char *tofree = NULL;
-    if(h->str.len < len) {
-      char *replace = malloc(len);
-      tofree = h->str.value;
-      pthread_mutex_lock(&h->mutex);
-      h->str.value = replace;
-      h->str.len = len;
-    } else {
-      pthread_mutex_lock(&h->mutex);
-    }
-    memcpy(h->str.value, (char *)ptr, len);
-    h->valueptr = h->strref;
-    pthread_mutex_unlock(&h->mutex);
-    free(tofree);
-    break;
+  switch(m->type) {
   case STATS_TYPE_INT32:
   case STATS_TYPE_UINT32:
-    h->valueptr = &h->store;
-    memcpy(h->valueptr, ptr, sizeof(int32_t));
+    memcpy(&m->v.i32, vptr, sizeof(int32_t));
     break;
-  case STATS_TYPE_INT64:
-  case STATS_TYPE_UINT64:
-  case STATS_TYPE_DOUBLE:
-    h->valueptr = &h->store;
-    memcpy(h->valueptr, ptr, sizeof(int64_t));
+  default:
+    memcpy(&m->v.u64, vptr, sizeof(uint64_t));
     break;
   }
   return true;
 }
 
-static int
-stats_ns_clear(stats_ns_t *ns, stats_type_t type) {
-  int cleared = 0;
-  void *vc;
-  ck_hs_iterator_t iterator = CK_HS_ITERATOR_INITIALIZER;
-  pthread_rwlock_rdlock(&ns->lock);
-  while(ck_hs_next(&ns->map, &iterator, &vc)) {
-    stats_container_t *c = vc;
-    if(c->ns) cleared += stats_ns_clear(c->ns, type);
-    if(c->handle && c->handle->type == type) {
-      if(stats_handle_clear(c->handle)) cleared++;
+/* Reads a counter or merges a histogram into m, allocating from arena. */
+static bool
+stats_snapshot_value(struct stats_arena_block **arena, struct stats_snapshot_metric *m,
+                     stats_handle_t *h, bool hist_since_last) {
+  int i;
+  switch(h->type) {
+  case STATS_TYPE_COUNTER:
+    for(i=0;i<h->u.agg.fanout;i++)
+      m->v.u64 += ck_pr_load_64(&h->u.agg.fan[i].cpu.incr);
+    break;
+  case STATS_TYPE_HISTOGRAM_FAST:
+  case STATS_TYPE_HISTOGRAM:
+    {
+      histogram_t *copy = stats_handle_hist_merge(h, hist_since_last);
+      int n = hist_bucket_count(copy);
+      m->v.buckets = stats_arena_alloc(arena, (n ? n : 1) * sizeof(*m->v.buckets));
+      if(m->v.buckets == NULL) {
+        stats_hist_scratch_done(copy);
+        return false;
+      }
+      for(i=0;i<n;i++) {
+        struct stats_snapshot_bucket *b = &m->v.buckets[m->nbuckets];
+        if(hist_bucket_idx_bucket(copy, i, &b->hb, &b->cnt)) m->nbuckets++;
+      }
+      stats_hist_scratch_done(copy);
     }
+    break;
+  default:
+    break;
   }
-  pthread_rwlock_unlock(&ns->lock);
-  return cleared;
-}
-
-int
-stats_recorder_clear(stats_recorder_t *rec, stats_type_t type) {
-  return stats_ns_clear(rec->global, type);
+  return true;
 }
 
-#define OUTF(cl,k,l,a) do { \
-  int rv = outf((cl), (k), (l)); \
-  if(rv != (l)) return -1; \
-  (a) += rv; \
-} while(0)
+/* Parallel collection.  The walk adds each metric in order but leaves the
+ * counters and histograms of callback-free handles as jobs, and keeps every
+ * namespace it visits read-locked; workers then fill in the jobs and only
+ * after that are the locks dropped, so no handle can go away underneath
+ * them.  Each worker allocates from its own arena.  The helpers are kept
+ * in one pool for the life of the process, started as snapshots first ask
+ * for them; a snapshot that finds the pool in use does its jobs alone.
+ */
+#define SNAPSHOT_JOB_BATCH 32
+struct stats_snapshot_job {
+  stats_handle_t               *h;
+  struct stats_snapshot_metric *m;
+};
+struct stats_snapshot_held {
+  stats_ns_t                   *ns;
+  uint64_t                      locked;
+  int                           idle;
+};
+struct stats_snapshot_work {
+  struct stats_snapshot_job    *jobs;
+  int                           njobs;
+  int                           jobs_alloc;
+  struct stats_snapshot_held   *held;
+  int                           nheld;
+  int                           held_alloc;
+  int                           next;
+  int                           failed;
+  stats_snapshot_t             *snap;
+};
+struct stats_snapshot_worker {
+  struct stats_snapshot_work   *work;    /* set while a snapshot has it */
+  struct stats_arena_block     *arena;
+};
+struct stats_snapshot_pool {
+  pthread_mutex_t               lock;
+  pthread_cond_t                work;
+  pthread_cond_t                done;
+  int                           running;  /* helpers still on the snapshot */
+  int                           threads;
+  struct stats_snapshot_worker  workers[SNAPSHOT_MAX_THREADS - 1];
+};
+static struct stats_snapshot_pool stats_snapshot_pool = {
+  PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER
+};
+/* held by the snapshot using the pool */
+static pthread_mutex_t stats_snapshot_pool_lock = PTHREAD_MUTEX_INITIALIZER;
 
-#define OUTB(cl,k,l,a,label) do { \
-  int rv = outf((cl), (k), (l)); \
-  if(rv != (l)) goto label; \
-  (a) += rv; \
-} while(0)
+static bool
+stats_snapshot_grow(void **array, int *alloc, int n, size_t size) {
+  void *grown;
+  if(n < *alloc) return true;
+  if((grown = realloc(*array, (*alloc ? *alloc * 2 : 256) * size)) == NULL) return false;
+  *array = grown;
+  *alloc = *alloc ? *alloc * 2 : 256;
+  return true;
+}
 
-#define OUTBLOCK(cl,k,l,a,block) do { \
-  int rv = outf((cl), (k), (l)); \
-  if(rv != (l)) block \
-  (a) += rv; \
-} while(0)
+static void
+stats_snapshot_run_jobs(struct stats_snapshot_worker *w) {
+  struct stats_snapshot_work *work = w->work;
+  int i, end;
+  while((i = ck_pr_faa_int(&work->next, SNAPSHOT_JOB_BATCH)) < work->njobs) {
+    end = i + SNAPSHOT_JOB_BATCH < work->njobs ? i + SNAPSHOT_JOB_BATCH : work->njobs;
+    for(;i<end;i++) {
+      if(!stats_snapshot_value(&w->arena, work->jobs[i].m, work->jobs[i].h,
+                               work->snap->hist_since_last))
+        ck_pr_store_int(&work->failed, 1);
+    }
+  }
+}
 
-/* yajl_string_encode is borrowed and hacked from libyajl
- *
- * Copyright (c) 2007-2014, Lloyd Hilaiel <me@lloyd.io>
- *
- * Permission to use, copy, modify, and/or distribute this software for any
- * purpose with or without fee is hereby granted, provided that the above
- * copyright notice and this permission notice appear in all copies.
- *
- * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
- * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
- * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
- * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
- * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
- * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
- * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
- */
-static ssize_t
-yajl_string_encode(ssize_t (*outf)(void *, const char *, size_t),
-                   void *cl,
-                   const char * sstr,
-                   size_t len) {
-  const unsigned char * str = (const unsigned char *)sstr;
-  ssize_t written = 0;
-  static const char * hexchar = "0123456789ABCDEF";
-  size_t beg = 0;
-  size_t end = 0;
-  char hexbuf[7] = { '\\', 'u', '0', '0', '0', '0', 0 };
+static void *
+stats_snapshot_worker(void *vw) {
+  struct stats_snapshot_worker *w = vw;
+  struct stats_snapshot_pool *pool = &stats_snapshot_pool;
+  pthread_mutex_lock(&pool->lock);
+  for(;;) {
+    while(w->work == NULL) pthread_cond_wait(&pool->work, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+    stats_snapshot_run_jobs(w);
+    pthread_mutex_lock(&pool->lock);
+    w->work = NULL;
+    if(--pool->running == 0) pthread_cond_broadcast(&pool->done);
+  }
+  return NULL;
+}
 
-  while (end < len) {
-    const char * escaped = NULL;
-    switch (str[end]) {
-      case '\r': escaped = "\\r"; break;
-      case '\n': escaped = "\\n"; break;
-      case '\\': escaped = "\\\\"; break;
-      case '"': escaped = "\\\""; break;
-      case '\f': escaped = "\\f"; break;
-      case '\b': escaped = "\\b"; break;
-      case '\t': escaped = "\\t"; break;
-      default:
-        if ((unsigned char) str[end] < 32) {
-          hexbuf[4] = hexchar[(uint8_t)str[end] >> 4];
-          hexbuf[5] = hexchar[(uint8_t)str[end] & 0xf];
-          escaped = hexbuf;
-        }
-        break;
+/* Runs work's jobs on the calling thread and up to helpers of the pool's,
+ * and hands their arenas to the snapshot. */
+static void
+stats_snapshot_pool_run(struct stats_snapshot_work *work, int helpers) {
+  struct stats_snapshot_pool *pool = &stats_snapshot_pool;
+  struct stats_snapshot_worker self = { work, NULL };
+  struct stats_arena_block *b, *next;
+  pthread_t tid;
+  int i;
+  if(helpers > 0 && pthread_mutex_trylock(&stats_snapshot_pool_lock)) helpers = 0;
+  if(helpers > 0) {
+    pthread_mutex_lock(&pool->lock);
+    while(pool->threads < helpers) {
+      if(pthread_create(&tid, NULL, stats_snapshot_worker, &pool->workers[pool->threads])) break;
+      pthread_detach(tid);
+      pool->threads++;
     }
-    if (escaped != NULL) {
-      OUTF(cl, (const char *) (str + beg), end - beg, written);
-      OUTF(cl, escaped, (unsigned int)strlen(escaped), written);
-      beg = ++end;
-    } else {
-      ++end;
+    if(helpers > pool->threads) helpers = pool->threads;
+    for(i=0;i<helpers;i++) pool->workers[i].work = work;
+    pool->running = helpers;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+  }
+  stats_snapshot_run_jobs(&self);
+  if(helpers > 0) {
+    pthread_mutex_lock(&pool->lock);
+    while(pool->running) pthread_cond_wait(&pool->done, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+  }
+  /* the workers' arenas now belong to the snapshot */
+  for(i=-1;i<helpers;i++) {
+    b = i < 0 ? self.arena : pool->workers[i].arena;
+    for(;b;b=next) {
+      next = b->next;
+      b->next = work->snap->arena;
+      work->snap->arena = b;
     }
+    if(i >= 0) pool->workers[i].arena = NULL;
   }
-  OUTF(cl, (const char *) (str + beg), end - beg, written);
-  return written;
+  if(helpers > 0) pthread_mutex_unlock(&stats_snapshot_pool_lock);
 }
-bool
-stats_handle_capture(const char *metric_name, stats_handle_t *h, bool hist_since_last,
-                     stats_capture_f cb, void *cl) {
-  bool took_action = false;
-  char string_copy[4096];
-  char *string = NULL;
-  if(h->cb) {
-    h->cb(h, &h->valueptr, h->cb_closure);
-  }
 
+/* Copies h, found under key, into the tree node and, unless the handle is
+ * suppressed from tagged output, as tagged metrics and Prometheus series. */
+static bool
+stats_snapshot_handle(stats_snapshot_t *snap, stats_handle_t *h, const char *key,
+                      const struct stats_tag_frame *frame, struct stats_snapshot_node *node,
+                      struct stats_snapshot_work *work) {
+  char name[MAX_METRIC_TAGGED_NAME];
+  struct stats_snapshot_metric *m;
+  bool tagged = !h->tagged_suppress;
+  int i, name_len = 0;
+  if(tagged) name_len = stats_handle_metric_name(h, key, frame, name, sizeof(name));
+  stats_handle_run_cb(h);
+  if(h->type == STATS_TYPE_SUMMARY) {
+    struct stats_summary_value *sv = stats_arena_alloc(&snap->arena, sizeof(*sv));
+    struct stats_snapshot_metric *first = NULL;
+    if(sv == NULL) return false;
+    stats_summary_fold(h, sv);
+    if(node) node->sv = sv;
+    if(!tagged) return true;
+    for(i=0;i<SUMMARY_NCOMPONENTS;i++) {
+      char metric_name[MAX_METRIC_TAGGED_NAME];
+      stats_type_t type;
+      void *vptr = stats_summary_component(sv, i, &type);
+      /* splice the component in between the plain name and its tags */
+      snprintf(metric_name, sizeof(metric_name), "%.*s_%s%s", name_len, name,
+               stats_summary_component_names[i], name + name_len);
+      if((m = stats_snapshot_add(snap, metric_name, type)) == NULL) return false;
+      stats_snapshot_scalar(m, vptr);
+      if(first == NULL) first = m;
+    }
+    return stats_snapshot_prom_add(snap, h, key, frame, first);
+  }
+  if((m = stats_snapshot_add(snap, tagged ? name : NULL, h->type)) == NULL) return false;
+  if(node) node->m = m;
+  if(tagged && h->type != STATS_TYPE_STRING &&
+     !stats_snapshot_prom_add(snap, h, key, frame, m)) return false;
   switch(h->type) {
   case STATS_TYPE_STRING:
-    pthread_mutex_lock(&h->mutex);
+    ck_spinlock_lock(&h->lock);
     if(h->valueptr && *(char **)h->valueptr) {
-      int len = strlen(*(char **)h->valueptr);
-      if(len >= sizeof(string_copy)) len = sizeof(string_copy)-1;
-      memcpy(string_copy, *(char **)h->valueptr, len);
-      string_copy[len] = '\0';
-      string = string_copy;
+      const char *str = *(char **)h->valueptr;
+      m->v.str = stats_arena_strndup(&snap->arena, str, strlen(str));
     }
-    pthread_mutex_unlock(&h->mutex);
-    took_action = cb(cl, metric_name, h->type, string);
+    ck_spinlock_unlock(&h->lock);
+    m->isnull = m->v.str == NULL;
     break;
   case STATS_TYPE_INT32:
   case STATS_TYPE_UINT32:
   case STATS_TYPE_INT64:
   case STATS_TYPE_UINT64:
   case STATS_TYPE_DOUBLE:
-    took_action = cb(cl, metric_name, h->type, h->valueptr);
+    stats_snapshot_scalar(m, h->valueptr);
     break;
-  case STATS_TYPE_COUNTER:
-  {
-    int i;
-    uint64_t sum = 0;
-    for(i=0;i<h->fanout;i++)
-      sum += ck_pr_load_64(&h->fan[i].cpu.incr);
-    took_action = cb(cl, metric_name, STATS_TYPE_UINT64, &sum);
+  case STATS_TYPE_SUMMARY:
     break;
-  }
+  case STATS_TYPE_COUNTER:
   case STATS_TYPE_HISTOGRAM_FAST:
   case STATS_TYPE_HISTOGRAM:
-    {
-      int i;
-      bool needs_comma = false;
-      histogram_t *copy = hist_alloc_nbins(h->last_size * h->fanout); // upper bound
-      for(i=0;i<h->fanout;i++) {
-        const histogram_t * const * hptr = (const histogram_t * const *)&h->fan[i].cpu.hist;
-        pthread_mutex_lock(&h->fan[i].cpu.mutex);
-        hist_accumulate(copy, hptr, 1);
-        if(hist_since_last) {
-          hist_clear(h->fan[i].cpu.hist);
-        }
-        pthread_mutex_unlock(&h->fan[i].cpu.mutex);
-      }
-      if(hist_since_last) hist_accumulate(h->hist_aggr, (const histogram_t *const *)&copy, 1);
-      else hist_accumulate(copy, (const histogram_t *const *)&h->hist_aggr, 1);
-      h->last_size = hist_bucket_count(copy);
-    bail:
-      took_action = cb(cl, metric_name, STATS_TYPE_HISTOGRAM, copy);
-      hist_free(copy);
+    /* callbacks stay on the calling thread */
+    if(work && !stats_handle_has_cb(h)) {
+      if(!stats_snapshot_grow((void **)&work->jobs, &work->jobs_alloc, work->njobs, sizeof(*work->jobs)))
+        return false;
+      work->jobs[work->njobs].h = h;
+      work->jobs[work->njobs].m = m;
+      work->njobs++;
+      break;
     }
-    break;
+    return stats_snapshot_value(&snap->arena, m, h, snap->hist_since_last);
   }
-  return took_action;
+  return true;
+}
+
+static bool
+stats_con_snapshot(stats_ns_t *ns, stats_handle_t *h, const char *name,
+                   const struct stats_tag_frame *up, stats_snapshot_t *snap,
+                   struct stats_snapshot_node *node, int depth,
+                   struct stats_snapshot_work *work) {
+  void *vc;
+  bool ok = true;
+  int idle = 0, held = 0;
+  uint64_t locked = 0;
+  struct stats_tag_frame frame = { NULL, up ? up->gen : 0, up };
+  ck_hs_iterator_t iterator = CK_HS_ITERATOR_INITIALIZER;
+  stats_ns_update(ns);
+  if(node) node->ns = ns != NULL;
+  if(ns) {
+    if(work && !stats_snapshot_grow((void **)&work->held, &work->held_alloc, work->nheld, sizeof(*work->held)))
+      return false;
+    pthread_rwlock_rdlock(&ns->lock);
+    locked = stats_nanos();
+    if(work) {
+      held = work->nheld++;
+      work->held[held].ns = ns;
+      work->held[held].locked = locked;
+      work->held[held].idle = 0;
+    }
+    frame.tags = &ns->tags;
+    frame.gen += ck_pr_load_64(&ns->tag_gen);
+    while(ok && ck_hs_next(&ns->map, &iterator, &vc)) {
+      stats_container_t *c = vc;
+      struct stats_snapshot_node *child = stats_snapshot_node_add(snap, c, depth + 1);
+      if(stats_container_idle(ns, c)) idle++;
+      ok = child && stats_con_snapshot(c->ns, c->handle, c->key, &frame, snap, child, depth + 1, work);
+    }
+    if(work) work->held[held].idle = idle;
+  }
+  if(ok && h) ok = stats_snapshot_handle(snap, h, name, &frame, node, work);
+  if(ns && !work) {
+    pthread_rwlock_unlock(&ns->lock);
+    locked = stats_nanos() - locked;
+    if(locked > snap->lock_ns) snap->lock_ns = locked;
+    if(stats_ns_expiring(ns, idle)) stats_ns_expire(ns);
+  }
+  return ok;
+}
+
+stats_snapshot_t *
+stats_recorder_snapshot_parallel(stats_recorder_t *rec, bool hist_since_last, int threads) {
+  uint64_t start = stats_nanos(), now;
+  struct stats_snapshot_work work, *wp = NULL;
+  bool ok;
+  int i, helpers;
+  stats_snapshot_t *snap = calloc(1, sizeof(*snap));
+  if(snap == NULL) return NULL;
+  snap->tail = &snap->head;
+  snap->nodes_tail = &snap->nodes;
+  snap->prom_tail = &snap->prom;
+  snap->hist_since_last = hist_since_last;
+  snap->hist_format = ck_pr_load_int((int *)&rec->hist_format);
+  if(threads > SNAPSHOT_MAX_THREADS) threads = SNAPSHOT_MAX_THREADS;
+  if(threads > 1) {
+    memset(&work, 0, sizeof(work));
+    work.snap = snap;
+    wp = &work;
+  }
+  ck_pr_inc_64(&rec->epoch);
+  stats_refresh_dispatch(rec);
+  stats_hist_rings_drain();
+  ok = stats_con_snapshot(rec->global, NULL, NULL, NULL, snap, NULL, 0, wp);
+  if(wp) {
+    if(ok) {
+      /* the calling thread is a worker too */
+      for(helpers=0;helpers+1<threads && (helpers+1)*SNAPSHOT_JOB_BATCH<work.njobs;helpers++);
+      stats_snapshot_pool_run(wp, helpers);
+    }
+    now = stats_nanos();
+    for(i=work.nheld-1;i>=0;i--) {
+      pthread_rwlock_unlock(&work.held[i].ns->lock);
+      if(now - work.held[i].locked > snap->lock_ns) snap->lock_ns = now - work.held[i].locked;
+    }
+    for(i=0;i<work.nheld;i++) {
+      if(stats_ns_expiring(work.held[i].ns, work.held[i].idle)) stats_ns_expire(work.held[i].ns);
+    }
+    ok = ok && !work.failed;
+    free(work.jobs);
+    free(work.held);
+  }
+  stats_snapshot_labels_done(snap);
+  if(!ok) {
+    stats_snapshot_free(snap);
+    return NULL;
+  }
+  snap->create_ns = stats_nanos() - start;
+  return snap;
+}
+stats_snapshot_t *
+stats_recorder_snapshot(stats_recorder_t *rec, bool hist_since_last) {
+  return stats_recorder_snapshot_parallel(rec, hist_since_last, 1);
+}
+
+void
+stats_snapshot_free(stats_snapshot_t *snap) {
+  struct stats_arena_block *b, *next;
+  if(snap == NULL) return;
+  for(b = snap->arena; b; b = next) {
+    next = b->next;
+    free(b);
+  }
+  free(snap);
+}
+
+int
+stats_snapshot_count(const stats_snapshot_t *snap) {
+  return snap->count;
+}
+uint64_t
+stats_snapshot_create_ns(const stats_snapshot_t *snap) {
+  return snap->create_ns;
+}
+uint64_t
+stats_snapshot_lock_ns(const stats_snapshot_t *snap) {
+  return snap->lock_ns;
 }
+
+/* Rebuilds a histogram from the snapshot's buckets in scratch space; the
+ * caller hands it back with stats_hist_scratch_done. */
+static histogram_t *
+stats_snapshot_hist(const struct stats_snapshot_metric *m) {
+  int i;
+  histogram_t *hist = stats_hist_scratch(m->nbuckets);
+  if(hist == NULL) return NULL;
+  for(i=0;i<m->nbuckets;i++) hist_insert_raw(hist, m->v.buckets[i].hb, m->v.buckets[i].cnt);
+  return hist;
+}
+
 static ssize_t
-stats_val_output_json(stats_handle_t *h, bool hist_since_last,
-                      ssize_t (*outf)(void *, const char *, size_t), void *cl) {
+stats_snapshot_val_output_json(const stats_snapshot_t *snap,
+                               const struct stats_snapshot_metric *m,
+                               stats_sink_t *sink) {
   ssize_t written = 0, rv, len;
-  int fpclass;
   char buff[64];
-  char string_copy[4096];
-
-  if(h->cb) {
-    h->cb(h, &h->valueptr, h->cb_closure);
-  }
+  int i;
 
-  if(h->valueptr == NULL ||
-     (h->type == STATS_TYPE_STRING && *((char **)h->valueptr) == NULL)) {
-    OUTF(cl, "null", 4, written);
+  if(m->isnull) {
+    OUTF(sink, "null", 4, written);
     return written;
   }
-  switch(h->type) {
+  switch(m->type) {
   case STATS_TYPE_STRING:
-    OUTF(cl,"\"",1,written);
-    pthread_mutex_lock(&h->mutex);
-    len = strlen(*(char **)h->valueptr);
-    if(len >= sizeof(string_copy)) len = sizeof(string_copy)-1;
-    memcpy(string_copy, *(char **)h->valueptr, len);
-    pthread_mutex_unlock(&h->mutex);
-    string_copy[len] = '\0';
-    rv = yajl_string_encode(outf, cl, string_copy, len);
+    OUTF(sink, "\"", 1, written);
+    rv = yajl_string_encode(sink, m->v.str, strlen(m->v.str));
     if(rv < 0) return -1;
     written += rv;
-    OUTF(cl,"\"",1,written);
-    break;
-  case STATS_TYPE_INT32:
-    len = snprintf(buff, sizeof(buff), "%d", *(int32_t *)h->valueptr);
-    OUTF(cl,buff,len,written);
-    break;
-  case STATS_TYPE_UINT32:
-    len = snprintf(buff, sizeof(buff), "%u", *(uint32_t *)h->valueptr);
-    OUTF(cl,buff,len,written);
-    break;
-  case STATS_TYPE_INT64:
-    len = snprintf(buff, sizeof(buff), "%" PRId64, *(int64_t *)h->valueptr);
-    OUTF(cl,buff,len,written);
-    break;
-  case STATS_TYPE_COUNTER:
-  {
-    int i;
-    uint64_t sum = 0;
-    for(i=0;i<h->fanout;i++)
-      sum += ck_pr_load_64(&h->fan[i].cpu.incr);
-    len = snprintf(buff, sizeof(buff), "%" PRIu64, sum);
-    OUTF(cl,buff,len,written);
-    break;
-  }
-  case STATS_TYPE_UINT64:
-    len = snprintf(buff, sizeof(buff), "%" PRIu64, *(uint64_t *)h->valueptr);
-    OUTF(cl,buff,len,written);
-    break;
-  case STATS_TYPE_DOUBLE:
-    fpclass = fpclassify(*(double *)h->valueptr);
-    if(fpclass == FP_INFINITE || fpclass == FP_NAN) {
-      OUTF(cl, "null", 4, written);
-    } else {
-      len = snprintf(buff, sizeof(buff), "%g", *(double *)h->valueptr);
-      OUTF(cl,buff,len,written);
-    }
+    OUTF(sink, "\"", 1, written);
     break;
   case STATS_TYPE_HISTOGRAM_FAST:
   case STATS_TYPE_HISTOGRAM:
-    {
-      int i;
-      bool needs_comma = false;
-      histogram_t *copy = hist_alloc_nbins(h->last_size * h->fanout); // upper bound
-      for(i=0;i<h->fanout;i++) {
-        const histogram_t * const * hptr = (const histogram_t * const *)&h->fan[i].cpu.hist;
-        pthread_mutex_lock(&h->fan[i].cpu.mutex);
-        hist_accumulate(copy, hptr, 1);
-        if(hist_since_last) {
-          hist_clear(h->fan[i].cpu.hist);
-        }
-        pthread_mutex_unlock(&h->fan[i].cpu.mutex);
-      }
-      if(hist_since_last) hist_accumulate(h->hist_aggr, (const histogram_t *const *)&copy, 1);
-      else hist_accumulate(copy, (const histogram_t *const *)&h->hist_aggr, 1);
-      OUTB(cl, "[", 1, written, bail);
-      h->last_size = hist_bucket_count(copy);
-      for(i=0;i<hist_bucket_count(copy);i++) {
-        uint64_t cnt;
-        double val;
-        if(hist_bucket_idx(copy, i, &val, &cnt)) {
-          len = snprintf(buff, sizeof(buff), "%s\"H[%0.2g]=%" PRIu64 "\"",
-                         needs_comma ? "," : "", val, cnt);
-          needs_comma = true;
-          OUTB(cl,buff,len,written,bail);
-        }
-      }
-      OUTB(cl, "]", 1, written,bail);
-    bail:
-      hist_free(copy);
+    if(snap->hist_format == STATS_HIST_FORMAT_B64) {
+      char b64buf[1024], *b64;
+      histogram_t *hist = stats_snapshot_hist(m);
+      if(hist == NULL) return -1;
+      len = stats_hist_b64(hist, b64buf, sizeof(b64buf), &b64);
+      stats_hist_scratch_done(hist);
+      if(len < 0) return -1;
+      OUTB(sink, "\"", 1, written, b64bail);
+      OUTB(sink, b64, len, written, b64bail);
+      OUTB(sink, "\"", 1, written, b64bail);
+      if(b64 != b64buf) free(b64);
+      break;
+    b64bail:
+      if(b64 != b64buf) free(b64);
+      return -1;
     }
+    OUTF(sink, "[", 1, written);
+    for(i=0;i<m->nbuckets;i++) {
+      len = stats_fmt_hist_elem(buff, m->v.buckets[i].hb, m->v.buckets[i].cnt, i > 0);
+      OUTF(sink, buff, len, written);
+    }
+    OUTF(sink, "]", 1, written);
+    break;
+  default:
+    rv = stats_scalar_output_json(m->type, &m->v, sink);
+    if(rv < 0) return -1;
+    written += rv;
     break;
   }
   return written;
 }
 
+ssize_t
+stats_snapshot_output_json_tagged_sink(const stats_snapshot_t *snap,
+                                       stats_sink_t *sink) {
+  ssize_t written = 0, rv;
+  const struct stats_snapshot_metric *m;
+  sink->failed = false;
+  OUTB(sink, "{", 1, written, bail);
+  for(m = snap->head; m; m = m->next) {
+    if(m != snap->head) OUTB(sink, ",", 1, written, bail);
+    OUTB(sink, "\"", 1, written, bail);
+    rv = yajl_string_encode(sink, m->name, strlen(m->name));
+    if(rv < 0) goto bail;
+    written += rv;
+    OUTB(sink, "\":{\"_type\":\"", 12, written, bail);
+    OUTB(sink, stats_type_code(m->type, snap->hist_since_last), 1, written, bail);
+    OUTB(sink, "\",\"_value\":", 11, written, bail);
+    rv = stats_snapshot_val_output_json(snap, m, sink);
+    if(rv < 0) goto bail;
+    written += rv;
+    OUTB(sink, "}", 1, written, bail);
+  }
+  OUTB(sink, "}", 1, written, bail);
+  if(!stats_sink_flush(sink)) return -1;
+  return written;
+ bail:
+  sink->used = 0; /* drop the partial document */
+  return -1;
+}
+ssize_t
+stats_snapshot_output_json_tagged(const stats_snapshot_t *snap,
+                                  ssize_t (*outf)(void *, const char *, size_t), void *cl) {
+  char buf[STATS_SINK_STACK_SIZE];
+  stats_sink_t sink;
+  stats_sink_init_outf(&sink, buf, sizeof(buf), outf, cl);
+  return stats_snapshot_output_json_tagged_sink(snap, &sink);
+}
+
+static bool
+stats_snapshot_node_hist(const struct stats_snapshot_node *node) {
+  return node->m && (node->m->type == STATS_TYPE_HISTOGRAM ||
+                     node->m->type == STATS_TYPE_HISTOGRAM_FAST);
+}
+
+/* Writes node (NULL for the global namespace) as stats_con_output_json
+ * would, consuming its descendants from *next. */
 static ssize_t
-stats_con_output_json(stats_ns_t *ns, stats_handle_t *h, bool hist_since_last,
-                      bool simple,
-                      ssize_t (*outf)(void *, const char *, size_t), void *cl) {
-  void *vc;
-  ssize_t written = 0, ns_written = 0;
-  ck_hs_iterator_t iterator = CK_HS_ITERATOR_INITIALIZER;
-  stats_ns_update(ns);
-  if(!simple) OUTF(cl, "{", 1, written);
-  if(ns) {
-    if(simple) OUTF(cl, "{", 1, written);
-    pthread_rwlock_rdlock(&ns->lock);
-    while(ck_hs_next(&ns->map, &iterator, &vc)) {
-      stats_container_t *c = vc;
-      if(!simple || c->ns != NULL ||
-         (c->handle->type != STATS_TYPE_HISTOGRAM &&
-          c->handle->type != STATS_TYPE_HISTOGRAM_FAST)) {
-        if(ns_written) {
-          OUTBLOCK(cl, ",", 1, written, { pthread_rwlock_unlock(&ns->lock); return -1; });
-        }
-        OUTBLOCK(cl, "\"", 1, written, { pthread_rwlock_unlock(&ns->lock); return -1; });
-        ns_written = yajl_string_encode(outf, cl, c->key, c->len);
-        if(ns_written < 0) {
-          pthread_rwlock_unlock(&ns->lock);
-          return -1;
-        }
-        written += ns_written;
-        OUTBLOCK(cl, "\":", 2, written, { pthread_rwlock_unlock(&ns->lock); return -1; });
-        ns_written = stats_con_output_json(c->ns, c->handle, hist_since_last, simple, outf, cl);
-        if(ns_written < 0) {
-          pthread_rwlock_unlock(&ns->lock);
-          return -1;
-        }
-        written += ns_written;
-      }
+stats_snapshot_node_output_json(const stats_snapshot_t *snap, const struct stats_snapshot_node *node,
+                                const struct stats_snapshot_node **next, bool simple,
+                                stats_sink_t *sink) {
+  ssize_t written = 0, rv;
+  bool isns = node == NULL || node->ns, any = false;
+  int depth = node ? node->depth : 0;
+
+  if(!simple) OUTF(sink, "{", 1, written);
+  if(isns) {
+    if(simple) OUTF(sink, "{", 1, written);
+    while(*next && (*next)->depth > depth) {
+      const struct stats_snapshot_node *c = *next;
+      *next = c->next;
+      if(simple && !c->ns && stats_snapshot_node_hist(c)) continue;
+      if(any) OUTF(sink, ",", 1, written);
+      OUTF(sink, "\"", 1, written);
+      if((rv = yajl_string_encode(sink, c->key, c->keylen)) < 0) return -1;
+      written += rv;
+      OUTF(sink, "\":", 2, written);
+      if((rv = stats_snapshot_node_output_json(snap, c, next, simple, sink)) < 0) return -1;
+      written += rv;
+      any = true;
     }
-    pthread_rwlock_unlock(&ns->lock);
-    if(simple) OUTF(cl, "}", 1, written);
+    if(simple) OUTF(sink, "}", 1, written);
+  }
+  if(node && node->sv && (!isns || !simple)) {
+    if(any) OUTF(sink, ",", 1, written);
+    if(simple) OUTF(sink, "{", 1, written);
+    if((rv = stats_summary_value_output_json(node->sv, simple, sink)) < 0) return -1;
+    written += rv;
+    if(simple) OUTF(sink, "}", 1, written);
   }
-  if(h && (!ns || !simple)) {
+  else if(node && node->m && (!isns || !simple)) {
     if(!simple) {
-      if(ns_written) OUTF(cl, ",", 1, written);
-      OUTF(cl, "\"_type\":\"", 9, written);
-      switch(h->type) {
-        case STATS_TYPE_STRING: OUTF(cl, "s", 1, written); break;
-        case STATS_TYPE_INT32: OUTF(cl, "i", 1, written); break;
-        case STATS_TYPE_UINT32: OUTF(cl, "I", 1, written); break;
-        case STATS_TYPE_INT64: OUTF(cl, "l", 1, written); break;
-        case STATS_TYPE_COUNTER:
-        case STATS_TYPE_UINT64: OUTF(cl, "L", 1, written); break;
-        case STATS_TYPE_DOUBLE: OUTF(cl, "n", 1, written); break;
-        case STATS_TYPE_HISTOGRAM_FAST:
-        case STATS_TYPE_HISTOGRAM: OUTF(cl, hist_since_last ? "h" : "H", 1, written); break;
-      }
-      OUTF(cl, "\",\"_value\":", 11, written);
+      if(any) OUTF(sink, ",", 1, written);
+      OUTF(sink, "\"_type\":\"", 9, written);
+      OUTF(sink, stats_type_code(node->m->type, snap->hist_since_last), 1, written);
+      OUTF(sink, "\",\"_value\":", 11, written);
     }
-    if(!simple || (h->type != STATS_TYPE_HISTOGRAM &&
-                   h->type != STATS_TYPE_HISTOGRAM_FAST)) {
-      ssize_t rv = stats_val_output_json(h, hist_since_last, outf, cl);
-      if(rv < 0) return -1;
+    if(!simple || !stats_snapshot_node_hist(node)) {
+      if((rv = stats_snapshot_val_output_json(snap, node->m, sink)) < 0) return -1;
       written += rv;
     }
   }
-  if(!simple) OUTF(cl, "}", 1, written);
+  if(!simple) OUTF(sink, "}", 1, written);
   return written;
 }
+
 ssize_t
-stats_recorder_output_json(stats_recorder_t *rec,
-                           bool hist_since_last, bool simple,
+stats_snapshot_output_json_sink(const stats_snapshot_t *snap, bool simple,
+                                stats_sink_t *sink) {
+  const struct stats_snapshot_node *next = snap->nodes;
+  ssize_t written;
+  sink->failed = false;
+  written = stats_snapshot_node_output_json(snap, NULL, &next, simple, sink);
+  if(written < 0) {
+    sink->used = 0; /* drop the partial document */
+    return -1;
+  }
+  if(!stats_sink_flush(sink)) return -1;
+  return written;
+}
+ssize_t
+stats_snapshot_output_json(const stats_snapshot_t *snap, bool simple,
                            ssize_t (*outf)(void *, const char *, size_t), void *cl) {
-  return stats_con_output_json(rec->global, NULL, hist_since_last, simple, outf, cl);
+  char buf[STATS_SINK_STACK_SIZE];
+  stats_sink_t sink;
+  stats_sink_init_outf(&sink, buf, sizeof(buf), outf, cl);
+  return stats_snapshot_output_json_sink(snap, simple, &sink);
+}
+
+int
+stats_snapshot_capture(const stats_snapshot_t *snap, stats_capture_f cb, void *cl) {
+  const struct stats_snapshot_metric *m;
+  int cnt = 0;
+  for(m = snap->head; m; m = m->next) {
+    switch(m->type) {
+    case STATS_TYPE_STRING:
+      if(cb(cl, m->name, m->type, (void *)m->v.str)) cnt++;
+      break;
+    case STATS_TYPE_HISTOGRAM_FAST:
+    case STATS_TYPE_HISTOGRAM:
+    {
+      histogram_t *hist = stats_snapshot_hist(m);
+      if(hist == NULL) break;
+      if(snap->hist_format == STATS_HIST_FORMAT_B64) {
+        char b64buf[1024], *b64;
+        if(stats_hist_b64(hist, b64buf, sizeof(b64buf), &b64) >= 0) {
+          if(cb(cl, m->name, STATS_TYPE_STRING, b64)) cnt++;
+          if(b64 != b64buf) free(b64);
+        }
+      }
+      else if(cb(cl, m->name, STATS_TYPE_HISTOGRAM, hist)) cnt++;
+      stats_hist_scratch_done(hist);
+      break;
+    }
+    default:
+    {
+      /* a copy, so callbacks cannot write into the snapshot */
+      uint64_t v = m->v.u64;
+      stats_type_t type = m->type == STATS_TYPE_COUNTER ? STATS_TYPE_UINT64 : m->type;
+      if(cb(cl, m->name, type, m->isnull ? NULL : &v)) cnt++;
+      break;
+    }
+    }
+  }
+  return cnt;
 }
 
+/* Prometheus text exposition.  All series of a family must be written
+ * together, yet one name may be registered in several namespaces, so the
+ * snapshot keeps a series per handle with its labels already rendered;
+ * an entry is made per family member, the entries are sorted by family
+ * and only then written out.
+ */
+#define PROM_VALUE -1   /* the handle's own value */
+#define PROM_SUMMARY 0  /* _sum and _count of a summary; >0 is a component gauge */
+struct stats_prom_entry {
+  const struct stats_snapshot_prom *p;
+  const char     *family;
+  size_t          family_off;
+  uint32_t        family_len;
+  uint32_t        seq;
+  int             component;
+};
+struct stats_prom_walk {
+  struct stats_prom_entry *ent;
+  size_t                   nent, alloc;
+  char                    *str;
+  size_t                   used, size;
+  bool                     failed;
+};
 
 static void
-merge_tags(ck_hs_t *tgt, ck_hs_t *src) {
-  ck_hs_iterator_t iterator = CK_HS_ITERATOR_INITIALIZER;
-  void *vname;
-  while(ck_hs_next(src, &iterator, &vname)) {
-    char *name = vname;
-    unsigned long hashv = CK_HS_HASH(tgt, hs_taghash, name);
-    ck_hs_put(tgt, hashv, name);
+stats_prom_put(struct stats_prom_walk *w, const char *data, size_t len) {
+  if(w->used + len > w->size) {
+    size_t size = w->size ? w->size : 4096;
+    char *grown;
+    while(size < w->used + len) size *= 2;
+    if(w->failed || (grown = realloc(w->str, size)) == NULL) {
+      w->failed = true;
+      return;
+    }
+    w->str = grown;
+    w->size = size;
   }
+  memcpy(w->str + w->used, data, len);
+  w->used += len;
 }
-static int
-charptrptrcmp(const void *a, const void *b) {
-  return strcmp(*(char **)a, *(char **)b);
+
+/* Metric names are [a-zA-Z_:][a-zA-Z0-9_:]*, label names the same less ':' */
+static void
+stats_prom_put_name(struct stats_prom_walk *w, const char *name, size_t len, bool label) {
+  size_t i;
+  if(len == 0 || (name[0] >= '0' && name[0] <= '9')) stats_prom_put(w, "_", 1);
+  for(i=0;i<len;i++) {
+    char c = name[i];
+    if(!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+         (c >= '0' && c <= '9') || c == '_' || (c == ':' && !label))) c = '_';
+    stats_prom_put(w, &c, 1);
+  }
 }
-static size_t personal_strlcat(char *dst, const char *src, size_t size) {
-  int dl = strlen(dst);
-  int sz = size-dl-1;
-  if(sz >= 0) {
-    strncat(dst, src, sz);
-    dst[dl+sz] = '\0';
+
+static void
+stats_prom_put_label_value(struct stats_prom_walk *w, const char *val, size_t len) {
+  size_t i, run = 0;
+  for(i=0;i<len;i++) {
+    const char *esc = NULL;
+    if(val[i] == '\\') esc = "\\\\";
+    else if(val[i] == '"') esc = "\\\"";
+    else if(val[i] == '\n') esc = "\\n";
+    if(esc) {
+      stats_prom_put(w, val + run, i - run);
+      stats_prom_put(w, esc, 2);
+      run = i + 1;
+    }
   }
-  return dl+strlen(src);
+  stats_prom_put(w, val + run, len - run);
 }
+
+/* Tags become labels.  A label name may appear only once per series, so
+ * when a category is inherited with several values the innermost wins. */
 static void
-make_metric_name(char *out, size_t len, const char *name, ck_hs_t *stags) {
-  int i = 0;
-  void *vname = NULL;
-  int ntags = ck_hs_count(stags);
-  char *tags[MAX_TAGS];
-  if(ntags > MAX_TAGS) ntags = MAX_TAGS;
-  ck_hs_iterator_t iterator = CK_HS_ITERATOR_INITIALIZER;
-  while(i < ntags && ck_hs_next(stags, &iterator, &vname)) {
-    if(vname) tags[i++] = vname;
+stats_prom_put_labels(struct stats_prom_walk *w, const stats_tagset_t *htags,
+                      const struct stats_tag_frame *frame) {
+  int i, j, ntags, nkeep = 0;
+  stats_tag_t *tags[MAX_TAGS];
+  ntags = collect_tags(tags, 0, htags);
+  for(;frame;frame=frame->up) {
+    if(frame->tags) ntags = collect_tags(tags, ntags, frame->tags);
   }
-  assert(ntags == i);
-  qsort(tags, ntags, sizeof(char *), charptrptrcmp);
-  snprintf(out, len, "%s|ST[", name);
   for(i=0;i<ntags;i++) {
-    char tag[NOIT_TAG_MAX_PAIR_LEN+1];
-    lcm_noit_metric_tagset_encode_tag(tag, sizeof(tag), tags[i], strlen(tags[i]));
-    if(i>0) personal_strlcat(out,",",len);
-    personal_strlcat(out,tag,len);
+    for(j=0;j<nkeep;j++) {
+      if(tags[j]->catlen == tags[i]->catlen &&
+         !memcmp(tags[j]->pair, tags[i]->pair, tags[i]->catlen)) break;
+    }
+    if(j == nkeep) tags[nkeep++] = tags[i];
   }
-  personal_strlcat(out,"]",len);
+  qsort(tags, nkeep, sizeof(*tags), tagptrcmp);
+  for(i=0;i<nkeep;i++) {
+    if(i) stats_prom_put(w, ",", 1);
+    stats_prom_put_name(w, tags[i]->pair, tags[i]->catlen, true);
+    stats_prom_put(w, "=\"", 2);
+    stats_prom_put_label_value(w, tags[i]->pair + tags[i]->catlen + 1,
+                               tags[i]->len - tags[i]->catlen - 1);
+    stats_prom_put(w, "\"", 1);
+  }
+}
+
+/* Records h's series in the snapshot; its labels are rendered into the
+ * snapshot's scratch buffer and then copied into the arena. */
+static bool
+stats_snapshot_prom_add(stats_snapshot_t *snap, stats_handle_t *h, const char *key,
+                        const struct stats_tag_frame *frame,
+                        const struct stats_snapshot_metric *m) {
+  struct stats_prom_walk *w = snap->labels;
+  struct stats_snapshot_prom *p;
+  const char *name;
+  if(w == NULL && (w = snap->labels = calloc(1, sizeof(*w))) == NULL) return false;
+  if((p = stats_arena_alloc(&snap->arena, sizeof(*p))) == NULL) return false;
+  w->used = 0;
+  pthread_mutex_lock(stats_handle_meta_lock(h));
+  name = h->cold && h->cold->tagged_name ? h->cold->tagged_name : key;
+  p->name = stats_arena_strndup(&snap->arena, name, strlen(name));
+  stats_prom_put_labels(w, stats_handle_tags(h), frame);
+  pthread_mutex_unlock(stats_handle_meta_lock(h));
+  if(p->name == NULL || w->failed) return false;
+  if((p->labels = stats_arena_strndup(&snap->arena, w->str ? w->str : "", w->used)) == NULL)
+    return false;
+  p->labels_len = w->used;
+  p->type = h->type;
+  p->m = m;
+  p->next = NULL;
+  *snap->prom_tail = p;
+  snap->prom_tail = &p->next;
+  return true;
+}
+
+static void
+stats_snapshot_labels_done(stats_snapshot_t *snap) {
+  if(snap->labels == NULL) return;
+  free(snap->labels->str);
+  free(snap->labels);
+  snap->labels = NULL;
+}
+
+static void
+stats_prom_add(struct stats_prom_walk *w, const struct stats_snapshot_prom *p, int component) {
+  struct stats_prom_entry *e;
+  if(w->nent == w->alloc) {
+    size_t alloc = w->alloc ? w->alloc * 2 : 64;
+    struct stats_prom_entry *grown = realloc(w->ent, alloc * sizeof(*grown));
+    if(grown == NULL) {
+      w->failed = true;
+      return;
+    }
+    w->ent = grown;
+    w->alloc = alloc;
+  }
+  e = &w->ent[w->nent];
+  e->p = p;
+  e->component = component;
+  e->seq = w->nent++;
+  e->family_off = w->used;
+  stats_prom_put_name(w, p->name, strlen(p->name), false);
+  if(component > 0) {
+    stats_prom_put(w, "_", 1);
+    stats_prom_put(w, stats_summary_component_names[component],
+                   strlen(stats_summary_component_names[component]));
+  }
+  e->family_len = w->used - e->family_off;
+}
+
+static int
+stats_prom_entcmp(const void *a, const void *b) {
+  const struct stats_prom_entry *ea = a, *eb = b;
+  size_t len = ea->family_len < eb->family_len ? ea->family_len : eb->family_len;
+  int rv = memcmp(ea->family, eb->family, len);
+  if(rv) return rv;
+  if(ea->family_len != eb->family_len) return ea->family_len < eb->family_len ? -1 : 1;
+  return ea->seq < eb->seq ? -1 : 1;
+}
+
+static const char *
+stats_prom_type(const struct stats_prom_entry *e) {
+  if(e->component > 0) return "gauge";
+  if(e->component == PROM_SUMMARY) return "summary";
+  switch(e->p->type) {
+  case STATS_TYPE_COUNTER: return "counter";
+  case STATS_TYPE_HISTOGRAM:
+  case STATS_TYPE_HISTOGRAM_FAST: return "histogram";
+  default: break;
+  }
+  return "gauge";
+}
+
+static size_t
+stats_prom_fmt_double(char *out, double d) {
+  if(isnan(d)) {
+    memcpy(out, "NaN", 3);
+    return 3;
+  }
+  if(isinf(d)) {
+    memcpy(out, d < 0 ? "-Inf" : "+Inf", 4);
+    return 4;
+  }
+  return stats_fmt_double(out, d);
+}
+
+/* The upper bound of a bucket: buckets cover [lower, lower + width) away
+ * from zero, so a negative bucket's upper bound is its own value. */
+static size_t
+stats_prom_fmt_le(char *out, hist_bucket_t hb) {
+  if(hb.val > 0 && hb.val < 99) hb.val++;
+  else if(hb.val == 99 && hb.exp < 127) {
+    hb.val = 10;
+    hb.exp++;
+  }
+  else if(hb.val > 0) {
+    return stats_prom_fmt_double(out, hist_bucket_to_double(hb) +
+                                      hist_bucket_to_double_bin_width(hb));
+  }
+  return stats_fmt_hist_bucket(out, hb);
 }
 
 static ssize_t
-stats_con_output_json_tagged(stats_ns_t *ns, stats_handle_t *h, const char *name, bool hist_since_last,
-                      bool top_level, bool *started, ck_hs_t *itags,
-                      ssize_t (*outf)(void *, const char *, size_t), void *cl) {
-  void *vc;
-  ssize_t written = 0, ns_written = 0;
-  ck_hs_t tmpmap;
-  if(ck_hs_init(&tmpmap, CK_HS_MODE_OBJECT|CK_HS_MODE_SPMC,
-                hs_taghash, hs_tagcompare, &hs_allocator, 10, lrand48()) == 0) {
-    return 0;
+stats_prom_sample(const struct stats_prom_entry *e, const char *suffix,
+                  const char *le, size_t le_len, const char *value, size_t len,
+                  stats_sink_t *sink) {
+  ssize_t written = 0;
+  size_t labels_len = e->p->labels_len;
+  OUTF(sink, e->family, e->family_len, written);
+  if(suffix) OUTF(sink, suffix, strlen(suffix), written);
+  if(labels_len || le) {
+    OUTF(sink, "{", 1, written);
+    OUTF(sink, e->p->labels, labels_len, written);
+    if(le) {
+      if(labels_len) OUTF(sink, ",", 1, written);
+      OUTF(sink, "le=\"", 4, written);
+      OUTF(sink, le, le_len, written);
+      OUTF(sink, "\"", 1, written);
+    }
+    OUTF(sink, "}", 1, written);
   }
-  if(itags) merge_tags(&tmpmap, itags);
-  ck_hs_iterator_t iterator = CK_HS_ITERATOR_INITIALIZER;
-  stats_ns_update(ns);
-  if(top_level) OUTF(cl, "{", 1, written);
-  if(ns) {
-    merge_tags(&tmpmap, &ns->tags);
-    pthread_rwlock_rdlock(&ns->lock);
-    while(ck_hs_next(&ns->map, &iterator, &vc)) {
-      stats_container_t *c = vc;
-      ns_written = stats_con_output_json_tagged(c->ns, c->handle, c->key, hist_since_last, false, started, &tmpmap, outf, cl);
-      if(ns_written < 0) {
-        pthread_rwlock_unlock(&ns->lock);
-        return -1;
-      }
-      written += ns_written;
+  OUTF(sink, " ", 1, written);
+  OUTF(sink, value, len, written);
+  OUTF(sink, "\n", 1, written);
+  return written;
+}
+
+static ssize_t
+stats_prom_output_hist(const struct stats_prom_entry *e, stats_sink_t *sink) {
+  const struct stats_snapshot_metric *m = e->p->m;
+  ssize_t written = 0, rv;
+  histogram_t *copy;
+  char le[STATS_NUMFMT_MAX], buff[STATS_NUMFMT_MAX];
+  uint64_t cumulative = 0, total = 0;
+  int i;
+
+  for(i=0;i<m->nbuckets;i++) {
+    hist_bucket_t hb = m->v.buckets[i].hb;
+    total += m->v.buckets[i].cnt;
+    /* NaN buckets only show up under +Inf */
+    if(hb.val > 99 || hb.val < -99 || (hb.val > -10 && hb.val < 10 && hb.val != 0)) continue;
+    cumulative += m->v.buckets[i].cnt;
+    rv = stats_prom_sample(e, "_bucket", le, stats_prom_fmt_le(le, hb),
+                           buff, stats_fmt_u64(buff, cumulative), sink);
+    if(rv < 0) return -1;
+    written += rv;
+  }
+  rv = stats_prom_sample(e, "_bucket", "+Inf", 4, buff, stats_fmt_u64(buff, total), sink);
+  if(rv < 0) return -1;
+  written += rv;
+  if((copy = stats_snapshot_hist(m)) == NULL) return -1;
+  rv = stats_prom_sample(e, "_sum", NULL, 0,
+                         buff, stats_prom_fmt_double(buff, hist_approx_sum(copy)), sink);
+  stats_hist_scratch_done(copy);
+  if(rv < 0) return -1;
+  written += rv;
+  rv = stats_prom_sample(e, "_count", NULL, 0, buff, stats_fmt_u64(buff, total), sink);
+  if(rv < 0) return -1;
+  return written + rv;
+}
+
+static ssize_t
+stats_prom_output_entry(const struct stats_prom_entry *e, stats_sink_t *sink) {
+  const struct stats_snapshot_metric *m = e->p->m;
+  char buff[STATS_NUMFMT_MAX];
+  size_t len;
+  ssize_t rv, written = 0;
+
+  if(e->component >= 0) {
+    /* the components follow each other: count, sum, min, max, mean */
+    int i;
+    if(e->component == PROM_SUMMARY) {
+      rv = stats_prom_sample(e, "_sum", NULL, 0, buff, stats_prom_fmt_double(buff, m->next->v.d), sink);
+      if(rv < 0) return -1;
+      written += rv;
+      rv = stats_prom_sample(e, "_count", NULL, 0, buff, stats_fmt_u64(buff, m->v.u64), sink);
+      if(rv < 0) return -1;
+      return written + rv;
     }
-    pthread_rwlock_unlock(&ns->lock);
+    for(i=0;i<e->component;i++) m = m->next;
+    len = stats_prom_fmt_double(buff, m->isnull ? NAN : m->v.d);
+    return stats_prom_sample(e, NULL, NULL, 0, buff, len, sink);
   }
-  if(h && !h->tagged_suppress) {
-    merge_tags(&tmpmap, &h->tags);
-    if(*started) {
-      OUTF(cl, ",", 1, written);
+
+  switch(m->type) {
+  case STATS_TYPE_HISTOGRAM:
+  case STATS_TYPE_HISTOGRAM_FAST:
+    return stats_prom_output_hist(e, sink);
+  case STATS_TYPE_COUNTER:
+    len = stats_fmt_u64(buff, m->v.u64);
+    break;
+  default:
+    if(m->isnull) return 0;
+    switch(m->type) {
+    case STATS_TYPE_INT32: len = stats_fmt_i64(buff, m->v.i32); break;
+    case STATS_TYPE_UINT32: len = stats_fmt_u64(buff, m->v.u32); break;
+    case STATS_TYPE_INT64: len = stats_fmt_i64(buff, m->v.i64); break;
+    case STATS_TYPE_UINT64: len = stats_fmt_u64(buff, m->v.u64); break;
+    case STATS_TYPE_DOUBLE: len = stats_prom_fmt_double(buff, m->v.d); break;
+    default: return 0;
     }
-    *started = true;
-    OUTF(cl, "\"", 1, written);
-    char metric_name[MAX_METRIC_TAGGED_NAME];
-    make_metric_name(metric_name, sizeof(metric_name), h->tagged_name ? h->tagged_name : name, &tmpmap);
-    ns_written = yajl_string_encode(outf, cl, metric_name, strlen(metric_name));
-    if(ns_written < 0) {
-      return -1;
+  }
+  return stats_prom_sample(e, NULL, NULL, 0, buff, len, sink);
+}
+
+ssize_t
+stats_snapshot_output_prometheus_sink(const stats_snapshot_t *snap, stats_sink_t *sink) {
+  struct stats_prom_walk w = { 0 };
+  const struct stats_snapshot_prom *p;
+  const char *type = NULL;
+  ssize_t written = 0, rv;
+  size_t i;
+
+  sink->failed = false;
+  for(p = snap->prom; p; p = p->next) {
+    if(p->type == STATS_TYPE_SUMMARY) {
+      int c;
+      stats_prom_add(&w, p, PROM_SUMMARY);
+      for(c=2;c<SUMMARY_NCOMPONENTS;c++) stats_prom_add(&w, p, c);
     }
-    written += ns_written;
-    OUTF(cl, "\":{", 3, written);
-    OUTF(cl, "\"_type\":\"", 9, written);
-    switch(h->type) {
-      case STATS_TYPE_STRING: OUTF(cl, "s", 1, written); break;
-      case STATS_TYPE_INT32: OUTF(cl, "i", 1, written); break;
-      case STATS_TYPE_UINT32: OUTF(cl, "I", 1, written); break;
-      case STATS_TYPE_INT64: OUTF(cl, "l", 1, written); break;
-      case STATS_TYPE_COUNTER:
-      case STATS_TYPE_UINT64: OUTF(cl, "L", 1, written); break;
-      case STATS_TYPE_DOUBLE: OUTF(cl, "n", 1, written); break;
-      case STATS_TYPE_HISTOGRAM_FAST:
-      case STATS_TYPE_HISTOGRAM: OUTF(cl, hist_since_last ? "h" : "H", 1, written); break;
-    }
-    OUTF(cl, "\",\"_value\":", 11, written);
-    ssize_t rv = stats_val_output_json(h, hist_since_last, outf, cl);
-    if(rv < 0) return -1;
+    else stats_prom_add(&w, p, PROM_VALUE);
+  }
+  if(w.failed) goto bail;
+  for(i=0;i<w.nent;i++) w.ent[i].family = w.str + w.ent[i].family_off;
+  qsort(w.ent, w.nent, sizeof(*w.ent), stats_prom_entcmp);
+  for(i=0;i<w.nent;i++) {
+    const struct stats_prom_entry *e = &w.ent[i];
+    if(i == 0 || e->family_len != e[-1].family_len ||
+       memcmp(e->family, e[-1].family, e->family_len)) {
+      type = stats_prom_type(e);
+      OUTBLOCK(sink, "# TYPE ", 7, written, { goto bail; });
+      OUTBLOCK(sink, e->family, e->family_len, written, { goto bail; });
+      OUTBLOCK(sink, " ", 1, written, { goto bail; });
+      OUTBLOCK(sink, type, strlen(type), written, { goto bail; });
+      OUTBLOCK(sink, "\n", 1, written, { goto bail; });
+    }
+    /* a family has a single type; clashing registrations are left out */
+    else if(strcmp(type, stats_prom_type(e))) continue;
+    rv = stats_prom_output_entry(e, sink);
+    if(rv < 0) goto bail;
     written += rv;
-    OUTF(cl, "}", 1, written);
   }
-  if(top_level) OUTF(cl, "}", 1, written);
-  ck_hs_destroy(&tmpmap);
+  free(w.ent);
+  free(w.str);
+  if(!stats_sink_flush(sink)) return -1;
   return written;
+ bail:
+  free(w.ent);
+  free(w.str);
+  sink->used = 0; /* drop the partial document */
+  return -1;
 }
+
 ssize_t
-stats_recorder_output_json_tagged(stats_recorder_t *rec,
-                           bool hist_since_last,
-                           ssize_t (*outf)(void *, const char *, size_t), void *cl) {
-  bool started = false;
-  return stats_con_output_json_tagged(rec->global, NULL, NULL, hist_since_last, true, &started, NULL, outf, cl);
+stats_snapshot_output_prometheus(const stats_snapshot_t *snap,
+                                 ssize_t (*outf)(void *, const char *, size_t), void *cl) {
+  char buf[STATS_SINK_STACK_SIZE];
+  stats_sink_t sink;
+  stats_sink_init_outf(&sink, buf, sizeof(buf), outf, cl);
+  return stats_snapshot_output_prometheus_sink(snap, &sink);
 }
 
-static int
-stats_con_capture(stats_ns_t *ns, stats_handle_t *h, const char *name, bool hist_since_last,
-                  ck_hs_t *itags, stats_capture_f cb, void *cl) {
-  int cnt = 0;
-  void *vc;
-  ck_hs_t tmpmap;
-  if(ck_hs_init(&tmpmap, CK_HS_MODE_OBJECT|CK_HS_MODE_SPMC,
-                hs_taghash, hs_tagcompare, &hs_allocator, 10, lrand48()) == 0) {
-    return 0;
-  }
-  if(itags) merge_tags(&tmpmap, itags);
-  ck_hs_iterator_t iterator = CK_HS_ITERATOR_INITIALIZER;
-  stats_ns_update(ns);
-  if(ns) {
-    merge_tags(&tmpmap, &ns->tags);
-    pthread_rwlock_rdlock(&ns->lock);
-    while(ck_hs_next(&ns->map, &iterator, &vc)) {
-      stats_container_t *c = vc;
-      cnt += stats_con_capture(c->ns, c->handle, c->key, hist_since_last, &tmpmap, cb, cl);
-    }
-    pthread_rwlock_unlock(&ns->lock);
-  }
-  if(h && !h->tagged_suppress) {
-    merge_tags(&tmpmap, &h->tags);
-    char metric_name[MAX_METRIC_TAGGED_NAME];
-    make_metric_name(metric_name, sizeof(metric_name), h->tagged_name ? h->tagged_name : name, &tmpmap);
-    if(stats_handle_capture(metric_name, h, hist_since_last, cb, cl)) {
-      cnt++;
-    }
+/* Histograms are exported cumulatively, as Prometheus expects. */
+ssize_t
+stats_recorder_output_prometheus_sink(stats_recorder_t *rec, stats_sink_t *sink) {
+  ssize_t rv;
+  stats_snapshot_t *snap = stats_recorder_snapshot(rec, false);
+  if(snap == NULL) {
+    sink->used = 0;
+    return -1;
   }
-  ck_hs_destroy(&tmpmap);
-  return cnt;
+  rv = stats_snapshot_output_prometheus_sink(snap, sink);
+  stats_snapshot_free(snap);
+  return rv;
 }
 
-int
-stats_recorder_capture(stats_recorder_t *rec, bool hist_since_last,
-                       stats_capture_f cb, void *cl) {
-  return stats_con_capture(rec->global, NULL, NULL, hist_since_last, NULL, cb, cl);
+ssize_t
+stats_recorder_output_prometheus(stats_recorder_t *rec,
+                                 ssize_t (*outf)(void *, const char *, size_t), void *cl) {
+  char buf[STATS_SINK_STACK_SIZE];
+  stats_sink_t sink;
+  stats_sink_init_outf(&sink, buf, sizeof(buf), outf, cl);
+  return stats_recorder_output_prometheus_sink(rec, &sink);
 }
@@ -0,0 +1,342 @@
+#ifndef STATS_NUMFMT_H
+#define STATS_NUMFMT_H
+
+/* Number formatting for the exporters.
+ *
+ * Integers are written two digits at a time from a lookup table.  Doubles
+ * are written with Grisu2 (Loitsch, "Printing Floating-Point Numbers Quickly
+ * and Accurately with Integers", PLDI 2010), as popularized by RapidJSON,
+ * whose output always reads back (strtod) as the identical double.  Like
+ * Grisu3, digit generation also notes when the imprecision it allows for
+ * might hide a shorter string; for those few doubles the shortest is found
+ * with snprintf and strtod instead, so the output is always the shortest.
+ * Callers must keep NaN and infinities away, JSON has no spelling for them.
+ *
+ * Every function writes at most STATS_NUMFMT_MAX bytes, does not terminate
+ * the string and returns the number of bytes written.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define STATS_NUMFMT_MAX 32
+
+static const char stats_numfmt_digits2[201] =
+  "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+  "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+  "8081828384858687888990919293949596979899";
+
+static inline size_t
+stats_fmt_u64(char *out, uint64_t v) {
+  char tmp[20], *p = tmp + sizeof(tmp);
+  size_t len;
+  while(v >= 100) {
+    unsigned int i = (unsigned int)(v % 100) * 2;
+    v /= 100;
+    p -= 2;
+    memcpy(p, stats_numfmt_digits2 + i, 2);
+  }
+  if(v >= 10) {
+    p -= 2;
+    memcpy(p, stats_numfmt_digits2 + v * 2, 2);
+  }
+  else *--p = '0' + (char)v;
+  len = tmp + sizeof(tmp) - p;
+  memcpy(out, p, len);
+  return len;
+}
+
+static inline size_t
+stats_fmt_i64(char *out, int64_t v) {
+  if(v < 0) {
+    *out = '-';
+    return 1 + stats_fmt_u64(out + 1, (uint64_t)0 - (uint64_t)v);
+  }
+  return stats_fmt_u64(out, (uint64_t)v);
+}
+
+/* Grisu2 */
+
+typedef struct {
+  uint64_t f;
+  int      e;
+} stats_diyfp_t;
+
+#define STATS_DP_HIDDEN_BIT 0x0010000000000000ULL
+#define STATS_DP_SIGNIFICAND_MASK 0x000FFFFFFFFFFFFFULL
+
+/* 10^k for k = -348, -340, ..., 340 as normalized 64-bit significands */
+static const uint64_t stats_numfmt_pow10_f[] = {
+  0xfa8fd5a0081c0288ULL, 0xbaaee17fa23ebf76ULL, 0x8b16fb203055ac76ULL,
+  0xcf42894a5dce35eaULL, 0x9a6bb0aa55653b2dULL, 0xe61acf033d1a45dfULL,
+  0xab70fe17c79ac6caULL, 0xff77b1fcbebcdc4fULL, 0xbe5691ef416bd60cULL,
+  0x8dd01fad907ffc3cULL, 0xd3515c2831559a83ULL, 0x9d71ac8fada6c9b5ULL,
+  0xea9c227723ee8bcbULL, 0xaecc49914078536dULL, 0x823c12795db6ce57ULL,
+  0xc21094364dfb5637ULL, 0x9096ea6f3848984fULL, 0xd77485cb25823ac7ULL,
+  0xa086cfcd97bf97f4ULL, 0xef340a98172aace5ULL, 0xb23867fb2a35b28eULL,
+  0x84c8d4dfd2c63f3bULL, 0xc5dd44271ad3cdbaULL, 0x936b9fcebb25c996ULL,
+  0xdbac6c247d62a584ULL, 0xa3ab66580d5fdaf6ULL, 0xf3e2f893dec3f126ULL,
+  0xb5b5ada8aaff80b8ULL, 0x87625f056c7c4a8bULL, 0xc9bcff6034c13053ULL,
+  0x964e858c91ba2655ULL, 0xdff9772470297ebdULL, 0xa6dfbd9fb8e5b88fULL,
+  0xf8a95fcf88747d94ULL, 0xb94470938fa89bcfULL, 0x8a08f0f8bf0f156bULL,
+  0xcdb02555653131b6ULL, 0x993fe2c6d07b7facULL, 0xe45c10c42a2b3b06ULL,
+  0xaa242499697392d3ULL, 0xfd87b5f28300ca0eULL, 0xbce5086492111aebULL,
+  0x8cbccc096f5088ccULL, 0xd1b71758e219652cULL, 0x9c40000000000000ULL,
+  0xe8d4a51000000000ULL, 0xad78ebc5ac620000ULL, 0x813f3978f8940984ULL,
+  0xc097ce7bc90715b3ULL, 0x8f7e32ce7bea5c70ULL, 0xd5d238a4abe98068ULL,
+  0x9f4f2726179a2245ULL, 0xed63a231d4c4fb27ULL, 0xb0de65388cc8ada8ULL,
+  0x83c7088e1aab65dbULL, 0xc45d1df942711d9aULL, 0x924d692ca61be758ULL,
+  0xda01ee641a708deaULL, 0xa26da3999aef774aULL, 0xf209787bb47d6b85ULL,
+  0xb454e4a179dd1877ULL, 0x865b86925b9bc5c2ULL, 0xc83553c5c8965d3dULL,
+  0x952ab45cfa97a0b3ULL, 0xde469fbd99a05fe3ULL, 0xa59bc234db398c25ULL,
+  0xf6c69a72a3989f5cULL, 0xb7dcbf5354e9beceULL, 0x88fcf317f22241e2ULL,
+  0xcc20ce9bd35c78a5ULL, 0x98165af37b2153dfULL, 0xe2a0b5dc971f303aULL,
+  0xa8d9d1535ce3b396ULL, 0xfb9b7cd9a4a7443cULL, 0xbb764c4ca7a44410ULL,
+  0x8bab8eefb6409c1aULL, 0xd01fef10a657842cULL, 0x9b10a4e5e9913129ULL,
+  0xe7109bfba19c0c9dULL, 0xac2820d9623bf429ULL, 0x80444b5e7aa7cf85ULL,
+  0xbf21e44003acdd2dULL, 0x8e679c2f5e44ff8fULL, 0xd433179d9c8cb841ULL,
+  0x9e19db92b4e31ba9ULL, 0xeb96bf6ebadf77d9ULL, 0xaf87023b9bf0ee6bULL,
+};
+static const int16_t stats_numfmt_pow10_e[] = {
+  -1220, -1193, -1166, -1140, -1113, -1087, -1060, -1034, -1007, -980,
+  -954, -927, -901, -874, -847, -821, -794, -768, -741, -715,
+  -688, -661, -635, -608, -582, -555, -529, -502, -475, -449,
+  -422, -396, -369, -343, -316, -289, -263, -236, -210, -183,
+  -157, -130, -103, -77, -50, -24, 3, 30, 56, 83,
+  109, 136, 162, 189, 216, 242, 269, 295, 322, 348,
+  375, 402, 428, 455, 481, 508, 534, 561, 588, 614,
+  641, 667, 694, 720, 747, 774, 800, 827, 853, 880,
+  907, 933, 960, 986, 1013, 1039, 1066,
+};
+
+static inline stats_diyfp_t
+stats_diyfp_mul(stats_diyfp_t x, stats_diyfp_t y) {
+  stats_diyfp_t r;
+#ifdef __SIZEOF_INT128__
+  unsigned __int128 p = (unsigned __int128)x.f * y.f;
+  r.f = (uint64_t)(p >> 64);
+  if((uint64_t)p & (1ULL << 63)) r.f++; /* round */
+#else
+  const uint64_t M32 = 0xFFFFFFFFULL;
+  uint64_t a = x.f >> 32, b = x.f & M32, c = y.f >> 32, d = y.f & M32;
+  uint64_t ac = a * c, bc = b * c, ad = a * d, bd = b * d;
+  uint64_t tmp = (bd >> 32) + (ad & M32) + (bc & M32);
+  tmp += 1U << 31; /* round */
+  r.f = ac + (ad >> 32) + (bc >> 32) + (tmp >> 32);
+#endif
+  r.e = x.e + y.e + 64;
+  return r;
+}
+
+static inline stats_diyfp_t
+stats_diyfp_normalize(stats_diyfp_t x) {
+  int shift = __builtin_clzll(x.f);
+  x.f <<= shift;
+  x.e -= shift;
+  return x;
+}
+
+static inline void
+stats_numfmt_grisu_round(char *buf, int len, uint64_t delta, uint64_t rest,
+                         uint64_t ten_kappa, uint64_t wp_w) {
+  while(rest < wp_w && delta - rest >= ten_kappa &&
+        (rest + ten_kappa < wp_w || wp_w - rest > rest + ten_kappa - wp_w)) {
+    buf[len - 1]--;
+    rest += ten_kappa;
+  }
+}
+
+/* *sure is cleared if, at a length short of the one returned, the
+ * interval widened by the error of the scaled boundaries (Grisu3's unsafe
+ * interval) could hold a shorter string. */
+static inline void
+stats_numfmt_digit_gen(stats_diyfp_t w, stats_diyfp_t mp, uint64_t delta,
+                       char *buf, int *len, int *k, int *sure) {
+  static const uint64_t pow10[] = {
+    1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL,
+    10000000ULL, 100000000ULL, 1000000000ULL, 10000000000ULL,
+    100000000000ULL, 1000000000000ULL, 10000000000000ULL,
+    100000000000000ULL, 1000000000000000ULL, 10000000000000000ULL,
+    100000000000000000ULL, 1000000000000000000ULL, 10000000000000000000ULL
+  };
+  const int shift = -mp.e;
+  const uint64_t one = 1ULL << shift, wp_w = mp.f - w.f;
+  uint32_t p1 = (uint32_t)(mp.f >> shift);
+  uint64_t p2 = mp.f & (one - 1), unit = 1;
+  int kappa = 1;
+  while(kappa < 10 && p1 >= pow10[kappa]) kappa++;
+  *len = 0;
+
+  while(kappa > 0) {
+    uint32_t d = p1 / (uint32_t)pow10[kappa - 1];
+    p1 %= (uint32_t)pow10[kappa - 1];
+    if(d || *len) buf[(*len)++] = '0' + (char)d;
+    kappa--;
+    uint64_t rest = ((uint64_t)p1 << shift) + p2;
+    if(rest <= delta) {
+      *k += kappa;
+      stats_numfmt_grisu_round(buf, *len, delta, rest, pow10[kappa] << shift, wp_w);
+      return;
+    }
+    if(rest <= delta + 2 || rest + 2 >= (pow10[kappa] << shift)) *sure = 0;
+  }
+  for(;;) {
+    p2 *= 10;
+    delta *= 10;
+    unit *= 10;
+    char d = (char)(p2 >> shift);
+    if(d || *len) buf[(*len)++] = '0' + d;
+    p2 &= one - 1;
+    kappa--;
+    if(p2 < delta) {
+      *k += kappa;
+      stats_numfmt_grisu_round(buf, *len, delta, p2, one,
+                               wp_w * (-kappa < 20 ? pow10[-kappa] : 0));
+      return;
+    }
+    if(p2 <= delta + 2 * unit || p2 + 2 * unit >= one) *sure = 0;
+  }
+}
+
+/* Fills buf with the digits of positive, finite d; d == digits * 10^k.
+ * *sure is cleared when a shorter string might also read back as d. */
+static inline int
+stats_numfmt_grisu2(double d, char *buf, int *k, int *sure) {
+  uint64_t u;
+  stats_diyfp_t v, plus, minus, c, w;
+  int biased_e, len, idx;
+  double dk;
+
+  memcpy(&u, &d, sizeof(u));
+  biased_e = (int)((u >> 52) & 0x7FF);
+  v.f = u & STATS_DP_SIGNIFICAND_MASK;
+  if(biased_e) {
+    v.f += STATS_DP_HIDDEN_BIT;
+    v.e = biased_e - 1075;
+  }
+  else v.e = -1074;
+
+  /* boundaries halfway to the neighbouring doubles */
+  plus.f = (v.f << 1) + 1;
+  plus.e = v.e - 1;
+  plus = stats_diyfp_normalize(plus);
+  if(v.f == STATS_DP_HIDDEN_BIT) {
+    minus.f = (v.f << 2) - 1;
+    minus.e = v.e - 2;
+  }
+  else {
+    minus.f = (v.f << 1) - 1;
+    minus.e = v.e - 1;
+  }
+  minus.f <<= minus.e - plus.e;
+  minus.e = plus.e;
+
+  /* a cached power of ten bringing the exponent into [-60, -32] */
+  dk = (-61 - plus.e) * 0.30102999566398114 + 347;
+  idx = (int)dk;
+  if(dk - idx > 0.0) idx++;
+  idx = (idx >> 3) + 1;
+  *k = -(-348 + (idx << 3));
+  c.f = stats_numfmt_pow10_f[idx];
+  c.e = stats_numfmt_pow10_e[idx];
+
+  w = stats_diyfp_mul(stats_diyfp_normalize(v), c);
+  plus = stats_diyfp_mul(plus, c);
+  minus = stats_diyfp_mul(minus, c);
+  minus.f++;
+  plus.f--;
+  *sure = 1;
+  stats_numfmt_digit_gen(w, plus, plus.f - minus.f, buf, &len, k, sure);
+  return len;
+}
+
+/* The shortest digits of positive, finite d, as stats_numfmt_grisu2 */
+static inline int
+stats_numfmt_shortest(double d, char *buf, int *k) {
+  char tmp[32], *e;
+  int len, sure, p, i;
+  len = stats_numfmt_grisu2(d, buf, k, &sure);
+  if(sure) return len;
+  for(p=1;p<len;p++) {
+    snprintf(tmp, sizeof(tmp), "%.*e", p - 1, d);
+    if(strtod(tmp, NULL) != d) continue;
+    /* d.ddde[+-]x */
+    buf[0] = tmp[0];
+    for(i=1;i<p;i++) buf[i] = tmp[i + 1];
+    e = strchr(tmp, 'e');
+    *k = atoi(e + 1) - (p - 1);
+    return p;
+  }
+  return len;
+}
+
+static inline size_t
+stats_fmt_exponent(char *out, int e) {
+  char *p = out;
+  *p++ = 'e';
+  if(e < 0) {
+    *p++ = '-';
+    e = -e;
+  }
+  else *p++ = '+';
+  if(e >= 100) {
+    *p++ = '0' + (char)(e / 100);
+    e %= 100;
+  }
+  memcpy(p, stats_numfmt_digits2 + e * 2, 2);
+  return p + 2 - out;
+}
+
+/* Lays digits out as plain decimals for exponents %g would also print that
+ * way, in scientific notation otherwise.  Integral values carry no ".0".
+ */
+static inline size_t
+stats_fmt_double(char *out, double d) {
+  char digits[20], *p = out;
+  int len, k, point, i;
+
+  if(d == 0) {
+    if(1 / d < 0) *p++ = '-';
+    *p++ = '0';
+    return p - out;
+  }
+  if(d < 0) {
+    *p++ = '-';
+    d = -d;
+  }
+  len = stats_numfmt_shortest(d, digits, &k);
+  point = len + k; /* position of the decimal point relative to digits */
+
+  if(k >= 0 && point <= 21) {
+    memcpy(p, digits, len);
+    memset(p + len, '0', k);
+    p += point;
+  }
+  else if(point > 0 && point <= 21) {
+    memcpy(p, digits, point);
+    p[point] = '.';
+    memcpy(p + point + 1, digits + point, len - point);
+    p += len + 1;
+  }
+  else if(point > -4 && point <= 0) {
+    *p++ = '0';
+    *p++ = '.';
+    for(i=point;i<0;i++) *p++ = '0';
+    memcpy(p, digits, len);
+    p += len;
+  }
+  else {
+    *p++ = digits[0];
+    if(len > 1) {
+      *p++ = '.';
+      memcpy(p, digits + 1, len - 1);
+      p += len - 1;
+    }
+    p += stats_fmt_exponent(p, point - 1);
+  }
+  return p - out;
+}
+
+#endif
@@ -0,0 +1,87 @@
+/* Compares full and delta tagged exports of a large recorder in which only
+ * a few handles change between exports: HANDLES counters spread over NS
+ * namespaces, CHANGED_PCT percent of them bumped before each export.  Also
+ * reports what the dirty stamp adds to a counter increment.
+ */
+#include "../stats_impl.c"
+
+#include <time.h>
+
+#define NS 300
+#define HANDLES 300000
+#define CHANGED_PCT 5
+#define EXPORTS 10
+#define INCRS 10000000
+
+static uint64_t nanos(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static ssize_t
+count_flush(void *cl, const struct iovec *iov, int iovcnt) {
+  ssize_t total = 0;
+  int i;
+  for(i=0;i<iovcnt;i++) total += iov[i].iov_len;
+  *(size_t *)cl += total;
+  return total;
+}
+
+static stats_handle_t *handles[HANDLES];
+
+static void
+churn(void) {
+  int i;
+  for(i=0;i<HANDLES * CHANGED_PCT / 100;i++)
+    stats_add64(handles[lrand48() % HANDLES], 1);
+}
+
+int main() {
+  stats_recorder_t *rec = stats_recorder_alloc();
+  stats_cursor_t *cursor = stats_cursor_alloc(0);
+  size_t bytes = 0;
+  stats_sink_t *sink = stats_sink_alloc(0, count_flush, &bytes);
+  uint64_t start, full, delta;
+  int i;
+
+  for(i=0;i<HANDLES;i++) {
+    char name[32];
+    stats_ns_t *ns;
+    snprintf(name, sizeof(name), "ns%d", i % NS);
+    ns = stats_register_ns(rec, NULL, name);
+    snprintf(name, sizeof(name), "counter%d", i);
+    handles[i] = stats_register(ns, name, STATS_TYPE_COUNTER);
+  }
+  /* the first delta export is a full one; it also populates name caches */
+  stats_recorder_output_json_tagged_delta_sink(rec, false, cursor, sink);
+
+  bytes = 0;
+  full = 0;
+  for(i=0;i<EXPORTS;i++) {
+    churn();
+    start = nanos();
+    stats_recorder_output_json_tagged_sink(rec, false, sink);
+    full += nanos() - start;
+  }
+  printf("%d handles, %d%% changed per export\n", HANDLES, CHANGED_PCT);
+  printf("  full   %8.2f ms/export %10zu bytes/export\n",
+         (double)full / EXPORTS / 1e6, bytes / EXPORTS);
+
+  stats_recorder_output_json_tagged_delta_sink(rec, false, cursor, sink);
+  bytes = 0;
+  delta = 0;
+  for(i=0;i<EXPORTS;i++) {
+    churn();
+    start = nanos();
+    stats_recorder_output_json_tagged_delta_sink(rec, false, cursor, sink);
+    delta += nanos() - start;
+  }
+  printf("  delta  %8.2f ms/export %10zu bytes/export\n",
+         (double)delta / EXPORTS / 1e6, bytes / EXPORTS);
+
+  start = nanos();
+  for(i=0;i<INCRS;i++) stats_add64(handles[i & 1023], 1);
+  printf("  stats_add64 with dirty stamp: %.2f ns/op\n", (double)(nanos() - start) / INCRS);
+  return 0;
+}
@@ -0,0 +1,148 @@
+/* Measures the cost of a tagged export over a tree of namespaces, DEPTH
+ * levels deep with TAGS tags on each level and HANDLES counters in each
+ * namespace.  Heap allocations are counted by interposing malloc so that
+ * per-node allocation regressions in the walkers show up as numbers.  Then
+ * does the same for HISTS histograms through each exporter.
+ */
+#include "../stats_impl.c"
+
+#include <time.h>
+
+#define DEPTH 5
+#define TAGS 10
+#define HANDLES 20
+#define EXPORTS 200
+#define HISTS 10000
+#define HIST_EXPORTS 20
+
+extern void *__libc_malloc(size_t);
+extern void *__libc_calloc(size_t, size_t);
+extern void *__libc_realloc(void *, size_t);
+extern void __libc_free(void *);
+
+static uint64_t nallocs;
+void *malloc(size_t len) { ck_pr_inc_64(&nallocs); return __libc_malloc(len); }
+void *calloc(size_t n, size_t len) { ck_pr_inc_64(&nallocs); return __libc_calloc(n, len); }
+void *realloc(void *p, size_t len) { ck_pr_inc_64(&nallocs); return __libc_realloc(p, len); }
+
+static uint64_t nanos(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t nfrees;
+void free(void *p) { if(p) ck_pr_inc_64(&nfrees); __libc_free(p); }
+
+static uint64_t ncalls;
+static ssize_t
+count_out(void *cl, const char *buf, size_t len) {
+  (void)buf;
+  ncalls++;
+  *(size_t *)cl += len;
+  return len;
+}
+
+static bool
+count_capture(void *cl, const char *name, stats_type_t type, void *addr) {
+  (void)name; (void)type; (void)addr;
+  ++*(int *)cl;
+  return true;
+}
+
+typedef void (*export_f)(stats_recorder_t *);
+static void export_json(stats_recorder_t *rec) {
+  size_t bytes = 0;
+  stats_recorder_output_json(rec, false, false, count_out, &bytes);
+}
+static void export_tagged(stats_recorder_t *rec) {
+  size_t bytes = 0;
+  stats_recorder_output_json_tagged(rec, false, count_out, &bytes);
+}
+static void export_prometheus(stats_recorder_t *rec) {
+  size_t bytes = 0;
+  stats_recorder_output_prometheus(rec, count_out, &bytes);
+}
+static void export_capture(stats_recorder_t *rec) {
+  int n = 0;
+  stats_recorder_capture(rec, false, count_capture, &n);
+}
+
+static void
+hist_exports(stats_recorder_t *rec, const char *label, export_f f) {
+  uint64_t start, elapsed, allocs, frees;
+  int i;
+  /* the first export may populate caches and this thread's scratch */
+  f(rec);
+  allocs = ck_pr_load_64(&nallocs);
+  frees = ck_pr_load_64(&nfrees);
+  start = nanos();
+  for(i=0;i<HIST_EXPORTS;i++) f(rec);
+  elapsed = nanos() - start;
+  allocs = ck_pr_load_64(&nallocs) - allocs;
+  frees = ck_pr_load_64(&nfrees) - frees;
+  printf("  %-10s %8.2f ms/export, %9.2f allocations/export, %9.2f frees/export\n", label,
+         (double)elapsed / HIST_EXPORTS / 1e6, (double)allocs / HIST_EXPORTS,
+         (double)frees / HIST_EXPORTS);
+}
+
+int main() {
+  stats_recorder_t *rec = stats_recorder_alloc();
+  stats_ns_t *ns = stats_recorder_global_ns(rec);
+  int d, i, nodes = 0;
+  size_t bytes = 0;
+  uint64_t start, elapsed, allocs;
+
+  for(d=0;d<DEPTH;d++) {
+    char name[32], tagval[32];
+    snprintf(name, sizeof(name), "level%d", d);
+    ns = stats_register_ns(rec, ns, name);
+    nodes++;
+    for(i=0;i<TAGS;i++) {
+      char tagcat[32];
+      snprintf(tagcat, sizeof(tagcat), "l%dt%d", d, i);
+      snprintf(tagval, sizeof(tagval), "value%d", i);
+      stats_ns_add_tag(ns, tagcat, tagval);
+    }
+    for(i=0;i<HANDLES;i++) {
+      snprintf(name, sizeof(name), "counter%d", i);
+      stats_add64(stats_register(ns, name, STATS_TYPE_COUNTER), i);
+      nodes++;
+    }
+  }
+
+  /* the first export may populate caches */
+  stats_recorder_output_json_tagged(rec, false, count_out, &bytes);
+  bytes = 0;
+  ncalls = 0;
+  allocs = ck_pr_load_64(&nallocs);
+  start = nanos();
+  for(i=0;i<EXPORTS;i++)
+    stats_recorder_output_json_tagged(rec, false, count_out, &bytes);
+  elapsed = nanos() - start;
+  allocs = ck_pr_load_64(&nallocs) - allocs;
+
+  printf("tagged export: %d nodes, %d levels x %d tags, %zu bytes\n",
+         nodes, DEPTH, TAGS, bytes / EXPORTS);
+  printf("  %.1f us/export, %.2f allocations/export, %.3f allocations/node\n",
+         (double)elapsed / EXPORTS / 1000.0, (double)allocs / EXPORTS,
+         (double)allocs / EXPORTS / nodes);
+  printf("  %.1f outf calls/export\n", (double)ncalls / EXPORTS);
+
+  rec = stats_recorder_alloc();
+  ns = stats_register_ns(rec, NULL, "hists");
+  for(i=0;i<HISTS;i++) {
+    char name[32];
+    stats_handle_t *h;
+    int j;
+    snprintf(name, sizeof(name), "latency%d", i);
+    h = stats_register(ns, name, STATS_TYPE_HISTOGRAM);
+    for(j=0;j<20;j++) stats_set_hist_intscale(h, lrand48() % 100000, -6, 1);
+  }
+  printf("%d histograms\n", HISTS);
+  hist_exports(rec, "json", export_json);
+  hist_exports(rec, "tagged", export_tagged);
+  hist_exports(rec, "prometheus", export_prometheus);
+  hist_exports(rec, "capture", export_capture);
+  return 0;
+}
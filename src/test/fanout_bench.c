@@ -0,0 +1,92 @@
+/* Measures how well fan-out slot selection tracks the CPU a thread is
+ * actually running on.  Every round each thread pins itself to a distinct
+ * CPU (a rotation of the previous round) and then selects a slot; threads
+ * landing on the same slot while sitting on different CPUs are collisions.
+ *
+ * "cached" is the historical selector: sched_getcpu() once per thread.
+ * "current" is __get_fanout() as built into the library.
+ */
+#include "../stats_impl.c"
+
+#include <time.h>
+
+#define ROUNDS 64
+#define MAX_THREADS 256
+#define TIMING_CALLS 10000000
+
+static int ncpu, nthreads;
+static pthread_barrier_t barrier;
+static unsigned int slots_cached[ROUNDS][MAX_THREADS];
+static unsigned int slots_current[ROUNDS][MAX_THREADS];
+
+static __thread int cached_cpu = -1;
+static unsigned int cached_get_fanout(unsigned int fanout) {
+  if(cached_cpu < 0) cached_cpu = sched_getcpu();
+  return cached_cpu % fanout;
+}
+
+static uint64_t nanos(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void *migrator(void *cl) {
+  int id = (int)(intptr_t)cl, r, i;
+  for(r=0;r<ROUNDS;r++) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET((id + r) % ncpu, &set);
+    sched_setaffinity(0, sizeof(set), &set);
+    sched_yield();
+    /* Burn through the refresh interval the way a busy thread would. */
+    for(i=0;i<CPU_REFRESH_INTERVAL;i++) (void)__get_fanout(ncpu);
+    slots_cached[r][id] = cached_get_fanout(ncpu);
+    slots_current[r][id] = __get_fanout(ncpu);
+    pthread_barrier_wait(&barrier);
+  }
+  return NULL;
+}
+
+static int collisions(unsigned int *slots) {
+  int i, j, cnt = 0;
+  for(i=0;i<nthreads;i++) {
+    for(j=0;j<nthreads;j++) {
+      if(i != j && slots[i] == slots[j]) { cnt++; break; }
+    }
+  }
+  return cnt;
+}
+
+int main() {
+  pthread_t tids[MAX_THREADS];
+  int i, r, total_cached = 0, total_current = 0;
+  uint64_t start, sink = 0;
+
+  ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+  nthreads = ncpu > MAX_THREADS ? MAX_THREADS : ncpu;
+  pthread_barrier_init(&barrier, NULL, nthreads);
+  for(i=0;i<nthreads;i++)
+    pthread_create(&tids[i], NULL, migrator, (void *)(intptr_t)i);
+  for(i=0;i<nthreads;i++)
+    pthread_join(tids[i], NULL);
+
+  for(r=0;r<ROUNDS;r++) {
+    total_cached += collisions(slots_cached[r]);
+    total_current += collisions(slots_current[r]);
+  }
+  printf("%d threads on %d cpus, %d migrations each\n", nthreads, ncpu, ROUNDS);
+  printf("colliding threads per round: cached %.2f, current %.2f\n",
+         (double)total_cached / ROUNDS, (double)total_current / ROUNDS);
+
+  start = nanos();
+  for(i=0;i<TIMING_CALLS;i++) sink += cached_get_fanout(ncpu);
+  printf("cached selector:  %.2f ns/call\n", (double)(nanos() - start) / TIMING_CALLS);
+  start = nanos();
+  for(i=0;i<TIMING_CALLS;i++) sink += __get_fanout(ncpu);
+  printf("current selector: %.2f ns/call\n", (double)(nanos() - start) / TIMING_CALLS);
+#ifdef CM_USE_RSEQ
+  printf("rseq: %s\n", circmetrics_rseq_cpu ? "yes" : "no");
+#endif
+  return sink == 0xffffffff;
+}
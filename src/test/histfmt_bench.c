@@ -0,0 +1,84 @@
+/* Compares export payloads for the two histogram formats on a latency-like
+ * workload: HISTS histograms, each fed SAMPLES log-normally distributed
+ * latencies (median 2ms, spanning several decades), exported through both
+ * JSON writers as "H[x]=n" bucket strings and as base64 circllhist.
+ */
+#include "../stats_impl.c"
+
+#include <time.h>
+
+#define HISTS 40
+#define SAMPLES 100000
+#define EXPORTS 100
+
+static uint64_t nanos(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static ssize_t
+count_flush(void *cl, const struct iovec *iov, int iovcnt) {
+  ssize_t total = 0;
+  int i;
+  for(i=0;i<iovcnt;i++) total += iov[i].iov_len;
+  *(size_t *)cl += total;
+  return total;
+}
+
+static double
+lognormal(double median, double sigma) {
+  double u1 = (lrand48() + 1.0) / 2147483649.0, u2 = lrand48() / 2147483648.0;
+  return median * exp(sigma * sqrt(-2.0 * log(u1)) * cos(2 * M_PI * u2));
+}
+
+static void
+run(stats_recorder_t *rec, const char *label, bool tagged) {
+  size_t bytes = 0;
+  stats_sink_t *sink = stats_sink_alloc(0, count_flush, &bytes);
+  uint64_t start;
+  int i;
+  start = nanos();
+  for(i=0;i<EXPORTS;i++) {
+    if(tagged) stats_recorder_output_json_tagged_sink(rec, false, sink);
+    else stats_recorder_output_json_sink(rec, false, false, sink);
+  }
+  start = nanos() - start;
+  printf("  %-16s %8zu bytes/export %7.0f bytes/histogram %8.1f us/export\n",
+         label, bytes / EXPORTS, (double)bytes / EXPORTS / HISTS,
+         (double)start / EXPORTS / 1000.0);
+  stats_sink_free(sink);
+}
+
+int main() {
+  stats_recorder_t *rec = stats_recorder_alloc();
+  stats_handle_t *hists[HISTS];
+  stats_ns_t *ns = stats_register_ns(rec, NULL, "http");
+  int i, j;
+  size_t buckets = 0;
+
+  stats_ns_add_tag(ns, "service", "api");
+  for(i=0;i<HISTS;i++) {
+    char name[32];
+    stats_handle_t *h;
+    snprintf(name, sizeof(name), "endpoint%d_latency", i);
+    h = stats_register(ns, name, STATS_TYPE_HISTOGRAM);
+    stats_handle_add_tag(h, "units", "seconds");
+    for(j=0;j<SAMPLES;j++) stats_set_hist(h, lognormal(0.002, 1.0), 1);
+    hists[i] = h;
+  }
+  for(i=0;i<HISTS;i++) {
+    histogram_t *merged = stats_handle_hist_merge(hists[i], false);
+    buckets += hist_bucket_count(merged);
+    stats_hist_scratch_done(merged);
+  }
+
+  printf("%d histograms x %d samples, %.0f buckets/histogram\n",
+         HISTS, SAMPLES, (double)buckets / HISTS);
+  run(rec, "json buckets", false);
+  run(rec, "tagged buckets", true);
+  stats_recorder_set_hist_format(rec, STATS_HIST_FORMAT_B64);
+  run(rec, "json b64", false);
+  run(rec, "tagged b64", true);
+  return 0;
+}
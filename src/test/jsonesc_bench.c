@@ -0,0 +1,48 @@
+/* JSON string encoding throughput under each string scanner the CPU
+ * supports, for metric-name sized strings and for long string values.
+ */
+#include "../stats_impl.c"
+
+#include <time.h>
+
+#define BYTES (256 * 1024 * 1024)
+
+static uint64_t nanos(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static ssize_t
+discard(void *cl, const struct iovec *iov, int iovcnt) {
+  ssize_t total = 0;
+  int i;
+  for(i=0;i<iovcnt;i++) total += iov[i].iov_len;
+  return total;
+}
+
+int main() {
+  static const char *names[] = { "", "scalar", "sse2", "avx2" };
+  static const size_t lens[] = { 48, 4096 };
+  static char str[4096];
+  stats_sink_t *sink = stats_sink_alloc(0, discard, NULL);
+  int isa, max_isa = json_escape_probe(), l;
+  size_t i;
+
+  for(i=0;i<sizeof(str);i++) str[i] = 'a' + i % 26;
+  /* one escape per kilobyte, like a path or a quoted word */
+  for(i=512;i<sizeof(str);i+=1024) str[i] = '"';
+  for(l=0;l<2;l++) {
+    printf("%zu byte strings\n", lens[l]);
+    for(isa=JSON_ESCAPE_SCALAR;isa<=max_isa;isa++) {
+      uint64_t start, n = BYTES / lens[l];
+      ck_pr_store_int(&json_escape_isa, isa);
+      start = nanos();
+      for(i=0;i<n;i++) yajl_string_encode(sink, str, lens[l]);
+      printf("  %-7s %7.0f MB/s\n", names[isa],
+             (double)BYTES / ((double)(nanos() - start) / 1e9) / 1e6);
+    }
+  }
+  stats_sink_free(sink);
+  return 0;
+}
@@ -0,0 +1,88 @@
+/* Fuzzes yajl_string_encode under every string scanner the CPU supports
+ * against the original byte-at-a-time encoder.
+ */
+#include "../stats_impl.c"
+
+#define Tassert assert
+#define ROUNDS 50000
+
+static size_t
+reference_encode(char *out, const unsigned char *str, size_t len) {
+  static const char *hexchar = "0123456789ABCDEF";
+  size_t i, o = 0;
+  for(i=0;i<len;i++) {
+    switch(str[i]) {
+      case '\r': memcpy(out + o, "\\r", 2); o += 2; break;
+      case '\n': memcpy(out + o, "\\n", 2); o += 2; break;
+      case '\\': memcpy(out + o, "\\\\", 2); o += 2; break;
+      case '"': memcpy(out + o, "\\\"", 2); o += 2; break;
+      case '\f': memcpy(out + o, "\\f", 2); o += 2; break;
+      case '\b': memcpy(out + o, "\\b", 2); o += 2; break;
+      case '\t': memcpy(out + o, "\\t", 2); o += 2; break;
+      default:
+        if(str[i] < 32) {
+          memcpy(out + o, "\\u00", 4);
+          out[o + 4] = hexchar[str[i] >> 4];
+          out[o + 5] = hexchar[str[i] & 0xf];
+          o += 6;
+        }
+        else out[o++] = str[i];
+    }
+  }
+  return o;
+}
+
+struct membuf {
+  char buf[8192];
+  size_t len;
+};
+static ssize_t
+flush_mem(void *cl, const struct iovec *iov, int iovcnt) {
+  struct membuf *mb = cl;
+  ssize_t total = 0;
+  int i;
+  for(i=0;i<iovcnt;i++) {
+    memcpy(mb->buf + mb->len, iov[i].iov_base, iov[i].iov_len);
+    mb->len += iov[i].iov_len;
+    total += iov[i].iov_len;
+  }
+  return total;
+}
+
+int main() {
+  static unsigned char input[1024 + 64];
+  static char expect[6 * sizeof(input)];
+  static struct membuf got;
+  static const char *names[] = { "", "scalar", "sse2", "avx2" };
+  stats_sink_t *sink = stats_sink_alloc(0, flush_mem, &got);
+  int isa, max_isa = json_escape_probe(), r;
+
+  for(isa=JSON_ESCAPE_SCALAR;isa<=max_isa;isa++) {
+    ck_pr_store_int(&json_escape_isa, isa);
+    srand48(isa);
+    for(r=0;r<ROUNDS;r++) {
+      /* random lengths and alignments, escapes from none to dense */
+      size_t len = lrand48() % 1024, align = lrand48() % 64, i, explen;
+      int density = 1 + lrand48() % 256;
+      unsigned char *s = input + align;
+      for(i=0;i<len;i++) {
+        s[i] = 0x20 + lrand48() % 0xe0;
+        if(lrand48() % density == 0) {
+          static const unsigned char specials[] = { '"', '\\', 0, 0x1f, '\n', 0x7f, 0x80, 0xff };
+          s[i] = lrand48() % 2 ? specials[lrand48() % sizeof(specials)] : lrand48() % 0x20;
+        }
+      }
+      explen = reference_encode(expect, s, len);
+      got.len = 0;
+      Tassert(yajl_string_encode(sink, (const char *)s, len) == (ssize_t)explen);
+      Tassert(stats_sink_flush(sink));
+      if(got.len != explen || memcmp(got.buf, expect, explen)) {
+        fprintf(stderr, "%s: mismatch on a %zu byte string\n", names[isa], len);
+        Tassert(false);
+      }
+    }
+    printf("jsonesc %s ok\n", names[isa]);
+  }
+  stats_sink_free(sink);
+  return 0;
+}
@@ -0,0 +1,73 @@
+/* Scaling of the stats_register hit path: threads looking up names that
+ * already exist in one shared namespace, as code that registers where it
+ * records does.  Run with 1, 2, 4, ... threads up to the number of online
+ * CPUs (at least 4), and again with each lookup inside the namespace's
+ * read lock, as it was taken before lookups became lock-free.
+ */
+#include "../stats_impl.c"
+
+#include <time.h>
+#include <unistd.h>
+
+#define NAMES 1024
+#define LOOKUPS 2000000
+
+static stats_ns_t *shared;
+static char names[NAMES][32];
+static bool locked;
+
+static uint64_t nanos(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void *
+lookups(void *unused) {
+  uint32_t j = (uintptr_t)pthread_self();
+  int i;
+  for(i=0;i<LOOKUPS;i++) {
+    j = j * 1103515245 + 12345;
+    /* the read lock that each lookup used to take around its probe */
+    if(locked) pthread_rwlock_rdlock(&shared->lock);
+    stats_add64(stats_register(shared, names[(j >> 16) % NAMES], STATS_TYPE_COUNTER), 1);
+    if(locked) pthread_rwlock_unlock(&shared->lock);
+  }
+  return NULL;
+}
+
+static void
+run(int threads) {
+  pthread_t tids[threads];
+  uint64_t start = nanos();
+  int i;
+  for(i=0;i<threads;i++) pthread_create(&tids[i], NULL, lookups, NULL);
+  for(i=0;i<threads;i++) pthread_join(tids[i], NULL);
+  start = nanos() - start;
+  /* with linear scaling, each thread's time per lookup stays flat */
+  printf("  %-9s %3d threads %7.1f ns/lookup/thread, %8.2f M lookups/s\n",
+         locked ? "rdlock" : "lock-free", threads, (double)start / LOOKUPS,
+         (double)threads * LOOKUPS / start * 1e3);
+}
+
+int main() {
+  stats_recorder_t *rec = stats_recorder_alloc();
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int i, threads;
+
+  shared = stats_register_ns(rec, NULL, "shared");
+  for(i=0;i<NAMES;i++) {
+    snprintf(names[i], sizeof(names[i]), "handle%d", i);
+    stats_register(shared, names[i], STATS_TYPE_COUNTER);
+  }
+  if(cpus < 4) cpus = 4;
+  printf("%d names, %d lookups per thread, %ld online CPUs\n", NAMES, LOOKUPS,
+         sysconf(_SC_NPROCESSORS_ONLN));
+  for(threads=1;threads<=cpus;threads*=2) {
+    locked = false;
+    run(threads);
+    locked = true;
+    run(threads);
+  }
+  return 0;
+}
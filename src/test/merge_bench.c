@@ -0,0 +1,104 @@
+/* Cost of merging one histogram handle's fan slots at export, for a wide
+ * fan (128 slots) of which only some, up to all, were written since the
+ * last export.  Each pass refills the written slots outside the timed
+ * region, then times a since-last merge (as an exporter with
+ * hist_since_last does), a cumulative one (as the Prometheus exporter
+ * does) and, for reference, a cumulative merge that accumulates each slot
+ * on its own.
+ */
+#include "../stats_impl.c"
+
+#include <time.h>
+
+#define FANOUT 128
+#define HANDLES 64
+#define PASSES 200
+#define BINS 40
+
+static uint64_t nanos(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void
+fill(stats_handle_t *h, int active) {
+  int i, b;
+  for(i=0;i<active;i++) {
+    /* spread the written slots across the fan */
+    int slot = i * (FANOUT / active);
+    for(b=0;b<BINS;b++)
+      hist_insert_intscale(h->u.agg.fan[slot].cpu.hist, 100 + b * 37 + i, -6, 1);
+    /* what a writer leaves behind after adding to the slot */
+    ck_pr_store_64(&h->u.agg.fan[slot].cpu.incr, 1);
+  }
+}
+
+/* starts each run from empty, unmarked slots */
+static void
+reset(stats_handle_t *h) {
+  int i;
+  for(i=0;i<FANOUT;i++) {
+    hist_clear(h->u.agg.fan[i].cpu.hist);
+    ck_pr_store_64(&h->u.agg.fan[i].cpu.incr, 0);
+  }
+  hist_clear(h->u.agg.hist_aggr);
+}
+
+/* the cumulative merge, one accumulate per slot under that slot's lock */
+static histogram_t *
+merge_per_slot(stats_handle_t *h) {
+  histogram_t *copy = stats_hist_scratch(hist_bucket_count(h->u.agg.hist_aggr));
+  int i;
+  for(i=0;i<h->u.agg.fanout;i++) {
+    if(ck_pr_load_64(&h->u.agg.fan[i].cpu.incr) == 0) continue;
+    pthread_mutex_lock(&h->u.agg.fan[i].cpu.mutex);
+    hist_accumulate(copy, (const histogram_t * const *)&h->u.agg.fan[i].cpu.hist, 1);
+    pthread_mutex_unlock(&h->u.agg.fan[i].cpu.mutex);
+  }
+  hist_accumulate(copy, (const histogram_t * const *)&h->u.agg.hist_aggr, 1);
+  return copy;
+}
+
+enum mode { SINCE_LAST, CUMULATIVE, PER_SLOT };
+static const char *mode_names[] = { "since-last", "cumulative", "per-slot" };
+
+static void
+run(stats_handle_t **hs, int active, enum mode mode) {
+  uint64_t spent = 0, samples = 0, start;
+  int p, i;
+  for(i=0;i<HANDLES;i++) reset(hs[i]);
+  for(p=0;p<PASSES;p++) {
+    for(i=0;i<HANDLES;i++) fill(hs[i], active);
+    start = nanos();
+    for(i=0;i<HANDLES;i++) {
+      histogram_t *copy = mode == PER_SLOT ? merge_per_slot(hs[i]) :
+                          stats_handle_hist_merge(hs[i], mode == SINCE_LAST);
+      samples += hist_sample_count(copy);
+      stats_hist_scratch_done(copy);
+    }
+    spent += nanos() - start;
+  }
+  printf("  %3d/%d slots written  %-10s %8.0f ns/merge  (%llu samples)\n",
+         active, FANOUT, mode_names[mode],
+         (double)spent / (PASSES * HANDLES), (unsigned long long)samples);
+}
+
+int main() {
+  stats_recorder_t *rec = stats_recorder_alloc();
+  stats_ns_t *ns = stats_register_ns(rec, NULL, "merge");
+  stats_handle_t *hs[HANDLES];
+  int actives[] = { 0, 1, 8, 32, FANOUT };
+  int i, a;
+
+  for(i=0;i<HANDLES;i++) {
+    char name[32];
+    snprintf(name, sizeof(name), "lat%d", i);
+    hs[i] = stats_register_fanout(ns, name, STATS_TYPE_HISTOGRAM_FAST, FANOUT);
+  }
+  printf("%d handles, %d bins per written slot, %d passes\n", HANDLES, BINS, PASSES);
+  for(a=0;a<5;a++) run(hs, actives[a], SINCE_LAST);
+  for(a=0;a<5;a++) run(hs, actives[a], CUMULATIVE);
+  for(a=0;a<5;a++) run(hs, actives[a], PER_SLOT);
+  return 0;
+}
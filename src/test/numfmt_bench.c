@@ -0,0 +1,55 @@
+/* Compares the exporters' number formatting against the snprintf calls it
+ * replaced, in ns per value.
+ */
+#include "../stats_impl.c"
+
+#include <time.h>
+
+#define VALUES 4096
+#define ROUNDS 500
+
+static uint64_t nanos(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t u64s[VALUES];
+static int64_t i64s[VALUES];
+static double doubles[VALUES];
+static hist_bucket_t buckets[VALUES];
+
+#define TIME(label, expr) do { \
+  uint64_t start = nanos(), sink = 0; \
+  int r, i; \
+  for(r=0;r<ROUNDS;r++) for(i=0;i<VALUES;i++) sink += (expr); \
+  printf("  %-10s %6.1f ns/value\n", label, \
+         (double)(nanos() - start) / ROUNDS / VALUES + (sink == 0 ? 0 : 0)); \
+} while(0)
+
+int main() {
+  char buf[64];
+  int i;
+  for(i=0;i<VALUES;i++) {
+    u64s[i] = ((uint64_t)lrand48() << 31 | lrand48()) >> (i % 48);
+    i64s[i] = (int64_t)u64s[i] * (i & 1 ? -1 : 1);
+    doubles[i] = (double)(lrand48() % 1000000) / 1000.0;
+    buckets[i] = double_to_hist_bucket(doubles[i] * pow(10, i % 10 - 5));
+  }
+  printf("uint64\n");
+  TIME("snprintf", snprintf(buf, sizeof(buf), "%" PRIu64, u64s[i]));
+  TIME("numfmt", stats_fmt_u64(buf, u64s[i]));
+  printf("int64\n");
+  TIME("snprintf", snprintf(buf, sizeof(buf), "%" PRId64, i64s[i]));
+  TIME("numfmt", stats_fmt_i64(buf, i64s[i]));
+  printf("double (%%g, 6 digits, lossy)\n");
+  TIME("snprintf", snprintf(buf, sizeof(buf), "%g", doubles[i]));
+  printf("double (%%.17g, round-trips)\n");
+  TIME("snprintf", snprintf(buf, sizeof(buf), "%.17g", doubles[i]));
+  printf("double (shortest, round-trips)\n");
+  TIME("numfmt", stats_fmt_double(buf, doubles[i]));
+  printf("histogram bucket\n");
+  TIME("snprintf", snprintf(buf, sizeof(buf), "%0.2g", hist_bucket_to_double(buckets[i])));
+  TIME("numfmt", stats_fmt_hist_bucket(buf, buckets[i]));
+  return 0;
+}
@@ -0,0 +1,119 @@
+/* Property tests for the exporters' number formatting: integers match
+ * printf, doubles read back bit-for-bit and are the shortest string that
+ * does, histogram buckets match "%0.2g".
+ */
+#include "../stats_impl.c"
+
+#include <float.h>
+
+#define Tassert assert
+#define RANDOM_DOUBLES 200000
+
+static uint64_t
+rand64(void) {
+  return ((uint64_t)mrand48() << 32) ^ (uint32_t)mrand48();
+}
+
+static int shortest_len(double d) {
+  char buf[64];
+  int p;
+  for(p=1;p<17;p++) {
+    snprintf(buf, sizeof(buf), "%.*g", p, d);
+    if(strtod(buf, NULL) == d) break;
+  }
+  return p;
+}
+
+static int longer = 0, unsure = 0;
+
+static void
+check_double(double d) {
+  char buf[STATS_NUMFMT_MAX + 1], *end;
+  size_t len = stats_fmt_double(buf, d);
+  double back;
+  int digits = 1;
+  Tassert(len <= STATS_NUMFMT_MAX);
+  buf[len] = '\0';
+  back = strtod(buf, &end);
+  if(*end || memcmp(&back, &d, sizeof(d))) {
+    fprintf(stderr, "%.17g formatted as %s reads back as %.17g\n", d, buf, back);
+    Tassert(false);
+  }
+  if(d != 0) {
+    char dbuf[20];
+    int k, sure;
+    stats_numfmt_grisu2(fabs(d), dbuf, &k, &sure);
+    if(!sure) unsure++;
+    digits = stats_numfmt_shortest(fabs(d), dbuf, &k);
+  }
+  if(digits > shortest_len(d)) longer++;
+}
+
+static void
+check_int(int64_t i, uint64_t u) {
+  char mine[STATS_NUMFMT_MAX + 1], ref[32];
+  size_t len = stats_fmt_i64(mine, i);
+  mine[len] = '\0';
+  snprintf(ref, sizeof(ref), "%" PRId64, i);
+  Tassert(!strcmp(mine, ref));
+  len = stats_fmt_u64(mine, u);
+  mine[len] = '\0';
+  snprintf(ref, sizeof(ref), "%" PRIu64, u);
+  Tassert(!strcmp(mine, ref));
+}
+
+int main() {
+  static const double edges[] = {
+    1, -1, 0.1, 0.5, 1.5, 12.5, 1e-5, 1.234e-5, 0.0001, 123456789012345678.0,
+    1e21, 1e22, 1e23, 5e-324, 2.2250738585072009e-308, DBL_MIN, DBL_MAX,
+    DBL_EPSILON, 9007199254740993.0, 0.30000000000000004, 4.35, 2.5e-7,
+    1.7976931348623157e308, 4.940656458412465e-324
+  };
+  int i, val, exp;
+
+  for(i=0;i<(int)(sizeof(edges)/sizeof(*edges));i++) {
+    check_double(edges[i]);
+    check_double(-edges[i]);
+  }
+  for(i=-1074;i<1024;i++) check_double(ldexp(1, i));
+  for(i=-323;i<309;i++) check_double(pow(10, i));
+  for(i=0;i<RANDOM_DOUBLES;i++) {
+    uint64_t bits = rand64();
+    double d;
+    memcpy(&d, &bits, sizeof(d));
+    if(isnan(d) || isinf(d)) continue;
+    check_double(d);
+    /* and something that looks like a measurement */
+    check_double((double)(mrand48() % 100000) / 1000.0);
+  }
+  /* the fallback is for the rare doubles (1e23) Grisu2 may not get shortest */
+  printf("doubles: %d of %d longer than shortest, %d checked by strtod\n",
+         longer, 2 * RANDOM_DOUBLES, unsure);
+  Tassert(longer == 0);
+
+  check_int(0, 0);
+  check_int(INT64_MIN, UINT64_MAX);
+  check_int(INT64_MAX, (uint64_t)INT64_MAX + 1);
+  for(i=0;i<1000000;i++) {
+    uint64_t u = rand64() >> (i % 64);
+    check_int((int64_t)u * ((i & 1) ? -1 : 1), u);
+  }
+
+  for(val=-99;val<=99;val++) {
+    for(exp=-128;exp<=127;exp++) {
+      hist_bucket_t hb = { val, exp };
+      char mine[STATS_NUMFMT_MAX + 1], ref[64];
+      size_t len;
+      if(val > -10 && val < 10 && val != 0) continue;
+      len = stats_fmt_hist_bucket(mine, hb);
+      mine[len] = '\0';
+      snprintf(ref, sizeof(ref), "%0.2g", hist_bucket_to_double(hb));
+      if(strcmp(mine, ref)) {
+        fprintf(stderr, "bucket (%d,%d): %s != %s\n", val, exp, mine, ref);
+        Tassert(false);
+      }
+    }
+  }
+  printf("numfmt ok\n");
+  return 0;
+}
@@ -0,0 +1,58 @@
+/* Scaling of parallel snapshot collection: HISTS histograms spread over NS
+ * namespaces, each recorded into from several fan slots, snapshotted with
+ * 1, 2, 4, ... threads up to the number of online CPUs (at least 4).
+ */
+#include "../stats_impl.c"
+
+#include <unistd.h>
+
+#define NS 100
+#define HISTS 100000
+#define COUNTERS 100000
+#define SAMPLES 20
+#define ROUNDS 3
+
+int main() {
+  stats_recorder_t *rec = stats_recorder_alloc();
+  stats_ns_t *nss[NS];
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  uint64_t serial = 0;
+  int i, j, threads;
+
+  for(i=0;i<NS;i++) {
+    char name[32];
+    snprintf(name, sizeof(name), "ns%d", i);
+    nss[i] = stats_register_ns(rec, NULL, name);
+  }
+  for(i=0;i<HISTS;i++) {
+    char name[32];
+    stats_handle_t *h;
+    snprintf(name, sizeof(name), "latency%d", i);
+    h = stats_register(nss[i % NS], name, STATS_TYPE_HISTOGRAM);
+    /* spread the samples over the fan slots, as concurrent writers would */
+    for(j=0;j<SAMPLES;j++)
+      hist_insert_intscale(h->u.agg.fan[j % h->u.agg.fanout].cpu.hist, lrand48() % 100000, -6, 1);
+  }
+  for(i=0;i<COUNTERS;i++) {
+    char name[32];
+    snprintf(name, sizeof(name), "counter%d", i);
+    stats_add64(stats_register(nss[i % NS], name, STATS_TYPE_COUNTER), i);
+  }
+  if(cpus < 4) cpus = 4;
+  printf("%d histograms, %d counters, %ld online CPUs\n", HISTS, COUNTERS,
+         sysconf(_SC_NPROCESSORS_ONLN));
+  for(threads=1;threads<=cpus;threads*=2) {
+    uint64_t create = 0, locked = 0;
+    for(i=0;i<ROUNDS;i++) {
+      stats_snapshot_t *snap = stats_recorder_snapshot_parallel(rec, false, threads);
+      create += stats_snapshot_create_ns(snap);
+      locked += stats_snapshot_lock_ns(snap);
+      stats_snapshot_free(snap);
+    }
+    if(threads == 1) serial = create;
+    printf("  %3d threads %9.2f ms/snapshot, locks held %9.2f ms, %5.2fx\n",
+           threads, create / ROUNDS / 1e6, locked / ROUNDS / 1e6,
+           (double)serial / create);
+  }
+  return 0;
+}
@@ -0,0 +1,210 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <assert.h>
+#include <pthread.h>
+#include <string.h>
+#include <errno.h>
+#include <strings.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "circmetrics_config.h"
+#include "cm_stats_api.h"
+#include "cm_publish_api.h"
+#if defined(HAVE_ZLIB_H) && defined(HAVE_LIBZ)
+#include <zlib.h>
+#define TEST_GZIP 1
+#endif
+
+#define Tassert assert
+
+/* A stand-in HTTP endpoint: it fails the first request with a 503, answers
+ * the second with a chunked body and asks to close the connection after the
+ * fourth, so retries, response framing and reconnects are all exercised.
+ */
+static int listen_fd;
+static int connections, requests, accepted, gzipped, authed;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int
+read_request(int fd, char *buf, size_t size, char **body, size_t *body_len) {
+  size_t len = 0, clen = 0;
+  char *eoh, *cl;
+  while((eoh = memmem(buf, len, "\r\n\r\n", 4)) == NULL) {
+    ssize_t rv = read(fd, buf + len, size - len - 1);
+    if(rv <= 0) return -1;
+    len += rv;
+  }
+  *eoh = '\0';
+  if((cl = strcasestr(buf, "content-length:")) != NULL) clen = strtoul(cl + 15, NULL, 10);
+  if(eoh + 4 + clen > buf + size) return -1;
+  while(len < (size_t)(eoh + 4 - buf) + clen) {
+    ssize_t rv = read(fd, buf + len, size - len);
+    if(rv <= 0) return -1;
+    len += rv;
+  }
+  *body = eoh + 4;
+  *body_len = clen;
+  return 0;
+}
+
+static bool
+document_ok(const char *buf, char *body, size_t len) {
+  static char plain[1 << 20];
+  size_t plain_len = len;
+  if(strcasestr(buf, "content-encoding: gzip")) {
+#ifdef TEST_GZIP
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if(inflateInit2(&zs, 15 + 32) != Z_OK) return false;
+    zs.next_in = (unsigned char *)body;
+    zs.avail_in = len;
+    zs.next_out = (unsigned char *)plain;
+    zs.avail_out = sizeof(plain) - 1;
+    if(inflate(&zs, Z_FINISH) != Z_STREAM_END) return false;
+    plain_len = zs.total_out;
+    inflateEnd(&zs);
+    pthread_mutex_lock(&lock);
+    gzipped++;
+    pthread_mutex_unlock(&lock);
+#else
+    return false;
+#endif
+  }
+  else {
+    memcpy(plain, body, len);
+  }
+  plain[plain_len] = '\0';
+  return plain[0] == '{' && strstr(plain, "\"pushed|ST[app:publish]\"") != NULL;
+}
+
+static void *
+server(void *unused) {
+  static char buf[1 << 20];
+  while(1) {
+    int fd = accept(listen_fd, NULL, NULL);
+    if(fd < 0) {
+      if(errno == EINTR) continue;
+      break;
+    }
+    pthread_mutex_lock(&lock);
+    connections++;
+    pthread_mutex_unlock(&lock);
+    while(1) {
+      char *body;
+      size_t body_len;
+      const char *resp;
+      int n;
+      if(read_request(fd, buf, sizeof(buf), &body, &body_len) < 0) break;
+      Tassert(!strncmp(buf, "PUT /module/httptrap/uuid/secret HTTP/1.1\r\n", 43));
+      Tassert(document_ok(buf, body, body_len));
+      pthread_mutex_lock(&lock);
+      n = ++requests;
+      if(strstr(buf, "\r\nX-Circonus-Auth-Token: sekrit\r\n")) authed++;
+      if(n > 1) accepted++;
+      pthread_mutex_unlock(&lock);
+      if(n == 1) resp = "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 5\r\n\r\nbusy\n";
+      else if(n == 2) resp = "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n"
+                             "3\r\nok\n\r\n0\r\n\r\n";
+      else if(n == 4) resp = "HTTP/1.1 200 OK\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+      else resp = "HTTP/1.1 200 OK\r\nContent-Length: 3\r\n\r\nok\n";
+      if(write(fd, resp, strlen(resp)) < 0) break;
+      if(n == 4) break;
+    }
+    close(fd);
+  }
+  return NULL;
+}
+
+static int
+listen_local(void) {
+  struct sockaddr_in sin;
+  socklen_t slen = sizeof(sin);
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+  Tassert(listen_fd >= 0);
+  Tassert(bind(listen_fd, (struct sockaddr *)&sin, sizeof(sin)) == 0);
+  Tassert(listen(listen_fd, 8) == 0);
+  Tassert(getsockname(listen_fd, (struct sockaddr *)&sin, &slen) == 0);
+  return ntohs(sin.sin_port);
+}
+
+static int
+count(int *v) {
+  int rv;
+  pthread_mutex_lock(&lock);
+  rv = *v;
+  pthread_mutex_unlock(&lock);
+  return rv;
+}
+
+static double
+now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main() {
+  stats_recorder_t *rec = stats_recorder_alloc();
+  stats_ns_t *ns = stats_register_ns(rec, NULL, "publish");
+  stats_handle_t *pushed = stats_register(ns, "pushed", STATS_TYPE_COUNTER);
+  stats_publisher_t *pub;
+  pthread_t tid;
+  char url[128];
+  double start;
+  int port = listen_local();
+
+  stats_ns_add_tag(ns, "app", "publish");
+  stats_add64(pushed, 1);
+  pthread_create(&tid, NULL, server, NULL);
+
+  pub = stats_publisher_alloc(rec);
+  Tassert(pub != NULL);
+  Tassert(!stats_publisher_set_period(pub, 0));
+  Tassert(!stats_publisher_set_apiurl(pub, "https://127.0.0.1/"));
+  Tassert(!stats_publisher_set_apiurl(pub, "http://:80/"));
+  Tassert(!stats_publisher_set_apitoken(pub, "bad\r\nHeader: injected"));
+  Tassert(stats_publisher_set_period(pub, 20));
+  Tassert(stats_publisher_set_apitoken(pub, "sekrit"));
+  snprintf(url, sizeof(url), "http://127.0.0.1:%d/module/httptrap/uuid/secret", port);
+  Tassert(stats_publisher_set_apiurl(pub, url));
+
+  /* the 503 is retried on the same connection, the chunked answer keeps it
+   * open, and "Connection: close" forces exactly one reconnect */
+  start = now();
+  while(count(&accepted) < 6 && now() - start < 10) {
+    stats_add64(pushed, 1);
+    usleep(1000);
+  }
+  stats_publisher_free(pub);
+  Tassert(count(&accepted) >= 6);
+  Tassert(count(&requests) == count(&accepted) + 1);
+  Tassert(count(&connections) == 2);
+  Tassert(count(&authed) == count(&requests));
+#ifdef TEST_GZIP
+  Tassert(count(&gzipped) == count(&requests));
+#endif
+
+  /* with nothing listening, pushes keep failing and backing off, but
+   * freeing the publisher does not wait for that to play out */
+  shutdown(listen_fd, SHUT_RDWR);
+  pthread_join(tid, NULL);
+  close(listen_fd);
+  pub = stats_publisher_alloc(rec);
+  snprintf(url, sizeof(url), "http://127.0.0.1:%d/", listen_local());
+  close(listen_fd);
+  Tassert(stats_publisher_set_period(pub, 10));
+  Tassert(stats_publisher_set_apiurl(pub, url));
+  usleep(150000);
+  start = now();
+  stats_publisher_free(pub);
+  Tassert(now() - start < 0.5);
+
+  printf("publish: %d requests over %d connections\n", requests, connections);
+  return 0;
+}
@@ -0,0 +1,106 @@
+/* Measures how long a slow exporter holds up registration: a writer thread
+ * keeps registering new top-level namespaces (which needs the root
+ * namespace's write lock) while the tagged JSON is exported to a sink that
+ * stalls SLOW_US on every flush, once straight from the recorder and once
+ * from a snapshot taken just before.
+ */
+#include "../stats_impl.c"
+
+#include <time.h>
+#include <unistd.h>
+
+#define NS 50
+#define HANDLES 20000
+#define HISTS 200
+#define EXPORTS 5
+#define SLOW_US 200
+
+static stats_recorder_t *rec;
+static stats_ns_t *nss[NS];
+static volatile int stop;
+static uint64_t worst_register;
+
+static uint64_t nanos(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static ssize_t
+slow_flush(void *cl, const struct iovec *iov, int iovcnt) {
+  ssize_t total = 0;
+  int i;
+  for(i=0;i<iovcnt;i++) total += iov[i].iov_len;
+  usleep(SLOW_US);
+  return total;
+}
+
+static void *
+registrar(void *unused) {
+  int i = 0;
+  while(!stop) {
+    char name[32];
+    uint64_t start = nanos(), took;
+    snprintf(name, sizeof(name), "late%d", i);
+    stats_register_ns(rec, NULL, name);
+    i++;
+    took = nanos() - start;
+    if(took > worst_register) worst_register = took;
+    usleep(100);
+  }
+  return NULL;
+}
+
+int main() {
+  stats_sink_t *sink = stats_sink_alloc(16384, slow_flush, NULL);
+  uint64_t start, export, create = 0, locked = 0;
+  pthread_t tid;
+  int i, j;
+
+  rec = stats_recorder_alloc();
+  for(i=0;i<NS;i++) {
+    char name[32];
+    snprintf(name, sizeof(name), "ns%d", i);
+    nss[i] = stats_register_ns(rec, NULL, name);
+    stats_ns_add_tag(nss[i], "shard", name);
+  }
+  for(i=0;i<HANDLES;i++) {
+    char name[32];
+    snprintf(name, sizeof(name), "counter%d", i);
+    stats_add64(stats_register(nss[i % NS], name, STATS_TYPE_COUNTER), i);
+  }
+  for(i=0;i<HISTS;i++) {
+    char name[32];
+    stats_handle_t *h;
+    snprintf(name, sizeof(name), "latency%d", i);
+    h = stats_register(nss[i % NS], name, STATS_TYPE_HISTOGRAM);
+    for(j=0;j<1000;j++) stats_set_hist_intscale(h, lrand48() % 100000, -6, 1);
+  }
+  printf("%d counters and %d histograms in %d namespaces, %dus per flush\n",
+         HANDLES, HISTS, NS, SLOW_US);
+
+  pthread_create(&tid, NULL, registrar, NULL);
+  start = nanos();
+  for(i=0;i<EXPORTS;i++) stats_recorder_output_json_tagged_sink(rec, false, sink);
+  export = nanos() - start;
+  printf("  direct   %8.2f ms/export, worst stats_register_ns %6.2f ms\n",
+         export / EXPORTS / 1e6, worst_register / 1e6);
+
+  worst_register = 0;
+  start = nanos();
+  for(i=0;i<EXPORTS;i++) {
+    stats_snapshot_t *snap = stats_recorder_snapshot(rec, false);
+    create += stats_snapshot_create_ns(snap);
+    locked += stats_snapshot_lock_ns(snap);
+    stats_snapshot_output_json_tagged_sink(snap, sink);
+    stats_snapshot_free(snap);
+  }
+  export = nanos() - start;
+  printf("  snapshot %8.2f ms/export, worst stats_register_ns %6.2f ms"
+         " (snapshot %.2f ms, locks held %.2f ms)\n",
+         export / EXPORTS / 1e6, worst_register / 1e6,
+         create / EXPORTS / 1e6, locked / EXPORTS / 1e6);
+  stop = 1;
+  pthread_join(tid, NULL);
+  return 0;
+}
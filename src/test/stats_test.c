@@ -3,6 +3,9 @@
 #include <unistd.h>
 #include <assert.h>
 #include <pthread.h>
+#include <string.h>
+#include <time.h>
+#include <circllhist.h>
 #include "cm_stats_api.h"
 
 #define Tassert assert
@@ -10,6 +13,8 @@
 int64_t global_42 = 42;
 char *foo = NULL;
 stats_handle_t *hist = NULL;
+stats_handle_t *hist_lf = NULL;
+stats_handle_t *hist_ring = NULL;
 stats_handle_t *mtadd = NULL;
 
 void cbtest(stats_handle_t *h, void *vptr, void *c) {
@@ -21,6 +26,37 @@ void cbtest(stats_handle_t *h, void *vptr, void *c) {
 
 stats_handle_t *h_dbl;
 
+void cbcount(stats_handle_t *h, void *vptr, void *closure) {
+  **(int64_t **)vptr = ++*(int *)closure;
+}
+/* records one sample per refresh */
+void cbsummary(stats_handle_t *h, void *vptr, void *closure) {
+  ++*(int *)closure;
+  stats_set_d(h, 1);
+}
+/* deregisters every dN in the closure's namespace, its own handle too */
+void cbdereg(stats_handle_t *h, void *vptr, void *closure) {
+  int i;
+  for(i=0;i<8;i++) {
+    char name[32];
+    snprintf(name, sizeof(name), "d%d", i);
+    stats_deregister(closure, name);
+  }
+}
+void nscount(stats_ns_t *ns, void *closure) {
+  ++*(int *)closure;
+}
+/* takes closure ms, then reports it */
+void cbslow(stats_handle_t *h, void *vptr, void *closure) {
+  usleep((intptr_t)closure * 1000);
+  **(int64_t **)vptr = (intptr_t)closure;
+}
+static int64_t ms_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
 void register_globals(stats_ns_t *ns) {
   stats_handle_t *h;
   h = stats_register(ns, "global_42", STATS_TYPE_INT64);
@@ -49,6 +85,100 @@ void *latency_m(void *cl) {
   stats_add32(mtadd, 1);
   while(true) {
     stats_set_hist_intscale(hist, lrand48()%10 + 10, -2+i, 1);
+    stats_set_hist_intscale(hist_lf, lrand48()%10 + 10, -2+i, 1);
+    stats_set_hist_intscale(hist_ring, lrand48()%10 + 10, -2+i, 1);
+  }
+  return NULL;
+}
+void *wide_fill(void *h) {
+  int i;
+  for(i=0;i<1000;i++) stats_set_hist_intscale(h, i, -3, 1);
+  return NULL;
+}
+struct hist_count {
+  const char *prefix;
+  uint64_t samples;
+};
+bool count_hist(void *cl, const char *name, stats_type_t type, void *addr) {
+  struct hist_count *hc = cl;
+  if(type != STATS_TYPE_HISTOGRAM || strncmp(name, hc->prefix, strlen(hc->prefix))) return false;
+  hc->samples += hist_sample_count((histogram_t *)addr);
+  return true;
+}
+struct summary_check {
+  uint64_t count;
+  double sum, min, max;
+  int seen;
+};
+bool check_summary(void *cl, const char *name, stats_type_t type, void *addr) {
+  struct summary_check *sc = cl;
+  if(strncmp(name, "qdepth_", 7)) return false;
+  sc->seen++;
+  if(!strncmp(name, "qdepth_count|", 13)) sc->count = *(uint64_t *)addr;
+  else if(!strncmp(name, "qdepth_sum|", 11)) sc->sum = *(double *)addr;
+  else if(!strncmp(name, "qdepth_min|", 11)) sc->min = *(double *)addr;
+  else if(!strncmp(name, "qdepth_max|", 11)) sc->max = *(double *)addr;
+  return true;
+}
+bool decode_b64(void *cl, const char *name, stats_type_t type, void *addr) {
+  if(type != STATS_TYPE_STRING || strncmp(name, "lat|", 4)) return false;
+  return hist_deserialize_b64((histogram_t *)cl, addr, strlen(addr)) > 0;
+}
+bool find_name(void *cl, const char *name, stats_type_t type, void *addr) {
+  if(strcmp(name, (const char *)cl)) return false;
+  return true;
+}
+struct membuf {
+  char buf[65536];
+  size_t len;
+  int calls;
+};
+ssize_t
+write_mem(void *cl, const char *buf, size_t len) {
+  struct membuf *mb = cl;
+  mb->calls++;
+  if(len > 7) len = 7; /* exercise short writes */
+  if(mb->len + len > sizeof(mb->buf)) return -1;
+  memcpy(mb->buf + mb->len, buf, len);
+  mb->len += len;
+  return len;
+}
+ssize_t
+flush_mem(void *cl, const struct iovec *iov, int iovcnt) {
+  struct membuf *mb = cl;
+  ssize_t total = 0;
+  int i;
+  mb->calls++;
+  for(i=0;i<iovcnt;i++) {
+    if(mb->len + iov[i].iov_len > sizeof(mb->buf)) return -1;
+    memcpy(mb->buf + mb->len, iov[i].iov_base, iov[i].iov_len);
+    mb->len += iov[i].iov_len;
+    total += iov[i].iov_len;
+  }
+  return total;
+}
+void *churn(void *cl) {
+  stats_ns_t *ns = cl;
+  int i;
+  for(i=0;i<2000;i++) {
+    char name[32];
+    snprintf(name, sizeof(name), "conn%d", i % 16);
+    stats_ns_t *conn = stats_register_ns(NULL, ns, name);
+    stats_handle_t *h = stats_register(conn, "bytes", STATS_TYPE_COUNTER);
+    stats_add64(h, i);
+    stats_set_hist(stats_register(conn, "rtt", STATS_TYPE_HISTOGRAM), i, 1);
+    if(i % 3 == 0) stats_deregister(conn, "bytes");
+    else stats_deregister_ns(NULL, ns, name);
+  }
+  return NULL;
+}
+void *grow(void *cl) {
+  stats_ns_t *ns = cl;
+  int i;
+  for(i=0;i<512;i++) {
+    char name[32];
+    snprintf(name, sizeof(name), "grow%d", i);
+    stats_register(ns, name, STATS_TYPE_COUNTER);
   }
   return NULL;
 }
@@ -82,6 +212,436 @@ int main() {
   stats_set_hist(hist, 1.2, 1);
   stats_set_hist_intscale(hist, 1200, -6, 1);
 
+  hist_lf = stats_register(ns1, "latency_lf", STATS_TYPE_HISTOGRAM);
+  Tassert(stats_handle_hist_lockfree(hist_lf));
+  Tassert(!stats_handle_hist_lockfree(h_dbl));
+  int i, j;
+  for(i=0;i<1000;i++) stats_set_hist_intscale(hist_lf, i, -3, 1);
+  stats_set(hist_lf, STATS_TYPE_INT32, &val);
+  struct hist_count lf_count = { "latency_lf|", 0 };
+  stats_recorder_capture(rec, true, count_hist, &lf_count);
+  Tassert(lf_count.samples == 1001);
+
+  hist_ring = stats_register(ns1, "latency_ring", STATS_TYPE_HISTOGRAM);
+  Tassert(stats_handle_hist_ring(hist_ring));
+  for(i=0;i<5000;i++) stats_set_hist_intscale(hist_ring, i, -3, 1);
+  stats_set_hist(hist_ring, 1.5, 2);
+  struct hist_count ring_count = { "latency_ring|", 0 };
+  stats_recorder_capture(rec, true, count_hist, &ring_count);
+  Tassert(ring_count.samples == 5002);
+
+  /* a wide fan with only a few slots written */
+  stats_handle_t *wide = stats_register_fanout(ns1, "latency_wide", STATS_TYPE_HISTOGRAM_FAST, 128);
+  pthread_t fillers[4];
+  for(i=0;i<4;i++) pthread_create(&fillers[i], NULL, wide_fill, wide);
+  for(i=0;i<4;i++) pthread_join(fillers[i], NULL);
+  struct hist_count wide_count = { "latency_wide|", 0 };
+  stats_recorder_capture(rec, true, count_hist, &wide_count);
+  Tassert(wide_count.samples == 4000);
+  stats_set_hist(wide, 2.5, 5);
+  wide_count.samples = 0;
+  stats_recorder_capture(rec, true, count_hist, &wide_count);
+  Tassert(wide_count.samples == 5);
+  wide_count.samples = 0;
+  stats_recorder_capture(rec, true, count_hist, &wide_count);
+  Tassert(wide_count.samples == 0);
+  wide_fill(wide);
+  wide_count.samples = 0;
+  stats_recorder_capture(rec, false, count_hist, &wide_count);
+  Tassert(wide_count.samples == 5005);
+
+  stats_handle_t *qdepth = stats_register(ns1, "qdepth", STATS_TYPE_SUMMARY);
+  Tassert(qdepth != NULL);
+  Tassert(stats_observe(qdepth, STATS_TYPE_INT64, &global_42) == NULL);
+  stats_set_i64(qdepth, 3);
+  stats_set_u32(qdepth, 7);
+  stats_set_d(qdepth, 2.5);
+  struct summary_check sc = { 0 };
+  stats_recorder_capture(rec, false, check_summary, &sc);
+  Tassert(sc.seen == 5);
+  Tassert(sc.count == 3 && sc.sum == 12.5 && sc.min == 2.5 && sc.max == 7);
+
+  /* cached tagged names follow tag changes on the handle and its namespaces */
+  Tassert(stats_recorder_capture(rec, false, find_name, "latency|ST[app:ns1,units:seconds]") == 1);
+  stats_ns_replace_tag(ns1, "app", "ns1b");
+  Tassert(stats_recorder_capture(rec, false, find_name, "latency|ST[app:ns1,units:seconds]") == 0);
+  stats_handle_add_tag(hist, "region", "east");
+  Tassert(stats_recorder_capture(rec, false, find_name, "latency|ST[app:ns1b,region:east,units:seconds]") == 1);
+  stats_ns_replace_tag(ns1, "app", "ns1");
+  Tassert(stats_recorder_capture(rec, false, find_name, "qdepth_max|ST[app:ns1]") == 1);
+
+  /* the same document through the outf adapter and through a tiny sink */
+  static struct membuf via_outf, via_sink;
+  static char longstr[200];
+  char *longref = longstr;
+  stats_recorder_t *rec2 = stats_recorder_alloc();
+  stats_ns_t *ns2 = stats_register_ns(rec2, NULL, "sinktest");
+  stats_ns_add_tag(ns2, "app", "sink");
+  memset(longstr, 'x', sizeof(longstr) - 1);
+  stats_observe(stats_register(ns2, "long", STATS_TYPE_STRING), STATS_TYPE_STRING, &longref);
+  for(i=0;i<20;i++) {
+    char name[32];
+    snprintf(name, sizeof(name), "counter%d", i);
+    stats_add64(stats_register(ns2, name, STATS_TYPE_COUNTER), i);
+  }
+  stats_sink_t *sink = stats_sink_alloc(64, flush_mem, &via_sink);
+  Tassert(stats_recorder_output_json_tagged(rec2, false, write_mem, &via_outf) == (ssize_t)via_outf.len);
+  Tassert(stats_recorder_output_json_tagged_sink(rec2, false, sink) == (ssize_t)via_sink.len);
+  Tassert(via_outf.len == via_sink.len && !memcmp(via_outf.buf, via_sink.buf, via_sink.len));
+  Tassert(via_sink.calls > 1);
+  stats_sink_free(sink);
+
+  /* histograms as base64 circllhist round-trip through capture and json */
+  stats_handle_t *b64h = stats_register(ns2, "lat", STATS_TYPE_HISTOGRAM);
+  histogram_t *decoded = hist_alloc();
+  for(i=0;i<1000;i++) stats_set_hist_intscale(b64h, i, -3, 1);
+  stats_recorder_set_hist_format(rec2, STATS_HIST_FORMAT_B64);
+  Tassert(stats_recorder_capture(rec2, false, decode_b64, decoded) == 1);
+  Tassert(hist_sample_count(decoded) == 1000);
+  via_sink.len = 0;
+  sink = stats_sink_alloc(0, flush_mem, &via_sink);
+  Tassert(stats_recorder_output_json_sink(rec2, false, false, sink) > 0);
+  via_sink.buf[via_sink.len] = '\0';
+  Tassert(strstr(via_sink.buf, "\"lat\":{\"_type\":\"H\",\"_value\":\"") != NULL);
+  Tassert(strstr(via_sink.buf, "H[") == NULL);
+  stats_sink_free(sink);
+  hist_free(decoded);
+
+  /* prometheus: one family per name across namespaces, tags as labels */
+  stats_recorder_t *rec3 = stats_recorder_alloc();
+  stats_ns_t *nsa = stats_register_ns(rec3, NULL, "a");
+  stats_ns_t *nsb = stats_register_ns(rec3, NULL, "b");
+  stats_ns_add_tag(nsa, "app", "x\"y");
+  stats_ns_add_tag(nsb, "app", "b");
+  stats_add64(stats_register(nsa, "requests", STATS_TYPE_COUNTER), 3);
+  stats_handle_t *reqb = stats_register(nsb, "requests", STATS_TYPE_COUNTER);
+  stats_handle_add_tag(reqb, "app", "inner");
+  stats_add64(reqb, 4);
+  stats_handle_t *lat = stats_register(nsa, "lat", STATS_TYPE_HISTOGRAM);
+  stats_set_hist(lat, 1.2, 2);
+  stats_set_hist(lat, 5, 1);
+  stats_handle_t *qd = stats_register(nsb, "qd", STATS_TYPE_SUMMARY);
+  stats_set_d(qd, 2);
+  stats_set_d(qd, 4);
+  via_sink.len = 0;
+  sink = stats_sink_alloc(0, flush_mem, &via_sink);
+  Tassert(stats_recorder_output_prometheus_sink(rec3, sink) == (ssize_t)via_sink.len);
+  via_sink.buf[via_sink.len] = '\0';
+  const char *prom = via_sink.buf, *p;
+  Tassert((p = strstr(prom, "# TYPE requests counter\n")) != NULL);
+  Tassert(strstr(p + 1, "# TYPE requests") == NULL);
+  Tassert(strstr(prom, "requests{app=\"x\\\"y\"} 3\n"));
+  Tassert(strstr(prom, "requests{app=\"inner\"} 4\n"));
+  Tassert(strstr(prom, "# TYPE lat histogram\n"));
+  Tassert(strstr(prom, "lat_bucket{app=\"x\\\"y\",le=\"1.3\"} 2\n"));
+  Tassert(strstr(prom, "lat_bucket{app=\"x\\\"y\",le=\"5.1\"} 3\n"));
+  Tassert(strstr(prom, "lat_bucket{app=\"x\\\"y\",le=\"+Inf\"} 3\n"));
+  Tassert(strstr(prom, "lat_count{app=\"x\\\"y\"} 3\n"));
+  Tassert(strstr(prom, "# TYPE qd summary\nqd_sum{app=\"b\"} 6\nqd_count{app=\"b\"} 2\n"));
+  Tassert(strstr(prom, "# TYPE qd_max gauge\nqd_max{app=\"b\"} 4\n"));
+  stats_sink_free(sink);
+  /* a summary is folded once per scrape, so its series agree */
+  stats_recorder_t *rec3b = stats_recorder_alloc();
+  int qdcalls = 0;
+  stats_invoke(stats_register(stats_recorder_global_ns(rec3b), "qdcb", STATS_TYPE_SUMMARY),
+               cbsummary, &qdcalls);
+  via_outf.len = 0;
+  Tassert(stats_recorder_output_prometheus(rec3b, write_mem, &via_outf) > 0);
+  via_outf.buf[via_outf.len] = '\0';
+  Tassert(qdcalls == 1);
+  Tassert(strstr(via_outf.buf, "qdcb_count 1\n") && strstr(via_outf.buf, "qdcb_mean 1\n"));
+
+  /* a snapshot serializes exactly like the live recorder, and stays put */
+  stats_snapshot_t *snap = stats_recorder_snapshot(rec3, false);
+  Tassert(snap != NULL && stats_snapshot_count(snap) == 8);
+  Tassert(stats_snapshot_lock_ns(snap) <= stats_snapshot_create_ns(snap));
+  via_outf.len = via_sink.len = 0;
+  sink = stats_sink_alloc(0, flush_mem, &via_sink);
+  Tassert(stats_recorder_output_json_tagged(rec3, false, write_mem, &via_outf) > 0);
+  Tassert(stats_snapshot_output_json_tagged_sink(snap, sink) == (ssize_t)via_sink.len);
+  Tassert(via_outf.len == via_sink.len && !memcmp(via_outf.buf, via_sink.buf, via_sink.len));
+  stats_add64(reqb, 1);
+  stats_register(nsa, "late", STATS_TYPE_COUNTER);
+  via_outf.len = 0;
+  Tassert(stats_snapshot_output_json_tagged(snap, write_mem, &via_outf) == (ssize_t)via_sink.len);
+  Tassert(!memcmp(via_outf.buf, via_sink.buf, via_sink.len));
+  stats_snapshot_free(snap);
+  stats_sink_free(sink);
+  /* ... hierarchically too, and as Prometheus text */
+  stats_recorder_t *recs[] = { rec2, rec3 };
+  for(i=0;i<2;i++) {
+    for(j=0;j<2;j++) {
+      via_outf.len = via_sink.len = 0;
+      snap = stats_recorder_snapshot(recs[i], false);
+      Tassert(stats_recorder_output_json(recs[i], false, j, write_mem, &via_outf) > 0);
+      Tassert(stats_snapshot_output_json(snap, j, write_mem, &via_sink) == (ssize_t)via_sink.len);
+      Tassert(via_outf.len == via_sink.len && !memcmp(via_outf.buf, via_sink.buf, via_sink.len));
+      via_outf.len = via_sink.len = 0;
+      Tassert(stats_recorder_output_prometheus(recs[i], write_mem, &via_outf) > 0);
+      Tassert(stats_snapshot_output_prometheus(snap, write_mem, &via_sink) == (ssize_t)via_sink.len);
+      Tassert(via_outf.len == via_sink.len && !memcmp(via_outf.buf, via_sink.buf, via_sink.len));
+      stats_snapshot_free(snap);
+    }
+  }
+  snap = stats_recorder_snapshot(rec2, false);
+  decoded = hist_alloc();
+  Tassert(stats_snapshot_capture(snap, decode_b64, decoded) == 1);
+  Tassert(hist_sample_count(decoded) == 1000);
+  hist_free(decoded);
+  stats_snapshot_free(snap);
+
+  /* parallel collection stitches the same document back together */
+  stats_recorder_t *rec5 = stats_recorder_alloc();
+  for(i=0;i<300;i++) {
+    char name[32];
+    stats_ns_t *ns5;
+    snprintf(name, sizeof(name), "ns%d", i % 7);
+    ns5 = stats_register_ns(rec5, NULL, name);
+    snprintf(name, sizeof(name), "m%d", i);
+    if(i % 3) stats_add64(stats_register(ns5, name, STATS_TYPE_COUNTER), i);
+    else stats_set_hist_intscale(stats_register(ns5, name, STATS_TYPE_HISTOGRAM), i, -2, i);
+  }
+  snap = stats_recorder_snapshot(rec5, false);
+  via_outf.len = 0;
+  Tassert(stats_snapshot_output_json_tagged(snap, write_mem, &via_outf) > 0);
+  /* the helpers stay around between snapshots, and more join as asked */
+  int threads5[] = { 4, 2, 8 };
+  stats_snapshot_t *psnap;
+  for(i=0;i<3;i++) {
+    psnap = stats_recorder_snapshot_parallel(rec5, false, threads5[i]);
+    Tassert(psnap != NULL && stats_snapshot_count(psnap) == 300);
+    via_sink.len = 0;
+    Tassert(stats_snapshot_output_json_tagged(psnap, write_mem, &via_sink) == (ssize_t)via_outf.len);
+    Tassert(!memcmp(via_outf.buf, via_sink.buf, via_sink.len));
+    stats_snapshot_free(psnap);
+  }
+  stats_snapshot_free(snap);
+
+  /* delta exports carry only what changed since the cursor */
+  stats_recorder_t *rec4 = stats_recorder_alloc();
+  stats_ns_t *ns4 = stats_register_ns(rec4, NULL, "delta");
+  static int64_t observed = 1;
+  stats_handle_t *c1 = stats_register(ns4, "c1", STATS_TYPE_COUNTER);
+  stats_handle_t *c2 = stats_register(ns4, "c2", STATS_TYPE_COUNTER);
+  stats_observe(stats_register(ns4, "obs", STATS_TYPE_INT64), STATS_TYPE_INT64, &observed);
+  stats_cursor_t *cursor = stats_cursor_alloc(0), *refresh = stats_cursor_alloc(2);
+  sink = stats_sink_alloc(0, flush_mem, &via_sink);
+#define DELTA(cur) (via_sink.len = 0, \
+                    Tassert(stats_recorder_output_json_tagged_delta_sink(rec4, false, cur, sink) >= 0), \
+                    via_sink.buf[via_sink.len] = '\0', via_sink.buf)
+  Tassert(strstr(DELTA(cursor), "\"c1|ST[]\"") && strstr(via_sink.buf, "\"c2|ST[]\"") &&
+          strstr(via_sink.buf, "\"obs|ST[]\""));
+  Tassert(!strcmp(DELTA(refresh), via_sink.buf));
+  stats_add64(c1, 1);
+  Tassert(!strcmp(DELTA(cursor), "{\"c1|ST[]\":{\"_type\":\"L\",\"_value\":1}}"));
+  Tassert(!strcmp(DELTA(cursor), "{}"));
+  observed = 2;
+  Tassert(!strcmp(DELTA(cursor), "{\"obs|ST[]\":{\"_type\":\"l\",\"_value\":2}}"));
+  Tassert(!strcmp(DELTA(cursor), "{}"));
+  /* the second cursor saw neither change yet, then refreshes fully */
+  Tassert(strstr(DELTA(refresh), "\"c1|ST[]\"") && strstr(via_sink.buf, "\"obs|ST[]\"") &&
+          !strstr(via_sink.buf, "\"c2|ST[]\""));
+  Tassert(strstr(DELTA(refresh), "\"c2|ST[]\""));
+  stats_ns_add_tag(ns4, "app", "delta");
+  Tassert(strstr(DELTA(cursor), "\"c2|ST[app:delta]\"") && strstr(via_sink.buf, "\"c1|ST[app:delta]\""));
+  Tassert(!strcmp(DELTA(cursor), "{}"));
+  stats_add64(c2, 1);
+  Tassert(!strcmp(DELTA(cursor), "{\"c2|ST[app:delta]\":{\"_type\":\"L\",\"_value\":1}}"));
+#undef DELTA
+  stats_cursor_free(cursor);
+  stats_cursor_free(refresh);
+  stats_sink_free(sink);
+
+  /* deregistration unlinks at once and frees after the walkers move on */
+  stats_recorder_t *rec6 = stats_recorder_alloc();
+  stats_ns_t *ns6 = stats_register_ns(rec6, NULL, "conns");
+  stats_handle_t *gone = stats_register(ns6, "gone", STATS_TYPE_COUNTER);
+  stats_handle_t *ringed = stats_register(ns6, "ringed", STATS_TYPE_HISTOGRAM);
+  stats_handle_t *both = stats_register(ns6, "both", STATS_TYPE_INT64);
+  stats_add64(gone, 5);
+  stats_set_i64(both, 3);
+  stats_handle_hist_ring(ringed);
+  stats_set_hist(ringed, 1, 1); /* left in this thread's ring */
+  stats_set_i64(stats_register(stats_register_ns(NULL, ns6, "both"), "inner", STATS_TYPE_INT64), 7);
+  Tassert(stats_deregister(ns6, "gone"));
+  Tassert(!stats_deregister(ns6, "gone"));
+  Tassert(stats_deregister(ns6, "ringed"));
+  Tassert(!stats_deregister_ns(rec6, NULL, "missing"));
+  gone = stats_register(ns6, "gone", STATS_TYPE_INT64);
+  Tassert(gone != NULL && stats_handle_type(gone) == STATS_TYPE_INT64);
+  via_outf.len = 0;
+  Tassert(stats_recorder_output_json_tagged(rec6, false, write_mem, &via_outf) > 0);
+  via_outf.buf[via_outf.len] = '\0';
+  Tassert(strstr(via_outf.buf, "\"both|ST[]\":{\"_type\":\"l\",\"_value\":3}") &&
+          strstr(via_outf.buf, "\"inner|ST[]\"") && strstr(via_outf.buf, "\"gone|ST[]\"") &&
+          !strstr(via_outf.buf, "ringed"));
+  /* the handle goes first, then the namespace sharing its name */
+  Tassert(stats_deregister(ns6, "both"));
+  Tassert(stats_register_ns(NULL, ns6, "both") != NULL);
+  Tassert(stats_deregister_ns(NULL, ns6, "both"));
+  via_outf.len = 0;
+  Tassert(stats_recorder_output_json_tagged(rec6, false, write_mem, &via_outf) > 0);
+  via_outf.buf[via_outf.len] = '\0';
+  Tassert(!strcmp(via_outf.buf, "{\"gone|ST[]\":{\"_type\":\"l\",\"_value\":0}}"));
+  /* connections come and go while the recorder is exported */
+  pthread_t churner, grower;
+  pthread_create(&churner, NULL, churn, ns6);
+  pthread_create(&grower, NULL, grow, ns6);
+  for(i=0;i<50;i++) {
+    via_outf.len = 0;
+    Tassert(stats_recorder_output_prometheus(rec6, write_mem, &via_outf) >= 0);
+    Tassert(stats_recorder_output_json_tagged(rec6, false, write_mem, &via_outf) >= 0);
+    /* lookups race the map growing under them */
+    for(j=0;j<100;j++) Tassert(stats_register(ns6, "gone", STATS_TYPE_INT64) == gone);
+  }
+  pthread_join(churner, NULL);
+  pthread_join(grower, NULL);
+  for(i=0;i<512;i++) {
+    char name[32];
+    snprintf(name, sizeof(name), "grow%d", i);
+    Tassert(stats_deregister(ns6, name));
+  }
+  Tassert(stats_deregister_ns(rec6, NULL, "conns"));
+  via_outf.len = 0;
+  Tassert(stats_recorder_output_json_tagged(rec6, false, write_mem, &via_outf) == 2);
+
+  /* per-namespace policies: a cardinality cap and idle expiry */
+  stats_recorder_t *rec7 = stats_recorder_alloc();
+  stats_ns_t *tenants = stats_register_ns(rec7, NULL, "tenants");
+  stats_ns_set_max_handles(tenants, 3);
+  for(i=0;i<6;i++) {
+    char name[32];
+    snprintf(name, sizeof(name), "t%d", i);
+    stats_add64(stats_register(tenants, name, STATS_TYPE_COUNTER), 1);
+  }
+  Tassert(stats_register(tenants, "t4", STATS_TYPE_COUNTER) ==
+          stats_register(tenants, "_overflow", STATS_TYPE_COUNTER));
+  Tassert(stats_register(tenants, "t9", STATS_TYPE_INT64) == NULL);
+  via_outf.len = 0;
+  Tassert(stats_recorder_output_json_tagged(rec7, false, write_mem, &via_outf) > 0);
+  via_outf.buf[via_outf.len] = '\0';
+  Tassert(strstr(via_outf.buf, "\"tenants|ST[overflow:true]\":{\"_type\":\"L\",\"_value\":3}") &&
+          strstr(via_outf.buf, "\"t2|ST[]\"") && !strstr(via_outf.buf, "\"t3|ST[]\""));
+  Tassert(stats_deregister(tenants, "t0"));
+  Tassert(stats_register(tenants, "t3", STATS_TYPE_COUNTER) !=
+          stats_register(tenants, "_overflow", STATS_TYPE_COUNTER));
+  stats_ns_t *idlens = stats_register_ns(rec7, NULL, "idle");
+  stats_ns_set_ttl(idlens, 1);
+  stats_observe(stats_register(idlens, "watched", STATS_TYPE_INT64), STATS_TYPE_INT64, &global_42);
+  stats_handle_t *stale = stats_register(idlens, "stale", STATS_TYPE_COUNTER);
+  stats_handle_t *unused = stats_register(idlens, "unused", STATS_TYPE_COUNTER);
+  for(i=0;i<8;i++) {
+    stats_add64(stats_register(idlens, "busy", STATS_TYPE_COUNTER), 1);
+    /* a writer that kept the handle after it expired brings it back */
+    if(i == 5) stats_add64(stale, 1);
+    via_outf.len = 0;
+    Tassert(stats_recorder_output_json_tagged(rec7, false, write_mem, &via_outf) > 0);
+    via_outf.buf[via_outf.len] = '\0';
+    /* exported until a pass idle, and again the pass after the write */
+    Tassert((i < 2 || i == 6) == (strstr(via_outf.buf, "\"stale|ST[]\"") != NULL));
+    Tassert(i != 6 || strstr(via_outf.buf, "\"stale|ST[]\":{\"_type\":\"L\",\"_value\":1}"));
+    Tassert((i < 2) == (strstr(via_outf.buf, "\"unused|ST[]\"") != NULL));
+  }
+  Tassert(strstr(via_outf.buf, "\"busy|ST[]\":{\"_type\":\"L\",\"_value\":8}") &&
+          strstr(via_outf.buf, "\"watched|ST[]\""));
+  /* and registering an expired name again hands back the same handle */
+  Tassert(stats_register(idlens, "unused", STATS_TYPE_COUNTER) == unused);
+  Tassert(stats_register(idlens, "stale", STATS_TYPE_COUNTER) == stale);
+
+  /* families: one handle per label set, tagged with the labels */
+  stats_ns_t *http = stats_register_ns(rec7, NULL, "http");
+  stats_family_t *fam = stats_register_family(http, "requests", STATS_TYPE_COUNTER,
+                                              "method", "status", NULL);
+  Tassert(fam != NULL);
+  Tassert(stats_register_family(http, "requests", STATS_TYPE_COUNTER,
+                                "method", "status", NULL) == fam);
+  Tassert(stats_register_family(http, "requests", STATS_TYPE_COUNTER, "method", NULL) == NULL);
+  Tassert(stats_register_family(http, "requests", STATS_TYPE_INT64,
+                                "method", "status", NULL) == NULL);
+  stats_handle_t *get200 = stats_family_get(fam, "GET", "200");
+  Tassert(get200 != NULL && stats_family_get(fam, "GET", "200") == get200);
+  Tassert(stats_family_get(fam, "GET", "404") != get200);
+  Tassert(stats_family_get(fam, "a,b", "c") != stats_family_get(fam, "a", "b,c"));
+  stats_ns_set_max_handles(stats_register_ns(NULL, http, "requests"), 100);
+  for(i=0;i<100;i++) {
+    char status[8];
+    snprintf(status, sizeof(status), "%d", i);
+    stats_add64(stats_family_get(fam, "PUT", status), 1);
+  }
+  stats_add64(stats_family_get(fam, "GET", "200"), 2);
+  Tassert(!stats_deregister(stats_register_ns(NULL, http, "requests"), "GET,200"));
+  via_outf.len = 0;
+  Tassert(stats_recorder_output_json_tagged(rec7, false, write_mem, &via_outf) > 0);
+  via_outf.buf[via_outf.len] = '\0';
+  Tassert(strstr(via_outf.buf, "\"requests|ST[method:GET,status:200]\":{\"_type\":\"L\",\"_value\":2}") &&
+          strstr(via_outf.buf, "\"requests|ST[method:PUT,status:95]\"") &&
+          !strstr(via_outf.buf, "\"requests|ST[method:PUT,status:96]\"") &&
+          strstr(via_outf.buf, "\"requests|ST[overflow:true]\":{\"_type\":\"L\",\"_value\":4}"));
+  /* the overflow is one more series of the family */
+  via_outf.len = 0;
+  Tassert(stats_recorder_output_prometheus(rec7, write_mem, &via_outf) > 0);
+  via_outf.buf[via_outf.len] = '\0';
+  Tassert((p = strstr(via_outf.buf, "# TYPE requests counter\n")) != NULL &&
+          strstr(p, "requests{overflow=\"true\"} 4\n") && !strstr(p + 1, "# TYPE requests"));
+  Tassert(stats_deregister_ns(rec7, http, "requests"));
+
+  /* refresh callbacks: rate limited, and pooled under a time budget */
+  stats_recorder_t *rec8 = stats_recorder_alloc();
+  stats_ns_t *ns8 = stats_register_ns(rec8, NULL, "refresh");
+  stats_handle_t *limited = stats_register(ns8, "limited", STATS_TYPE_INT64);
+  int calls = 0, nscalls = 0;
+  Tassert(stats_invoke_interval(limited, cbcount, &calls, 60000));
+  Tassert(stats_ns_invoke_interval(ns8, nscount, &nscalls, 60000));
+  for(i=0;i<3;i++) {
+    via_outf.len = 0;
+    Tassert(stats_recorder_output_json_tagged(rec8, false, write_mem, &via_outf) > 0);
+  }
+  Tassert(calls == 1 && nscalls == 1);
+  Tassert(stats_invoke_interval(limited, cbcount, &calls, 0));
+  via_outf.len = 0;
+  Tassert(stats_recorder_output_json_tagged(rec8, false, write_mem, &via_outf) > 0);
+  via_outf.buf[via_outf.len] = '\0';
+  Tassert(calls == 2 && strstr(via_outf.buf, "\"limited|ST[]\":{\"_type\":\"l\",\"_value\":2}"));
+  stats_invoke(stats_register(ns8, "slow", STATS_TYPE_INT64), cbslow, (void *)300);
+  stats_invoke(stats_register(ns8, "slower", STATS_TYPE_INT64), cbslow, (void *)400);
+  stats_invoke(stats_register(ns8, "fast", STATS_TYPE_INT64), cbslow, (void *)1);
+  Tassert(stats_recorder_set_refresh(rec8, 3, 100));
+  int64_t took = ms_now();
+  via_outf.len = 0;
+  Tassert(stats_recorder_output_json_tagged(rec8, false, write_mem, &via_outf) > 0);
+  took = ms_now() - took;
+  via_outf.buf[via_outf.len] = '\0';
+  /* the budget runs out before the slow ones are done */
+  Tassert(took < 250 && strstr(via_outf.buf, "\"fast|ST[]\":{\"_type\":\"l\",\"_value\":1}") &&
+          strstr(via_outf.buf, "\"slow|ST[]\":{\"_type\":\"l\",\"_value\":0}"));
+  usleep(500000);
+  Tassert(stats_recorder_set_refresh(rec8, 3, 0));
+  took = ms_now();
+  via_outf.len = 0;
+  Tassert(stats_recorder_output_json_tagged(rec8, false, write_mem, &via_outf) > 0);
+  took = ms_now() - took;
+  via_outf.buf[via_outf.len] = '\0';
+  /* with no budget every callback is waited for, side by side */
+  Tassert(took >= 400 && took < 650 &&
+          strstr(via_outf.buf, "\"slow|ST[]\":{\"_type\":\"l\",\"_value\":300}") &&
+          strstr(via_outf.buf, "\"slower|ST[]\":{\"_type\":\"l\",\"_value\":400}"));
+  Tassert(calls == 4 && stats_deregister(ns8, "slower"));
+  /* a pool thread that frees handles still queued behind it carries on */
+  stats_recorder_t *rec8b = stats_recorder_alloc();
+  stats_ns_t *ns8b = stats_register_ns(rec8b, NULL, "dereg");
+  for(i=0;i<8;i++) {
+    char name[32];
+    snprintf(name, sizeof(name), "d%d", i);
+    stats_invoke(stats_register(ns8b, name, STATS_TYPE_INT64), cbdereg, ns8b);
+  }
+  Tassert(stats_recorder_set_refresh(rec8b, 1, 0));
+  for(i=0;i<3;i++) {
+    via_outf.len = 0;
+    Tassert(stats_recorder_output_json_tagged(rec8b, false, write_mem, &via_outf) > 0);
+  }
+  via_outf.buf[via_outf.len] = '\0';
+  Tassert(strstr(via_outf.buf, "d0") == NULL);
+
   start_thread();
 
   int cnt = 5;